@@ -1,7 +1,7 @@
 <F10># QMake Project file
 CONFIG += c++11
 
-QT = core gui widgets network
+QT = core gui widgets network concurrent
 CONFIG += console debug
 TEMPLATE = app
 TARGET = MidiTrain
@@ -12,14 +12,42 @@ include(../externals/QMidi/src/QMidi.pri)
 SOURCES += $$PWD/main.cpp \
 	$$PWD/mainwindow.cpp \
 	$$PWD/scorewidget.cpp \
+        $$PWD/scorerenderer.cpp \
+        $$PWD/scoreexporter.cpp \
         $$PWD/composition.cpp \
         $$PWD/playthread.cpp \
-        $$PWD/eventqueue.cpp
+        $$PWD/eventqueue.cpp \
+        $$PWD/compiledcomposition.cpp \
+        $$PWD/trace.cpp \
+        $$PWD/voicetable.cpp \
+        $$PWD/realtime.cpp \
+        $$PWD/midiinput.cpp \
+        $$PWD/oscserver.cpp \
+        $$PWD/metrics.cpp \
+        $$PWD/waiter.cpp \
+        $$PWD/schedulershard.cpp \
+        $$PWD/playhost.cpp \
+        $$PWD/syncpeer.cpp
 
 HEADERS += $$PWD/miditrain.h \
         $$PWD/mainwindow.h \
 	$$PWD/scorewidget.h \
+        $$PWD/scorerenderer.h \
+        $$PWD/scoreexporter.h \
         $$PWD/composition.h \
         $$PWD/playthread.h \
-        $$PWD/eventqueue.h
+        $$PWD/eventqueue.h \
+        $$PWD/compiledcomposition.h \
+        $$PWD/trace.h \
+        $$PWD/voicetable.h \
+        $$PWD/realtime.h \
+        $$PWD/mpmcqueue.h \
+        $$PWD/midiinput.h \
+        $$PWD/playclock.h \
+        $$PWD/oscserver.h \
+        $$PWD/metrics.h \
+        $$PWD/waiter.h \
+        $$PWD/schedulershard.h \
+        $$PWD/playhost.h \
+        $$PWD/syncpeer.h
 
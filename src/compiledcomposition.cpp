@@ -0,0 +1,345 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "compiledcomposition.h"
+#include "composition.h"
+#include "eventqueue.h"
+#include <QSaveFile>
+#include <QHash>
+#include <QSharedPointer>
+#include <cstring>
+
+/* Table-driven CRC-32 (IEEE 802.3), as used by zlib */
+static quint32
+crc32( const uchar* data, quint32 length ) {
+    static quint32 table[256];
+    static bool init =false;
+    if( !init ) {
+        for( quint32 i =0; i < 256; i++ ) {
+            quint32 c =i;
+            for( int k =0; k < 8; k++ )
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] =c;
+        }
+        init =true;
+    }
+    quint32 crc =0xffffffffu;
+    for( quint32 i =0; i < length; i++ )
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+/** Append @bytes from @data to @buffer, aligned to 8 bytes. Returns the offset of the data */
+static quint32
+appendTable( QByteArray& buffer, const void* data, int bytes ) {
+    while( buffer.size() % 8 ) buffer.append( '\0' );
+    quint32 offset =buffer.size();
+    if( bytes ) buffer.append( reinterpret_cast<const char*>( data ), bytes );
+    return offset;
+}
+
+/** Check that a table of @count records of @recordSize bytes at @offset fits within @size */
+static bool
+tableInBounds( quint32 offset, quint32 count, quint32 recordSize, qint64 size ) {
+    return offset % 8 == 0 && (qint64)offset + (qint64)count * recordSize <= size;
+}
+
+/* Class CompiledComposition implementation */
+
+CompiledComposition::CompiledComposition() : _data( nullptr ) { }
+CompiledComposition::~CompiledComposition() {
+    close();
+}
+
+bool
+CompiledComposition::save( const Composition* comp, const QString& path, QString* error ) {
+    // Flatten the composition exactly as the player would, so the queues can be stored as-is
+    EventQueue queue;
+    queue.initialize( comp );
+
+    QVector<TrackRecord> tracks;
+    QVector<SectionRecord> sections;
+    QVector<double> offsets;
+    QVector<TriggerRecord> triggers;
+    QVector<EventRecord> events;
+    QVector<QueuedRecord> queued;
+    QVector<IndexRecord> trackIndex, triggerIndex;
+
+    // Maps from objects in the model to their index in the flat tables
+    QHash<const Trigger*, qint32> triggerMap;
+    QHash<const Trigger::Event*, qint32> eventMap;
+    QHash<const Track::Section*, quint32> sectionMap;
+
+    for( const auto& trig : comp->triggers() ) {
+        TriggerRecord tr ={ trig.id(), (quint32)events.count(), (quint32)trig.events().count(), trig.hasStopEvent() };
+        triggerMap[&trig] =triggers.count();
+        triggerIndex.append( { trig.id(), (quint32)triggers.count() } );
+        triggers.append( tr );
+
+        for( const auto& e : trig.events() ) {
+            EventRecord er ={ e.type, e.midiDelay, e.midiDuration, e.target,
+                              e.midiEvent.type(), e.midiEvent.note(), e.midiEvent.voice(),
+                              e.midiEvent.velocity(), e.midiEvent.value(), e.midiEvent.number() };
+            eventMap[&e] =events.count();
+            events.append( er );
+        }
+    }
+
+    for( int i =0; i < comp->tracks().count(); i++ ) {
+        const Track& t =comp->tracks()[i];
+        const EventQueue::TrackQueue* tq =queue.tracks()[i];
+        TrackRecord tr;
+        std::memset( &tr, 0, sizeof( tr ) );
+        tr.tempo =t.tempo(); tr.lengthMsec =tq->length;
+        tr.id =t.id(); tr.channel =t.midiChannel(); tr.loop =t.loopCount(); tr.length =t.length();
+        tr.autoStart =t.autoStart();
+        tr.firstSection =sections.count(); tr.sectionCount =t.sections().count();
+        tr.firstOffset =offsets.count(); tr.offsetCount =t.axleOffsets().count();
+        tr.firstQueued =queued.count(); tr.queuedCount =tq->events.count();
+
+        for( const auto& sec : t.sections() ) {
+            sectionMap[&sec] =sections.count();
+            sections.append( { sec.offset, sec.trigger, sec.transpose } );
+        }
+        for( double o : t.axleOffsets() )
+            offsets.append( o );
+
+        for( const auto& e : tq->events ) {
+            QueuedRecord qr ={ e.timestamp, e.type,
+                               e.section ? sectionMap.value( e.section ) : 0u,
+                               e.event ? eventMap.value( e.event, -1 ) : -1,
+                               e.trigger ? triggerMap.value( e.trigger, -1 ) : -1 };
+            queued.append( qr );
+        }
+
+        trackIndex.append( { t.id(), (quint32)tracks.count() } );
+        tracks.append( tr );
+    }
+
+    auto byId =[]( const IndexRecord& a, const IndexRecord& b ) { return a.id < b.id; };
+    std::sort( trackIndex.begin(), trackIndex.end(), byId );
+    std::sort( triggerIndex.begin(), triggerIndex.end(), byId );
+
+    Header h;
+    std::memset( &h, 0, sizeof( h ) );
+    h.magic =Magic; h.version =Version;
+    h.trackCount =tracks.count(); h.sectionCount =sections.count(); h.offsetCount =offsets.count();
+    h.triggerCount =triggers.count(); h.eventCount =events.count(); h.queuedCount =queued.count();
+
+    QByteArray buffer( sizeof( Header ), '\0' );
+    h.trackTable   =appendTable( buffer, tracks.constData(),   tracks.count()   * sizeof( TrackRecord ) );
+    h.sectionTable =appendTable( buffer, sections.constData(), sections.count() * sizeof( SectionRecord ) );
+    h.offsetTable  =appendTable( buffer, offsets.constData(),  offsets.count()  * sizeof( double ) );
+    h.triggerTable =appendTable( buffer, triggers.constData(), triggers.count() * sizeof( TriggerRecord ) );
+    h.eventTable   =appendTable( buffer, events.constData(),   events.count()   * sizeof( EventRecord ) );
+    h.queuedTable  =appendTable( buffer, queued.constData(),   queued.count()   * sizeof( QueuedRecord ) );
+    h.trackIndex   =appendTable( buffer, trackIndex.constData(),   trackIndex.count()   * sizeof( IndexRecord ) );
+    h.triggerIndex =appendTable( buffer, triggerIndex.constData(), triggerIndex.count() * sizeof( IndexRecord ) );
+    QByteArray name =comp->name().toUtf8();
+    h.name         =appendTable( buffer, name.constData(), name.size() );
+    h.nameLength   =name.size();
+    appendTable( buffer, nullptr, 0 ); // pad the end of the file as well
+
+    h.size =buffer.size();
+    h.checksum =crc32( reinterpret_cast<const uchar*>( buffer.constData() ) + sizeof( Header ),
+                       buffer.size() - sizeof( Header ) );
+    std::memcpy( buffer.data(), &h, sizeof( Header ) );
+
+    QSaveFile file( path );
+    if( !file.open( QIODevice::WriteOnly )
+        || file.write( buffer ) != buffer.size()
+        || !file.commit() ) {
+        if( error != nullptr ) *error = "Could not write compiled composition: " + file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool
+CompiledComposition::open( const QString& path, QString* error, bool verify ) {
+    QString etxt;
+    const Header* h;
+    qint64 size;
+    close();
+
+    _file.setFileName( path );
+    if( !_file.open( QIODevice::ReadOnly ) ) {
+        etxt = "Could not open given file for reading"; goto ERROR;
+    }
+
+    size =_file.size();
+    if( size < (qint64)sizeof( Header ) ) { etxt = "File is too short"; goto ERROR; }
+
+    _data =_file.map( 0, size );
+    if( _data == nullptr ) { etxt = "Could not map file into memory"; goto ERROR; }
+
+    h =header();
+    if( h->magic != Magic ) { etxt = "Not a compiled composition"; goto ERROR; }
+    if( h->version != Version ) { etxt = "Unsupported version " + QString::number( h->version ); goto ERROR; }
+    if( h->size != size ) { etxt = "Truncated file"; goto ERROR; }
+
+    if( !tableInBounds( h->trackTable,   h->trackCount,   sizeof( TrackRecord ),   size )
+     || !tableInBounds( h->sectionTable, h->sectionCount, sizeof( SectionRecord ), size )
+     || !tableInBounds( h->offsetTable,  h->offsetCount,  sizeof( double ),        size )
+     || !tableInBounds( h->triggerTable, h->triggerCount, sizeof( TriggerRecord ), size )
+     || !tableInBounds( h->eventTable,   h->eventCount,   sizeof( EventRecord ),   size )
+     || !tableInBounds( h->queuedTable,  h->queuedCount,  sizeof( QueuedRecord ),  size )
+     || !tableInBounds( h->trackIndex,   h->trackCount,   sizeof( IndexRecord ),   size )
+     || !tableInBounds( h->triggerIndex, h->triggerCount, sizeof( IndexRecord ),   size )
+     || (qint64)h->name + h->nameLength > size ) {
+        etxt = "Corrupt table layout"; goto ERROR;
+    }
+
+    if( verify && crc32( _data + sizeof( Header ), size - sizeof( Header ) ) != h->checksum ) {
+        etxt = "Checksum mismatch"; goto ERROR;
+    }
+
+    // The ranges referenced by the tracks and triggers are cheap enough to always check
+    for( int i =0; i < trackCount(); i++ ) {
+        const TrackRecord& t =tracks()[i];
+        if( (quint64)t.firstSection + t.sectionCount > h->sectionCount
+            || (quint64)t.firstOffset + t.offsetCount > h->offsetCount
+            || (quint64)t.firstQueued + t.queuedCount > h->queuedCount ) {
+            etxt = "Corrupt track record"; goto ERROR;
+        }
+    }
+    for( int i =0; i < triggerCount(); i++ ) {
+        const TriggerRecord& t =triggers()[i];
+        if( (quint64)t.firstEvent + t.eventCount > h->eventCount ) {
+            etxt = "Corrupt trigger record"; goto ERROR;
+        }
+    }
+    if( verify ) {
+        // Every queued event refers to a section of its own track and an event of its own trigger
+        for( int i =0; i < trackCount(); i++ ) {
+            const TrackRecord& t =tracks()[i];
+            for( quint32 j =0; j < t.queuedCount; j++ ) {
+                const QueuedRecord& q =queued()[t.firstQueued + j];
+                if( q.type < EventQueue::LoopBeginEvent || q.type > EventQueue::ImplicitNoteOffEvent ) {
+                    etxt = "Corrupt event queue"; goto ERROR;
+                }
+                // Loops have no section, they are saved with 0
+                if( q.type != EventQueue::LoopBeginEvent
+                    && (q.section < t.firstSection || q.section >= t.firstSection + t.sectionCount) ) {
+                    etxt = "Corrupt event queue"; goto ERROR;
+                }
+                if( q.trigger >= (qint64)h->triggerCount || (q.event >= 0 && q.trigger < 0) ) {
+                    etxt = "Corrupt event queue"; goto ERROR;
+                }
+                if( q.event >= 0 ) {
+                    const TriggerRecord& tr =triggers()[q.trigger];
+                    if( (quint32)q.event < tr.firstEvent || (quint32)q.event >= tr.firstEvent + tr.eventCount ) {
+                        etxt = "Corrupt event queue"; goto ERROR;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+ERROR:
+    close();
+    if( error != nullptr ) *error = "Could not load compiled composition - " + etxt;
+    return false;
+}
+
+void
+CompiledComposition::close() {
+    if( _data != nullptr )
+        _file.unmap( const_cast<uchar*>( _data ) );
+    _data =nullptr;
+    _file.close();
+}
+
+/** Load the compiled composition at @path and construct the corresponding Composition.
+ * The returned composition keeps the file mapped, so its queues can be used by EventQueue. */
+Composition*
+CompiledComposition::load( const QString& path, QString* error, bool verify ) {
+    QSharedPointer<CompiledComposition> compiled( new CompiledComposition() );
+    if( !compiled->open( path, error, verify ) )
+        return nullptr;
+
+    Composition* comp =compiled->toComposition();
+    comp->setCompiled( compiled );
+    return comp;
+}
+
+Composition*
+CompiledComposition::toComposition() const {
+    if( !isOpen() ) return nullptr;
+    const Header* h =header();
+    Composition* comp =new Composition();
+
+    comp->setName( QString::fromUtf8( reinterpret_cast<const char*>( _data + h->name ), h->nameLength ) );
+
+    // All counts are known, so every object is constructed in place in a single allocation
+    CompositionArena* arena =comp->arena();
+    arena->allocate( h->trackCount, h->triggerCount, h->sectionCount, h->eventCount, h->offsetCount );
+
+    for( int i =0; i < triggerCount(); i++ ) {
+        const TriggerRecord& tr =triggers()[i];
+        Trigger trig;
+        trig.setId( tr.id );
+        for( quint32 j =0; j < tr.eventCount; j++ ) {
+            const EventRecord& er =events()[tr.firstEvent + j];
+            Trigger::Event e;
+            e.type =(Trigger::EventType)er.type;
+            e.midiDelay =er.midiDelay; e.midiDuration =er.midiDuration;
+            e.target =er.target;
+            e.midiEvent.setType( (QMidiEvent::EventType)er.midiType );
+            e.midiEvent.setNote( er.note );
+            e.midiEvent.setVoice( er.voice );
+            e.midiEvent.setVelocity( er.velocity );
+            e.midiEvent.setValue( er.value );
+            e.midiEvent.setNumber( er.number );
+            trig.addEvent( arena, std::move( e ) );
+        }
+        comp->addTrigger( std::move( trig ) );
+    }
+
+    for( int i =0; i < trackCount(); i++ ) {
+        const TrackRecord& tr =tracks()[i];
+        Track t;
+        t.setId( tr.id );
+        t.setTempo( tr.tempo );
+        t.setLength( tr.length );
+        t.setMidiChannel( tr.channel );
+        t.setLoopCount( tr.loop );
+        t.setAutoStart( tr.autoStart );
+        for( quint32 j =0; j < tr.sectionCount; j++ ) {
+            const SectionRecord& sr =sections()[tr.firstSection + j];
+            t.addSection( arena, { sr.offset, sr.trigger, sr.transpose } );
+        }
+        for( quint32 j =0; j < tr.offsetCount; j++ )
+            t.addAxleOffset( arena, axleOffsets()[tr.firstOffset + j] );
+        comp->addTrack( std::move( t ) );
+    }
+
+    return comp;
+}
+
+const CompiledComposition::IndexRecord*
+CompiledComposition::findId( quint32 offset, quint32 count, int id ) const {
+    const IndexRecord* begin =table<IndexRecord>( offset );
+    const IndexRecord* end =begin + count;
+    const IndexRecord* it =std::lower_bound( begin, end, id,
+        []( const IndexRecord& r, int id ) { return r.id < id; } );
+    if( it == end || it->id != id ) return nullptr;
+    return it;
+}
+
+const CompiledComposition::TrackRecord*
+CompiledComposition::trackById( int id ) const {
+    const IndexRecord* r =findId( header()->trackIndex, header()->trackCount, id );
+    return r ? tracks() + r->index : nullptr;
+}
+
+const CompiledComposition::TriggerRecord*
+CompiledComposition::triggerById( int id ) const {
+    const IndexRecord* r =findId( header()->triggerIndex, header()->triggerCount, id );
+    return r ? triggers() + r->index : nullptr;
+}
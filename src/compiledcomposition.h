@@ -0,0 +1,117 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QFile>
+#include <QString>
+
+class Composition;
+
+/** Binary, memory-mappable form of a Composition.
+ *
+ * The file consists of a fixed header followed by a number of flat tables of plain records.
+ * All tables are 8-byte aligned and are addressed by their byte offset in the header,
+ * which allows them to be used in place after the file has been mapped into memory.
+ * Besides the composition itself, the file contains the flattened and sorted events of the
+ * first axle of every track, so EventQueue does not have to compute (and sort) them when loading.
+ */
+class CompiledComposition {
+public:
+    enum {
+        Magic   = 0x4354524d, // "MRTC"
+        Version = 2
+    };
+
+    struct Header {
+        quint32 magic;
+        quint32 version;
+        quint32 checksum;       // CRC-32 of everything after the header
+        quint32 size;           // Total size of the file in bytes
+        quint32 trackCount, sectionCount, offsetCount, triggerCount, eventCount, queuedCount;
+        quint32 trackTable, sectionTable, offsetTable, triggerTable, eventTable, queuedTable;
+        quint32 trackIndex, triggerIndex;   // Tables of IndexRecord, sorted by id
+        quint32 name, nameLength;           // UTF-8 encoded composition name
+    };
+
+    struct TrackRecord {
+        double tempo;
+        qint64 lengthMsec;
+        qint32 id, channel, loop, length;
+        quint32 autoStart;
+        quint32 firstSection, sectionCount;
+        quint32 firstOffset, offsetCount;
+        quint32 firstQueued, queuedCount;
+        quint32 reserved;
+    };
+
+    struct SectionRecord {
+        double offset;
+        qint32 trigger, transpose;
+    };
+
+    struct TriggerRecord {
+        qint32 id;
+        quint32 firstEvent, eventCount;
+        quint32 hasStop;
+    };
+
+    struct EventRecord {
+        qint32 type, midiDelay, midiDuration, target;
+        qint32 midiType, note, voice, velocity, value, number;
+    };
+
+    // One entry of a track's pre-flattened event queue
+    struct QueuedRecord {
+        qint64 timestamp;
+        qint32 type;            // EventQueue::EventType
+        quint32 section;        // Index in the section table
+        qint32 event;           // Index in the event table, -1 for none
+        qint32 trigger;         // Index in the trigger table, -1 for none
+    };
+
+    struct IndexRecord {
+        qint32 id;
+        quint32 index;
+    };
+
+    CompiledComposition();
+    ~CompiledComposition();
+
+    static bool save( const Composition*, const QString& path, QString* error =nullptr );
+    static Composition* load( const QString& path, QString* error =nullptr, bool verify =true );
+
+    bool open( const QString& path, QString* error =nullptr, bool verify =true );
+    void close();
+    bool isOpen() const { return _data != nullptr; }
+
+    Composition* toComposition() const;
+
+    inline const Header* header() const { return reinterpret_cast<const Header*>( _data ); }
+
+    const TrackRecord* tracks() const { return table<TrackRecord>( header()->trackTable ); }
+    const SectionRecord* sections() const { return table<SectionRecord>( header()->sectionTable ); }
+    const double* axleOffsets() const { return table<double>( header()->offsetTable ); }
+    const TriggerRecord* triggers() const { return table<TriggerRecord>( header()->triggerTable ); }
+    const EventRecord* events() const { return table<EventRecord>( header()->eventTable ); }
+    const QueuedRecord* queued() const { return table<QueuedRecord>( header()->queuedTable ); }
+
+    int trackCount() const { return header()->trackCount; }
+    int triggerCount() const { return header()->triggerCount; }
+
+    const TrackRecord* trackById( int id ) const;
+    const TriggerRecord* triggerById( int id ) const;
+
+private:
+    template<typename T> inline const T* table( quint32 offset ) const {
+        return reinterpret_cast<const T*>( _data + offset );
+    }
+    const IndexRecord* findId( quint32 table, quint32 count, int id ) const;
+
+    QFile _file;
+    const uchar* _data;
+};
@@ -11,6 +11,8 @@
 #include <QJsonValue>
 #include <QJsonArray>
 #include <cstdio>
+#include <new>
+#include <utility>
 
 QMidiEvent::EventType
 eventTypeFromStr( const QString& str ) {
@@ -81,7 +83,7 @@ Trigger::Trigger() : _id( -1 ), _hasStop( false ) { }
 Trigger::~Trigger() { }
 
 Trigger
-Trigger::fromJson( const QJsonObject& json, QString* error ) {
+Trigger::fromJson( const QJsonObject& json, CompositionArena* arena, QString* error ) {
     Trigger t;
     for( auto it =json.begin(); it != json.end(); it++ ) {
 	if( it.key() == "Id" )
@@ -89,7 +91,7 @@ Trigger::fromJson( const QJsonObject& json, QString* error ) {
         else if( it.key() == "Events" && it.value().isArray() ) {
             QJsonArray array = it.value().toArray();
             for( auto it2 =array.begin(); it2 != array.end(); it2++ ) {
-                if( !t.addEventFromJson( (*it2).toObject(), error ) )
+                if( !t.addEventFromJson( (*it2).toObject(), arena, error ) )
                     return t;
             }
         }
@@ -107,15 +109,20 @@ Trigger::isValid() const {
     return _id != -1 && !_events.isEmpty();
 }
 
-void
-Trigger::addEvent( const Event& e ) {
-    _events.append( e );
-    if( e.type == StopEvent )
+/** Construct @e in @arena and add it to this trigger.
+ * The events of a trigger have to be added consecutively, so they form a single array. */
+bool
+Trigger::addEvent( CompositionArena* arena, Event&& e ) {
+    const bool stop =e.type == StopEvent;
+    if( !_events.extend( arena->appendEvent( std::move( e ) ) ) )
+        return false;
+    if( stop )
         _hasStop =true;
+    return true;
 }
     
 bool 
-Trigger::addEventFromJson( const QJsonObject& json, QString* error ) {
+Trigger::addEventFromJson( const QJsonObject& json, CompositionArena* arena, QString* error ) {
     QString etxt;
     Event e;
 
@@ -145,7 +152,7 @@ Trigger::addEventFromJson( const QJsonObject& json, QString* error ) {
 
     } else { etxt = "No or incorrect type"; goto ERROR; }
     
-    addEvent( e );
+    if( !addEvent( arena, std::move( e ) ) ) { etxt = "Out of space"; goto ERROR; }
     return true;
 ERROR:
     if( error != nullptr ) *error = "Incompletely specified trigger - " + etxt;
@@ -160,7 +167,7 @@ Track::Track()
 Track::~Track() { }
 
 Track 
-Track::fromJson( const QJsonObject& json, QString* error ) {
+Track::fromJson( const QJsonObject& json, CompositionArena* arena, QString* error ) {
     Track t;
 
     t.setAutoStart( json.value( "Start" ).toBool( true ) );
@@ -169,13 +176,13 @@ Track::fromJson( const QJsonObject& json, QString* error ) {
     t.setLoopCount( json.value( "Loop" ).toInt( 0 ) );
     t.setTempo( json.value( "Tempo" ).toDouble( 0.0 ) );
     t.setLength( json.value( "Length" ).toInt( 360 ) );
-    if( !t.setOffsetsFromJson( json.value( "AxleOffsets" ).toArray(), error ) )
+    if( !t.setOffsetsFromJson( json.value( "AxleOffsets" ).toArray(), arena, error ) )
         return t;
 
     QJsonArray array = json.value( "Sections" ).toArray();
 
     for( auto it2 =array.begin(); it2 != array.end(); it2++ ) {
-        if( !t.addSectionFromJson( (*it2).toObject(), error ) )
+        if( !t.addSectionFromJson( (*it2).toObject(), arena, error ) )
             return t;
     }
 
@@ -190,9 +197,23 @@ Track::isValid() const {
     return _tempo != 0.0 && !_sections.isEmpty();
 }
 
+/** Construct @s in @arena and add it to this track's sections.
+ * The sections of a track have to be added consecutively, so they form a single array. */
 bool
-Track::setOffsetsFromJson( const QJsonArray& array, QString *error ) {
-    _offsets.clear();
+Track::addSection( CompositionArena* arena, const Section& s ) {
+    return _sections.extend( arena->appendSection( s ) );
+}
+
+/** Construct the axle offset @d in @arena and add it to this track.
+ * The offsets of a track have to be added consecutively, so they form a single array. */
+bool
+Track::addAxleOffset( CompositionArena* arena, double d ) {
+    return _offsets.extend( arena->appendOffset( d ) );
+}
+
+bool
+Track::setOffsetsFromJson( const QJsonArray& array, CompositionArena* arena, QString *error ) {
+    _offsets =OffsetVectorT();
 
     for( auto it =array.begin(); it != array.end(); it++ ) {
         double offset = (*it).toDouble( 0.0 );
@@ -200,21 +221,24 @@ Track::setOffsetsFromJson( const QJsonArray& array, QString *error ) {
             if( error != nullptr ) *error = "Incorrect axle offset specified";
             return false;
         }
-        _offsets.append( offset );
+        if( !addAxleOffset( arena, offset ) ) {
+            if( error != nullptr ) *error = "Out of space for axle offsets";
+            return false;
+        }
 
     }
     return true;
 }
 
 bool 
-Track::addSectionFromJson( const QJsonObject& json, QString *error ) {
+Track::addSectionFromJson( const QJsonObject& json, CompositionArena* arena, QString *error ) {
     Section s;
     s.offset = json.value( "Offset" ).toDouble( -1 );
     s.trigger = json.value( "Trigger" ).toInt( -1 );
     s.transpose = json.value( "Transpose" ).toInt( 0 );
     
     if( s.offset < 0 ) goto ERROR;
-    _sections.append( s );
+    if( !addSection( arena, s ) ) goto ERROR;
     return true;
 ERROR:
     if( error != nullptr ) *error = "Incompletely specified section";
@@ -222,11 +246,122 @@ ERROR:
 }
 
 
-/* Class Composition implementation */
+/* Class CompositionArena implementation */
+
+/** Reserve space for @count objects of type T at the end of a block of @size bytes */
+template<typename T> static size_t
+layout( size_t& size, int count ) {
+    size =(size + alignof( T ) - 1) / alignof( T ) * alignof( T );
+    size_t offset =size;
+    size += count * sizeof( T );
+    return offset;
+}
+
+CompositionArena::CompositionArena() : _block( nullptr ) { }
+
+CompositionArena::CompositionArena( CompositionArena&& a ) : _block( nullptr ) {
+    *this =std::move( a );
+}
+
+CompositionArena& 
+CompositionArena::operator=( CompositionArena&& a ) {
+    if( this == &a ) return *this;
+    release();
+    _block =a._block;       a._block =nullptr;
+    _tracks =a._tracks;     a._tracks =ArenaPool<Track>();
+    _triggers =a._triggers; a._triggers =ArenaPool<Trigger>();
+    _sections =a._sections; a._sections =ArenaPool<Track::Section>();
+    _events =a._events;     a._events =ArenaPool<Trigger::Event>();
+    _offsets =a._offsets;   a._offsets =ArenaPool<double>();
+    return *this;
+}
+
+CompositionArena::~CompositionArena() {
+    release();
+}
+
+/** Allocate one block with room for the given number of objects of each type */
+void
+CompositionArena::allocate( int tracks, int triggers, int sections, int events, int offsets ) {
+    release();
+
+    size_t size =0;
+    size_t t =layout<Track>( size, tracks );
+    size_t g =layout<Trigger>( size, triggers );
+    size_t s =layout<Track::Section>( size, sections );
+    size_t e =layout<Trigger::Event>( size, events );
+    size_t o =layout<double>( size, offsets );
+
+    _block =static_cast<char*>( ::operator new( size ? size : 1 ) );
+
+    _tracks._array._data =reinterpret_cast<Track*>( _block + t );            _tracks._capacity =tracks;
+    _triggers._array._data =reinterpret_cast<Trigger*>( _block + g );        _triggers._capacity =triggers;
+    _sections._array._data =reinterpret_cast<Track::Section*>( _block + s ); _sections._capacity =sections;
+    _events._array._data =reinterpret_cast<Trigger::Event*>( _block + e );   _events._capacity =events;
+    _offsets._array._data =reinterpret_cast<double*>( _block + o );          _offsets._capacity =offsets;
+}
+
+/** Destroy all objects and free the block */
+void
+CompositionArena::release() {
+    destroy( _tracks );
+    destroy( _triggers );
+    destroy( _sections );
+    destroy( _events );
+    destroy( _offsets );
+    ::operator delete( _block );
+    _block =nullptr;
+}
+
+template<typename T> T* 
+CompositionArena::append( ArenaPool<T>& pool, T&& obj ) {
+    if( pool.count() >= pool.capacity() ) return nullptr;
+    T* p =new( pool._array._data + pool._array._count ) T( std::move( obj ) );
+    pool._array._count++;
+    return p;
+}
+
+template<typename T> void
+CompositionArena::destroy( ArenaPool<T>& pool ) {
+    for( int i =0; i < pool._array._count; i++ )
+        pool._array._data[i].~T();
+    pool =ArenaPool<T>();
+}
+
+Track* 
+CompositionArena::appendTrack( Track&& t ) { return append( _tracks, std::move( t ) ); }
+
+Trigger* 
+CompositionArena::appendTrigger( Trigger&& t ) { return append( _triggers, std::move( t ) ); }
 
+Track::Section* 
+CompositionArena::appendSection( const Track::Section& s ) { return append( _sections, Track::Section( s ) ); }
 
+Trigger::Event* 
+CompositionArena::appendEvent( Trigger::Event&& e ) { return append( _events, std::move( e ) ); }
+
+double* 
+CompositionArena::appendOffset( double d ) { return append( _offsets, std::move( d ) ); }
+
+/* Class Composition implementation */
 
 Composition::Composition() : _maxId(0) { }
+
+Composition::Composition( Composition&& c ) : _maxId(0) {
+    *this =std::move( c );
+}
+
+Composition& 
+Composition::operator=( Composition&& c ) {
+    if( this == &c ) return *this;
+    _arena =std::move( c._arena );
+    _name =c._name;
+    _maxId =c._maxId;
+    _compiled =c._compiled;
+    c._compiled.clear();
+    return *this;
+}
+
 Composition::~Composition() { }
 
 Composition 
@@ -248,6 +383,22 @@ Composition::fromJson( const QByteArray& json, QString* error ) {
 
     QJsonObject root =doc.object();
 
+    // Count all objects first, so the arena can be allocated in one go
+    int tracks =0, triggers =0, sections =0, events =0, offsets =0;
+    QJsonArray array =root.value( "Tracks" ).toArray();
+    for( auto it =array.begin(); it != array.end(); it++ ) {
+        QJsonObject track =(*it).toObject();
+        tracks++;
+        sections += track.value( "Sections" ).toArray().count();
+        offsets += track.value( "AxleOffsets" ).toArray().count();
+    }
+    array =root.value( "Triggers" ).toArray();
+    for( auto it =array.begin(); it != array.end(); it++ ) {
+        triggers++;
+        events += (*it).toObject().value( "Events" ).toArray().count();
+    }
+    comp._arena.allocate( tracks, triggers, sections, events, offsets );
+
     for( auto it =root.begin(); it != root.end(); it++ ) {
         //printf( "Key: %s\n", qPrintable(it.key()) );
         if( it.key() == "Tracks" ) {
@@ -258,16 +409,11 @@ Composition::fromJson( const QByteArray& json, QString* error ) {
             }
             QJsonArray array = it.value().toArray();
             for( auto it2 =array.begin(); it2 != array.end(); it2++ ) {
-                Track t =Track::fromJson( (*it2).toObject(), error );
-                if( !t.isValid() ) {
+                Track t =Track::fromJson( (*it2).toObject(), &comp._arena, error );
+                if( !t.isValid() || !comp.addTrack( std::move( t ) ) ) {
                     comp.clear();
                     return comp;
                 }
-                if( t.id() < 0 )
-                    t.setId( ++comp._maxId );
-                else
-                    comp._maxId = qMax( comp._maxId, t.id() );
-                comp._tracks.append( t );
             }
         }
         else if( it.key() == "Triggers" ) {
@@ -278,12 +424,11 @@ Composition::fromJson( const QByteArray& json, QString* error ) {
             }
             QJsonArray array = it.value().toArray();
             for( auto it2 =array.begin(); it2 != array.end(); it2++ ) {
-                Trigger t =Trigger::fromJson( (*it2).toObject(), error );
-                if( !t.isValid() ) {
+                Trigger t =Trigger::fromJson( (*it2).toObject(), &comp._arena, error );
+                if( !t.isValid() || !comp.addTrigger( std::move( t ) ) ) {
                     comp.clear();
                     return comp;
                 }
-                comp._triggers.append( t );
             }
         }
         else if( it.key() == "Name" ) {
@@ -299,15 +444,29 @@ Composition::toJson() const {
 
 }
 
+bool
+Composition::addTrack( Track&& t ) {
+    if( t.id() < 0 )
+        t.setId( ++_maxId );
+    else
+        _maxId = qMax( _maxId, t.id() );
+    return _arena.appendTrack( std::move( t ) ) != nullptr;
+}
+
+bool
+Composition::addTrigger( Trigger&& t ) {
+    return _arena.appendTrigger( std::move( t ) ) != nullptr;
+}
+
 void
 Composition::clear() {
-    _tracks.clear();
-    _triggers.clear();
+    _arena.release();
+    _compiled.clear();
 }
 
 const Trigger* 
 Composition::triggerById( int id ) const {
-    for( const auto &trig : _triggers )
+    for( const auto &trig : triggers() )
         if( trig.id() == id ) return &trig;
 
     return nullptr;
@@ -315,7 +474,7 @@ Composition::triggerById( int id ) const {
 
 const Track* 
 Composition::trackById( int id ) const {
-    for( const auto &track : _tracks )
+    for( const auto &track : tracks() )
         if( track.id() == id ) return &track;
 
     return nullptr;
@@ -323,9 +482,9 @@ Composition::trackById( int id ) const {
 
 bool 
 Composition::isValid() const {
-    if( _triggers.isEmpty() || _tracks.isEmpty() ) return false;
-    for( auto & t : _triggers ) if( !t.isValid() ) return false;
-    for( auto & t : _tracks )   if( !t.isValid() ) return false;
+    if( triggers().isEmpty() || tracks().isEmpty() ) return false;
+    for( auto & t : triggers() ) if( !t.isValid() ) return false;
+    for( auto & t : tracks() )   if( !t.isValid() ) return false;
     return true;
 }
 
@@ -12,6 +12,44 @@
 #include <QMidiFile.h>
 #include <QByteArray>
 #include <QString>
+#include <QSharedPointer>
+
+class CompiledComposition;
+class CompositionArena;
+
+// Names of MIDI event types as they appear in compositions, e.g. "NoteOn" or "CC"
+QMidiEvent::EventType eventTypeFromStr( const QString& );
+QString eventTypeToStr( QMidiEvent::EventType );
+
+/** Non-owning view of a contiguous array of objects in a CompositionArena */
+template<typename T>
+class ArenaArray {
+public:
+    ArenaArray() : _data( nullptr ), _count( 0 ) { }
+
+    inline int count() const { return _count; }
+    inline bool isEmpty() const { return _count == 0; }
+    inline const T& operator[]( int i ) const { return _data[i]; }
+    inline const T& first() const { return _data[0]; }
+    inline const T& last() const { return _data[_count-1]; }
+    inline const T* begin() const { return _data; }
+    inline const T* end() const { return _data + _count; }
+    inline const T* constData() const { return _data; }
+
+    /** Extend the view by the element at @p, which must directly follow its last element */
+    bool extend( T* p ) {
+        if( p == nullptr || (_count != 0 && p != _data + _count) ) return false;
+        if( _count == 0 ) _data =p;
+        _count++;
+        return true;
+    }
+
+private:
+    friend class CompositionArena;
+    template<typename> friend class ArenaPool;
+    T* _data;
+    int _count;
+};
 
 class Trigger {
 public:
@@ -29,17 +67,17 @@ public:
         int target;
     };
 
-    typedef QVector<Event> EventVectorT;
+    typedef ArenaArray<Event> EventVectorT;
 
     Trigger();
     ~Trigger();
 
-    void addEvent( const Event& );
+    bool addEvent( CompositionArena*, Event&& );
 
     const EventVectorT& events() const { return _events; }
     //EventVectorT& events() { return _events; }
 
-    static Trigger fromJson( const QJsonObject&, QString* error =nullptr );
+    static Trigger fromJson( const QJsonObject&, CompositionArena*, QString* error =nullptr );
     
     inline void setId( int i ) { _id = i; }
     inline int id() const { return _id; }
@@ -50,7 +88,7 @@ public:
     void setHasStop( bool b ) { _hasStop =b; }
 
 private:
-    bool addEventFromJson( const QJsonObject&, QString* error );
+    bool addEventFromJson( const QJsonObject&, CompositionArena*, QString* error );
     EventVectorT _events;
     int _id;
     bool _hasStop;
@@ -65,13 +103,13 @@ public:
         int transpose;
     };
 
-    typedef QVector<Section> SectionVectorT;
-    typedef QVector<double> OffsetVectorT;
+    typedef ArenaArray<Section> SectionVectorT;
+    typedef ArenaArray<double> OffsetVectorT;
 
     Track();
     ~Track();
     
-    static Track fromJson( const QJsonObject&, QString* error =nullptr );
+    static Track fromJson( const QJsonObject&, CompositionArena*, QString* error =nullptr );
 
     inline bool autoStart() const { return _start; }
     inline void setAutoStart( bool b ) { _start =b; }
@@ -87,6 +125,9 @@ public:
 
     int axleCount() const { return _offsets.count() + 1; }
 
+    bool addSection( CompositionArena*, const Section& );
+    bool addAxleOffset( CompositionArena*, double );
+
     void setLength( int i = 360 ) { _length =i; }
     int length() const { return _length; }
 
@@ -102,8 +143,8 @@ public:
     bool isValid() const;
     
 private:
-    bool setOffsetsFromJson( const QJsonArray& array, QString *error );
-    bool addSectionFromJson( const QJsonObject& json, QString *error );
+    bool setOffsetsFromJson( const QJsonArray& array, CompositionArena*, QString *error );
+    bool addSectionFromJson( const QJsonObject& json, CompositionArena*, QString *error );
     SectionVectorT _sections;
     OffsetVectorT _offsets;
     double _tempo;
@@ -114,12 +155,70 @@ private:
     int _loop;
 };
 
+/** Fixed-capacity array of objects of type T, constructed in place in a CompositionArena */
+template<typename T>
+class ArenaPool {
+public:
+    ArenaPool() : _capacity( 0 ) { }
+
+    const ArenaArray<T>& array() const { return _array; }
+    inline int count() const { return _array._count; }
+    inline int capacity() const { return _capacity; }
+
+private:
+    friend class CompositionArena;
+    ArenaArray<T> _array;
+    int _capacity;
+};
+
+/** Single block of memory that holds all objects of a Composition.
+ * The capacity for each type of object is set once by allocate(), after which the objects are
+ * constructed in place. Objects never move, so pointers to them (e.g. in EventQueue) stay valid
+ * until the arena is released, which frees everything with a single deallocation. */
+class CompositionArena {
+public:
+    CompositionArena();
+    CompositionArena( CompositionArena&& );
+    CompositionArena& operator=( CompositionArena&& );
+    ~CompositionArena();
+
+    void allocate( int tracks, int triggers, int sections, int events, int offsets );
+    void release();
+
+    Track* appendTrack( Track&& );
+    Trigger* appendTrigger( Trigger&& );
+    Track::Section* appendSection( const Track::Section& );
+    Trigger::Event* appendEvent( Trigger::Event&& );
+    double* appendOffset( double );
+
+    const ArenaArray<Track>& tracks() const { return _tracks.array(); }
+    const ArenaArray<Trigger>& triggers() const { return _triggers.array(); }
+    const ArenaArray<Track::Section>& sections() const { return _sections.array(); }
+    const ArenaArray<Trigger::Event>& events() const { return _events.array(); }
+    const ArenaArray<double>& offsets() const { return _offsets.array(); }
+
+private:
+    CompositionArena( const CompositionArena& ) =delete;
+    CompositionArena& operator=( const CompositionArena& ) =delete;
+    template<typename T> T* append( ArenaPool<T>&, T&& );
+    template<typename T> void destroy( ArenaPool<T>& );
+
+    char* _block;
+    ArenaPool<Track> _tracks;
+    ArenaPool<Trigger> _triggers;
+    ArenaPool<Track::Section> _sections;
+    ArenaPool<Trigger::Event> _events;
+    ArenaPool<double> _offsets;
+};
+
 class Composition {
 public:
-    typedef QVector<Track>   TrackVectorT;
-    typedef QVector<Trigger> TriggerVectorT;
+    typedef ArenaArray<Track>   TrackVectorT;
+    typedef ArenaArray<Trigger> TriggerVectorT;
 
     Composition();
+    Composition( Composition&& );
+    Composition& operator=( Composition&& );
     ~Composition();
 
     static Composition fromJson( const QByteArray&, QString* error =nullptr );
@@ -131,22 +230,33 @@ public:
     void clear();
     bool isValid() const;
 
-    const TrackVectorT& tracks() const { return _tracks; }
+    const TrackVectorT& tracks() const { return _arena.tracks(); }
     //TrackVectorT& tracks() { return _tracks; }
 
-    const TriggerVectorT& triggers() const { return _triggers; }
+    const TriggerVectorT& triggers() const { return _arena.triggers(); }
     //TriggerVectorT& triggers() { return _triggers; }
     //
     const Track* trackById( int id ) const;
     
     const Trigger* triggerById( int id ) const;
 
+    // All objects are stored in the arena, which must be allocated before adding any of them
+    CompositionArena* arena() { return &_arena; }
+    bool addTrack( Track&& );
+    bool addTrigger( Trigger&& );
+
+    // The compiled form this composition was loaded from, if any
+    const CompiledComposition* compiled() const { return _compiled.data(); }
+    void setCompiled( const QSharedPointer<const CompiledComposition>& c ) { _compiled =c; }
+
 private:
+    Composition( const Composition& ) =delete;
+    Composition& operator=( const Composition& ) =delete;
 
-    TrackVectorT _tracks;
-    TriggerVectorT _triggers;
+    CompositionArena _arena;
     QString _name;
     int _maxId;
+    QSharedPointer<const CompiledComposition> _compiled;
 
 };
 
@@ -8,19 +8,188 @@
 #include "eventqueue.h"
 #include <QMidiFile.h>
 #include "composition.h"
+#include "compiledcomposition.h"
+#include <QtConcurrent>
+#include <cmath>
 #include <cstdio>
+#include <functional>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-EventQueue::EventQueue() {}
+EventQueue::EventQueue() :
+    _source( nullptr ), _origin( 0 ), _now( 0 ), _lateness( 0 ), _coalescing( false ),
+    _parallel( false ), _allControlled( false ), _cursor( 0 ), _lap( 0 ), _period( 0 ), _clock( nullptr ) {}
 EventQueue::~EventQueue() {
     clear();
 }
 
 void
 EventQueue::clear() {
-    for( auto tq : _tracks ) {
-        delete tq;
+    if( !_source ) {
+        for( auto tq : _tracks ) {
+            delete tq;
+        }
     }
     _tracks.clear();
+    _source =nullptr;
+    _merges.clear();
+    _dynamic.clear();
+    _schedule.clear();
+    _cursor =_lap =0;
+    _period =0;
+    _clock =nullptr;
+    _lengths.clear(); _inverses.clear();
+    _offsets.clear(); _laps.clear(); _positions.clear();
+}
+
+/** Sort a run of events by timestamp.
+ *  The events of a track are usually sorted already, or sorted but rotated at the point where
+ *  the timestamps wrap around the track length. Both cases are handled in linear time. */
+template<typename It, typename Less> static void
+sortRun( It begin, It end, Less cmp ) {
+    auto split =std::is_sorted_until( begin, end, cmp );
+    if( split == end ) return;
+    if( std::is_sorted( split, end, cmp ) && !cmp( *begin, *(end-1) ) )
+        std::rotate( begin, split, end );
+    else
+        std::stable_sort( begin, end, cmp );
+}
+
+static inline bool
+earlier( const EventQueue::Event& a, const EventQueue::Event& b ) {
+    return a.timestamp < b.timestamp;
+}
+
+/** Only MIDI events are played by every axle, other events only by the first one */
+static inline bool
+repeats( const EventQueue::Event& e ) {
+    return e.event && e.event->type == Trigger::MidiEvent && e.axle == 0;
+}
+
+/** The timestamp of the MIDI event @e of @tq when played by the axle @angle behind the first
+ *  one, computed like addTrack() does for the first axle */
+static qint64
+timestamp( const EventQueue::TrackQueue* tq, const EventQueue::Event& e, double angle ) {
+    const qint64 ts =((e.section->offset + angle) / tq->track->tempo()) * 1000.0;
+    const qint64 duration =e.type == EventQueue::ImplicitNoteOffEvent ? e.event->midiDuration : 0;
+    return (ts + e.event->midiDelay + duration) % tq->length;
+}
+
+/** The timestamp of the event at @q in TrackQueue::repeating when played by @a */
+static inline qint64
+shifted( const EventQueue::TrackQueue* tq, const EventQueue::Axle& a, int q ) {
+    qint64 ts =tq->repeating[q].timestamp + a.offset + (qint64)((a.rounding[q >> 5] >> ((q & 31) * 2)) & 3);
+    if( ts < 0 ) ts += tq->length;
+    else if( ts >= 2 * tq->length ) ts -= 2 * tq->length;
+    else if( ts >= tq->length ) ts -= tq->length;
+    return ts;
+}
+
+/** The timestamp of the event that @a plays at @position */
+static inline qint64
+played( const EventQueue::TrackQueue* tq, const EventQueue::Axle& a, int position ) {
+    auto p =std::lower_bound( a.patches.cbegin(), a.patches.cend(), position,
+        []( const EventQueue::Patch& p, int position ) { return p.position < position; } );
+    if( p != a.patches.cend() && p->position == position )
+        return p->index < 0 ? tq->events[-1 - p->index].timestamp : shifted( tq, a, p->index );
+    const int m =tq->repeating.count();
+    return shifted( tq, a, a.wrap + position < m ? a.wrap + position : a.wrap + position - m );
+}
+
+/** The order in which addTrack() generates the events of a track, which the sort keeps for
+ *  events with the same timestamp */
+static inline qint64
+generated( const EventQueue::TrackQueue* tq, const EventQueue::Event& e ) {
+    const qint64 section =e.section - tq->track->sections().constData();
+    const qint64 event =e.event - e.trigger->events().constData();
+    return (section << 32) | (event << 1) | (e.type == EventQueue::ImplicitNoteOffEvent ? 1 : 0);
+}
+
+// Heap order of the axles: earliest event first, lowest axle first for equal timestamps
+static inline qint64
+key( const EventQueue::AxleCursor& c ) {
+    return c.timestamp << 16 | c.axle;
+}
+
+static qint64
+gcd( qint64 a, qint64 b ) {
+    while( b != 0 ) {
+        const qint64 r =a % b;
+        a =b; b =r;
+    }
+    return a;
+}
+
+/** Split the running times in @elapsed (msec) of @count tracks into the time into their lap,
+ *  the lap and the normalized offset, written to @offset, @lap and @position, like / and %
+ *  and fmod() do. The lap is found with a multiply by the @inverse of the @length, which is
+ *  off by at most one and corrected with the remainder, so the results are exact and the
+ *  same whichever instructions are used. Negative times round towards zero, like the
+ *  division, and tracks without a length are at 0. Every output may be the input as well. */
+static void
+lapOffsets( const double* elapsed, const double* length, const double* inverse,
+            double* offset, double* lap, double* position, int count ) {
+    int i =0;
+#if defined(__AVX__)
+    const __m256d sign =_mm256_set1_pd( -0.0 ), zero =_mm256_setzero_pd();
+    for( ; i + 4 <= count; i += 4 ) {
+        const __m256d e =_mm256_loadu_pd( elapsed + i ), l =_mm256_loadu_pd( length + i );
+        const __m256d s =_mm256_and_pd( e, sign ), a =_mm256_andnot_pd( sign, e );
+        __m256d q =_mm256_floor_pd( _mm256_mul_pd( a, _mm256_loadu_pd( inverse + i ) ) );
+        __m256d r =_mm256_sub_pd( a, _mm256_mul_pd( q, l ) );
+        __m256d under =_mm256_cmp_pd( r, zero, _CMP_LT_OQ );
+        r =_mm256_add_pd( r, _mm256_and_pd( under, l ) );
+        q =_mm256_sub_pd( q, _mm256_and_pd( under, _mm256_set1_pd( 1.0 ) ) );
+        __m256d over =_mm256_cmp_pd( r, l, _CMP_GE_OQ );
+        r =_mm256_sub_pd( r, _mm256_and_pd( over, l ) );
+        q =_mm256_add_pd( q, _mm256_and_pd( over, _mm256_set1_pd( 1.0 ) ) );
+        const __m256d valid =_mm256_cmp_pd( l, zero, _CMP_GT_OQ );
+        r =_mm256_and_pd( valid, _mm256_or_pd( r, s ) );
+        q =_mm256_and_pd( valid, _mm256_or_pd( q, s ) );
+        const __m256d p =_mm256_and_pd( valid, _mm256_div_pd( r, l ) );
+        _mm256_storeu_pd( offset + i, r );
+        _mm256_storeu_pd( lap + i, q );
+        _mm256_storeu_pd( position + i, p );
+    }
+#elif defined(__SSE2__)
+    // SSE2 has no floor, adding and subtracting 2^52 rounds to the nearest integer instead
+    const __m128d sign =_mm_set1_pd( -0.0 ), zero =_mm_setzero_pd(), round =_mm_set1_pd( 4503599627370496.0 );
+    for( ; i + 2 <= count; i += 2 ) {
+        const __m128d e =_mm_loadu_pd( elapsed + i ), l =_mm_loadu_pd( length + i );
+        const __m128d s =_mm_and_pd( e, sign ), a =_mm_andnot_pd( sign, e );
+        __m128d q =_mm_sub_pd( _mm_add_pd( _mm_mul_pd( a, _mm_loadu_pd( inverse + i ) ), round ), round );
+        __m128d r =_mm_sub_pd( a, _mm_mul_pd( q, l ) );
+        __m128d under =_mm_cmplt_pd( r, zero );
+        r =_mm_add_pd( r, _mm_and_pd( under, l ) );
+        q =_mm_sub_pd( q, _mm_and_pd( under, _mm_set1_pd( 1.0 ) ) );
+        __m128d over =_mm_cmpge_pd( r, l );
+        r =_mm_sub_pd( r, _mm_and_pd( over, l ) );
+        q =_mm_add_pd( q, _mm_and_pd( over, _mm_set1_pd( 1.0 ) ) );
+        const __m128d valid =_mm_cmpgt_pd( l, zero );
+        r =_mm_and_pd( valid, _mm_or_pd( r, s ) );
+        q =_mm_and_pd( valid, _mm_or_pd( q, s ) );
+        const __m128d p =_mm_and_pd( valid, _mm_div_pd( r, l ) );
+        _mm_storeu_pd( offset + i, r );
+        _mm_storeu_pd( lap + i, q );
+        _mm_storeu_pd( position + i, p );
+    }
+#endif
+    for( ; i < count; i++ ) {
+        const double l =length[i];
+        if( l <= 0. ) {
+            offset[i] =lap[i] =position[i] =0.;
+            continue;
+        }
+        const double a =std::fabs( elapsed[i] ), s =elapsed[i] < 0. ? -1. : 1.;
+        double q =std::floor( a * inverse[i] );
+        double r =a - q * l;
+        if( r < 0. ) { r += l; q -= 1.; }
+        else if( r >= l ) { r -= l; q += 1.; }
+        offset[i] =s * r;
+        lap[i] =s * q;
+        position[i] =s * r / l;
+    }
 }
 
 /** (Re-)populate the event queue with all events from @comp */
@@ -29,64 +198,444 @@ EventQueue::initialize( const Composition* comp ) {
 
     clear();
 
-    for( const auto& t : comp->tracks() ) {
-        addTrack( &t, comp );
+    // Look up the triggers by id once, instead of searching them for every section
+    TriggerMapT triggers;
+    for( const auto& trig : comp->triggers() )
+        triggers.insert( trig.id(), &trig );
+
+    qint64 size =0;
+    for( int i =0; i < comp->tracks().count(); i++ ) {
+        const Track* t =&comp->tracks()[i];
+        // Tracklength in msec
+        qint64 length =(qint64)((t->length() / t->tempo()) * 1000.0);
+        _tracks.append( new TrackQueue( { length, t, EventVectorT(), 0, 0, t->autoStart(), false, 0, 0, i, false, {}, 0, {}, {}, {} } ) );
+        size += t->sections().count();
+    }
+
+    // Tracks are flattened independently, so large compositions are spread over the thread pool
+    auto build =[&]( TrackQueue* tq ) {
+        if( comp->compiled() )
+            addCompiledTrack( tq, comp );
+        else
+            addTrack( tq, comp, triggers );
+        addAxles( tq );
+    };
+
+    _parallel =_tracks.count() > 1 && size >= PARALLEL_INIT_THRESHOLD;
+    if( _parallel )
+        QtConcurrent::blockingMap( _tracks, build );
+    else
+        for( auto tq : _tracks ) build( tq );
+
+    if( _coalescing )
+        coalesce( comp );
+    buildSchedule( controlledTracks( comp ) );
+    layoutTracks();
+}
+
+/** Make this queue play the tracks at @indices of @source, e.g. on a thread of its own.
+ *
+ * The tracks stay owned by @source and keep their state there, so starting, stopping and
+ * seeking @source while not playing applies to this queue as well; call resume() before
+ * playing. The static tracks among them get a schedule of their own. Tracks are controlled
+ * if anything in @source controls them, not just the tracks of this queue. */
+void
+EventQueue::share( const EventQueue& source, const QVector<int>& indices, const Composition* comp ) {
+    clear();
+    _source =&source;
+    _coalescing =source._coalescing;
+    for( int i : indices ) _tracks.append( source._tracks[i] );
+    buildSchedule( source.controlledTracks( comp ) );
+    layoutTracks();
+}
+
+void
+EventQueue::swap( EventQueue& other ) {
+    _tracks.swap( other._tracks );
+    std::swap( _source, other._source );
+    std::swap( _origin, other._origin );
+    std::swap( _now, other._now );
+    std::swap( _lateness, other._lateness );
+    std::swap( _coalescing, other._coalescing );
+    std::swap( _parallel, other._parallel );
+    _merges.swap( other._merges );
+    _controlled.swap( other._controlled );
+    std::swap( _allControlled, other._allControlled );
+    _dynamic.swap( other._dynamic );
+    _schedule.swap( other._schedule );
+    std::swap( _cursor, other._cursor );
+    std::swap( _lap, other._lap );
+    std::swap( _period, other._period );
+    std::swap( _clock, other._clock );
+    _lengths.swap( other._lengths );
+    _inverses.swap( other._inverses );
+    _offsets.swap( other._offsets );
+    _laps.swap( other._laps );
+    _positions.swap( other._positions );
+}
+
+/** Copy the lap lengths of the tracks into the arrays advance() works on */
+void
+EventQueue::layoutTracks() {
+    const int n =_tracks.count();
+    _lengths.resize( n ); _inverses.resize( n );
+    _offsets.fill( 0., n ); _laps.fill( 0., n ); _positions.fill( 0., n );
+    for( int i =0; i < n; i++ ) {
+        _lengths[i] =(double)_tracks[i]->length;
+        _inverses[i] =_tracks[i]->length > 0 ? 1.0 / _tracks[i]->length : 0.;
     }
 }
 
+/** Generate the sorted events of the first axle of @tq */
 void 
-EventQueue::addTrack( const Track* t, const Composition* comp ) {
-    EventVectorT events;
+EventQueue::addTrack( TrackQueue* tq, const Composition* comp, const TriggerMapT& triggers ) {
+    const Track* t =tq->track;
+    const qint64 length =tq->length;
+    EventVectorT& events =tq->events;
 
-    // Tracklength in msec
-    qint64 length =(qint64)((t->length() / t->tempo()) * 1000.0);
-    
-    TrackQueue* tq = new TrackQueue( { length, 0, t, EventVectorT(), 0, 0, t->autoStart(), false, 0, 0, 0. } );
+    // Pre-size the vector from the number of events each section will produce
+    int count =1;
+    for( const auto & sec : t->sections() ) {
+        const Trigger* trig = triggers.value( sec.trigger, nullptr );
+        if( trig == nullptr ) continue;
+        for( const auto &event : trig->events() )
+            count += event.type == Trigger::MidiEvent && event.midiDuration > 0 ? 2 : 1;
+    }
+    events.reserve( count );
     
     // We make a vector of all events in this track, starting with the 'loop begin'
     events.append( {LoopBeginEvent, 0, nullptr, nullptr, nullptr, tq} );
-    
+
     // We want to 'flatten' all possible (midi) events for each section of this track
     for( const auto & sec : t->sections() ) {
         // Obtain the trigger for this section
-        const Trigger* trig = comp->triggerById( sec.trigger );
+        const Trigger* trig = triggers.value( sec.trigger, nullptr );
         if( trig == nullptr ) continue;
 
-        // We have to add duplicates for each axle, given its offset
-        double axle =0.0;
-        for( int i=0; i < t->axleCount(); i++ ) {
-            axle += i==0 ? 0.0 : t->axleOffsets()[i-1];
-
-            // Add the trigger's (midi) events with their absolute offsets
-            for( const auto &event : trig->events() ) {
-                
-                const double angle =sec.offset + axle;;
-                // Compute the timestamp from the angle
-                const qint64 ts = (angle / t->tempo()) * 1000.0;
-                if( event.type == Trigger::MidiEvent ) {
-                    // For MIDI events we have to add the extra delay parameter
-                    Event e ={TriggerEvent, (ts + event.midiDelay) % length, &event, trig, &sec, tq};
+        // Compute the timestamp from the angle
+        const qint64 ts = (sec.offset / t->tempo()) * 1000.0;
+
+        // Add the trigger's (midi) events with their absolute offsets
+        for( const auto &event : trig->events() ) {
+            if( event.type == Trigger::MidiEvent ) {
+                // For MIDI events we have to add the extra delay parameter
+                Event e ={TriggerEvent, (ts + event.midiDelay) % length, &event, trig, &sec, tq};
+                events.append( e );
+
+                if( event.midiDuration > 0 ) {
+                    // If 'duration' is specified, we add an automagic NoteOff
+                    Event e ={ImplicitNoteOffEvent, (ts + event.midiDelay + event.midiDuration) % length, &event, trig, &sec, tq};
                     events.append( e );
+                }
+            } else {
+                Event e ={TriggerEvent, ts % length, &event, trig, &sec, tq};
+                events.append( e );
+            }
+        }
+    }
+
+    // The sections are sorted by offset, so only delays and durations can spoil the order
+    sortRun( events.begin(), events.end(), earlier );
+}
+
+/** Compute the time shift of every axle of @tq relative to the first one, with the rounding
+ *  and the order of its events that make them the same as if they were generated for it */
+void
+EventQueue::addAxles( TrackQueue* tq ) {
+    const Track* t =tq->track;
+    tq->repeating.clear();
+    tq->silent =0;
+    for( int i =0; i < tq->events.count(); i++ ) {
+        const Event& e =tq->events[i];
+        if( repeats( e ) ) tq->repeating.append( { e.timestamp, i } );
+        tq->silent |= e.silent;
+    }
+    const int m =tq->repeating.count();
+
+    // The copies that coalesce() made for the axles that kept a NoteOn with counts of their own
+    QHash<qint64, int> copies;
+    for( int i =0; i < tq->events.count(); i++ )
+        if( tq->events[i].axle > 0 ) copies.insert( generated( tq, tq->events[i] ) * 64 + tq->events[i].axle, i );
+
+    tq->axles.clear();
+    tq->axles.reserve( t->axleCount() );
+    // The first axle plays the events as they are
+    tq->axles.append( { 0.0, 0, 0, QVector<quint64>(), QVector<Patch>() } );
+
+    // The events of every axle in the order addTrack() would generate them
+    QVector<int> generation( m );
+    for( int q =0; q < m; q++ ) generation[q] =q;
+    std::sort( generation.begin(), generation.end(), [tq]( int a, int b ) {
+        return generated( tq, tq->events[tq->repeating[a].index] ) < generated( tq, tq->events[tq->repeating[b].index] ); } );
+
+    QVector<qint64> times( m );
+    QVector<int> order;
+    double angle =0.0;
+    for( int k =1; k < t->axleCount(); k++ ) {
+        angle += t->axleOffsets()[k-1];
+        Axle a;
+        a.angle =angle;
+        a.offset =(qint64)((angle / t->tempo()) * 1000.0) % tq->length - 1;
+        a.rounding.fill( 0, (m + 31) / 32 );
+        for( int q =0; q < m; q++ ) {
+            const Event& e =tq->events[tq->repeating[q].index];
+            times[q] =timestamp( tq, e, angle );
+            // The shift and the timestamp were rounded separately, so they are 1 msec apart at most
+            qint64 round =(times[q] - e.timestamp - a.offset) % tq->length;
+            if( round < 0 ) round += tq->length;
+            a.rounding[q >> 5] |= (quint64)qMin( round, (qint64)3 ) << ((q & 31) * 2);
+        }
 
-                    if( event.midiDuration > 0 ) {
-                        // If 'duration' is specified, we add an automagic NoteOff
-                        Event e ={ImplicitNoteOffEvent, (ts + event.midiDelay + event.midiDuration) % length, &event, trig, &sec, tq};
-                        events.append( e );
+        // Sorted the way addTrack() sorts, which only differs from the first axle when events
+        // of different sections come within a msec of each other
+        order =generation;
+        sortRun( order.begin(), order.end(), [&times]( int a, int b ) { return times[a] < times[b]; } );
+        a.wrap =m > 0 ? order[0] : 0;
+        for( int p =0; p < m; p++ ) {
+            const int rotated =a.wrap + p < m ? a.wrap + p : a.wrap + p - m;
+            const Event& e =tq->events[tq->repeating[order[p]].index];
+            const int copy =k < 64 && (e.silent >> k & 1) ? copies.value( generated( tq, e ) * 64 + k, -1 ) : -1;
+            if( copy != -1 ) a.patches.append( { p, -1 - copy } );
+            else if( order[p] != rotated ) a.patches.append( { p, order[p] } );
+        }
+        tq->axles.append( a );
+    }
+    tq->cursors.resize( tq->axles.count() );
+    tq->heap.reserve( tq->axles.count() );
+}
+
+/** Fill @tq from the pre-flattened queue stored in the compiled composition.
+ *  The records only have to be translated to pointers into @comp, no sorting is needed. */
+void 
+EventQueue::addCompiledTrack( TrackQueue* tq, const Composition* comp ) {
+    const Track* t =tq->track;
+    const CompiledComposition* cc =comp->compiled();
+    const CompiledComposition::TrackRecord& tr =cc->tracks()[tq->index];
+    
+    tq->events.resize( tr.queuedCount );
+
+    const CompiledComposition::QueuedRecord* q =cc->queued() + tr.firstQueued;
+    for( quint32 i =0; i < tr.queuedCount; i++, q++ ) {
+        Event& e =tq->events[i];
+        e.type =q->type;
+        e.timestamp =q->timestamp;
+        e.merged =e.borrowed =0;
+        e.silent =0;
+        e.axle =0;
+        e.trackQueue =tq;
+        e.section =q->type == LoopBeginEvent ? nullptr : &t->sections()[q->section - tr.firstSection];
+        e.trigger =q->trigger < 0 ? nullptr : &comp->triggers()[q->trigger];
+        e.event =q->event < 0 ? nullptr
+            : &e.trigger->events()[q->event - cc->triggers()[q->trigger].firstEvent];
+    }
+}
+
+/** Remove NoteOns that play the same note on the same channel with the same velocity at the
+ *  same time as another NoteOn, and count them on the one that is kept instead.
+ *
+ * The NoteOffs are left in place: the voice is only released by the last of them, see
+ * VoiceTable::noteOff(). Within a track this is always safe. Across tracks it is only done
+ * for tracks that are sure to play in lockstep: they start with playback, loop forever, have
+ * the same length and are never started, stopped or reset by a trigger.
+ *
+ * Every axle of a train plays a NoteOn at a time of its own, so they are merged one by one.
+ * The axles it was removed from are marked silent. Where an axle kept it with other counts
+ * than the first axle that plays it, the axle plays a copy with its own counts in its place.
+ * Trains of more than 64 axles are not coalesced. */
+void
+EventQueue::coalesce( const Composition* comp ) {
+    const QSet<const Track*> controlled =controlledTracks( comp );
+
+    // Tracks in lockstep are grouped by length, every other track is a group of its own
+    QVector<TrackQueuePtrVectorT> groups;
+    QHash<qint64, int> lockstep;
+    for( auto tq : _tracks ) {
+        const Track* t =tq->track;
+        if( tq->axles.count() > 64 ) continue;
+        const bool free =t->autoStart() && t->loopCount() <= 0 && !controlled.contains( t );
+        if( free && lockstep.contains( tq->length ) ) {
+            groups[lockstep.value( tq->length )].append( tq );
+            continue;
+        }
+        if( free ) lockstep.insert( tq->length, groups.count() );
+        groups.append( TrackQueuePtrVectorT() << tq );
+    }
+
+    struct Kept { Event* event; int axle; };
+    struct Refs { int merged, borrowed; };
+    for( const auto& group : groups ) {
+        // The NoteOn that is kept for each timestamp, channel, note and velocity
+        QHash<quint64, Kept> kept;
+        // What was folded into the kept NoteOns, per axle
+        QHash<Event*, QVector<Refs> > refs;
+        for( auto tq : group ) {
+            for( int k =0; k < tq->axles.count(); k++ ) {
+                // The axle in the order it plays, so the first NoteOn that is played is kept
+                for( AxleCursor c ={ 0, k, 0, 0, 0 }; fill( tq, c ); c.position++ ) {
+                    Event& e =tq->events[c.index];
+                    if( e.type != TriggerEvent || !e.event || e.event->type != Trigger::MidiEvent ) continue;
+                    const QMidiEvent& midi =e.event->midiEvent;
+                    if( midi.type() != QMidiEvent::NoteOn ) continue;
+                    const int channel =midi.voice() == -1 ? tq->track->midiChannel() : midi.voice();
+                    const int note =midi.note() + e.section->transpose;
+                    if( channel < 0 || channel > 15 || note < 0 || note > 127 ) continue;
+
+                    const quint64 key =((quint64)c.timestamp << 24) | (channel << 16) | (note << 8) | (midi.velocity() & 0xff);
+                    Kept& kk =kept[key];
+                    if( !kk.event ) {
+                        kk ={ &e, k };
+                        continue;
                     }
+                    QVector<Refs>& r =refs[kk.event];
+                    if( r.isEmpty() ) r.fill( { 0, 0 }, kk.event->trackQueue->axles.count() );
+                    if( kk.event->trackQueue == tq ) r[kk.axle].merged++;
+                    else r[kk.axle].borrowed++;
+                    // The NoteOn is not sent, nor is the NoteOff that would be sent for it
+                    const int bytes =e.event->midiDuration > 0 ? 6 : 3;
+                    _merges.append( { kk.event->trackQueue->track->id(), tq->track->id(), c.timestamp, channel, note, bytes } );
+                    e.silent |= 1ULL << k;
+                }
+            }
+        }
 
-                } else if( i ==0 ) {
-                    // Other events are only added for the first axle
-                    Event e ={TriggerEvent, ts % length, &event, trig, &sec, tq};
-                    events.append( e );
+        // The kept events are moved, so this can only be done once the group is complete
+        for( auto tq : group ) {
+            const quint64 all =tq->axles.count() == 64 ? ~0ULL : (1ULL << tq->axles.count()) - 1;
+            EventVectorT copies;
+            bool changed =false;
+            for( auto& e : tq->events ) {
+                if( e.silent ) changed =true;
+                if( !refs.contains( &e ) ) continue;
+                changed =true;
+                const QVector<Refs> r =refs.value( &e );
+                int first =0;
+                while( e.silent >> first & 1 ) first++;
+                e.merged =r[first].merged;
+                e.borrowed =r[first].borrowed;
+                for( int k =first + 1; k < r.count(); k++ ) {
+                    if( (e.silent >> k & 1) || (r[k].merged == e.merged && r[k].borrowed == e.borrowed) ) continue;
+                    Event copy =e;
+                    copy.timestamp =timestamp( tq, e, tq->axles[k].angle );
+                    copy.merged =r[k].merged;
+                    copy.borrowed =r[k].borrowed;
+                    copy.silent =1;
+                    copy.axle =k;
+                    copies.append( copy );
+                    e.silent |= 1ULL << k;
                 }
+            }
+            if( !changed ) continue;
+            tq->events.erase( std::remove_if( tq->events.begin(), tq->events.end(),
+                [all]( const Event& e ) { return (e.silent & all) == all; } ), tq->events.end() );
+            tq->events.append( copies );
+            sortRun( tq->events.begin(), tq->events.end(), earlier );
+            addAxles( tq );
+        }
+    }
+}
+
+/** Return the tracks that are started, stopped or reset by a trigger or from outside.
+ *  The others only follow playback as a whole, if they start with it and never stop by
+ *  themselves, their output is fully periodic. */
+QSet<const Track*>
+EventQueue::controlledTracks( const Composition* comp ) const {
+    QSet<const Track*> controlled;
+    for( auto tq : _tracks ) {
+        if( _allControlled || _controlled.contains( tq->track->id() ) )
+            controlled.insert( tq->track );
+        for( const auto& e : tq->events ) {
+            if( e.type != TriggerEvent || !e.event ) continue;
+            if( e.event->type == Trigger::StopEvent )
+                controlled.insert( tq->track );
+            else if( e.event->type == Trigger::StartEvent || e.event->type == Trigger::ResetEvent )
+                controlled.insert( comp->trackById( e.event->target ) );
+        }
+    }
+    return controlled;
+}
+
+/** Merge the events of all static tracks over their hyperperiod (the least common multiple of
+ *  their lengths) into one sorted array, which is played with a single cursor.
+ *
+ * A track is static if it starts with playback, loops forever and is not controlled by any
+ * trigger. Static tracks are added as long as the schedule stays below SCHEDULE_MAX_EVENTS,
+ * the others are left to the per-track queues. */
+void
+EventQueue::buildSchedule( const QSet<const Track*>& controlled ) {
+    _dynamic.clear();
+    _schedule.clear();
+    _period =0;
+    _clock =nullptr;
+
+    TrackQueuePtrVectorT scheduled;
+    QVector<qint64> perLap;
+    qint64 period =1;
+    for( auto tq : _tracks ) {
+        const Track* t =tq->track;
+        tq->scheduled =false;
+        if( !t->autoStart() || t->loopCount() > 0 || controlled.contains( t ) || tq->length <= 0 ) {
+            _dynamic.append( tq );
+            continue;
+        }
+
+        // Events per lap, all axles together
+        qint64 count =0;
+        for( const auto& e : tq->events ) count += repeats( e ) ? tq->axles.count() : 1;
 
+        // The track must fit, also after the period has been extended for it
+        const qint64 factor =tq->length / gcd( period, tq->length );
+        double size =(double)count * period * factor / tq->length;
+        for( int i =0; i < scheduled.count(); i++ )
+            size += (double)perLap[i] * period * factor / scheduled[i]->length;
+        if( size > SCHEDULE_MAX_EVENTS ) {
+            _dynamic.append( tq );
+            continue;
+        }
+        period *= factor;
+        scheduled.append( tq );
+        perLap.append( count );
+    }
+    if( scheduled.isEmpty() ) return;
+
+    // Walk the per-track queues through the whole period. Events of different tracks with
+    // the same timestamp stay in the order of the tracks.
+    for( auto tq : scheduled ) {
+        const int first =_schedule.count();
+        tq->lap =0;
+        seek( tq, 0 );
+        for( qint64 lap =0; lap < period / tq->length; lap++ ) {
+            while( tq->lap == lap ) {
+                _schedule.append( { tq->frontTimestamp() + lap * tq->length, &tq->events[tq->frontIndex()] } );
+                next( tq );
             }
         }
+        std::inplace_merge( _schedule.begin(), _schedule.begin() + first, _schedule.end(),
+            []( const Scheduled& a, const Scheduled& b ) { return a.timestamp < b.timestamp; } );
+        tq->lap =0;
+        seek( tq, 0 );
+        tq->scheduled =true;
     }
+    _period =period;
+    _clock =scheduled.first();
+}
+
+/** Position the schedule at the first event not before the running time of the scheduled tracks */
+void
+EventQueue::seekSchedule() {
+    if( !_clock ) return;
+    const qint64 elapsed =elapsedTrackTime( _clock );
+    auto it =std::lower_bound( _schedule.cbegin(), _schedule.cend(), elapsed % _period,
+        []( const Scheduled& s, qint64 ts ) { return s.timestamp < ts; } );
+    _cursor =it == _schedule.cend() ? 0 : (int)(it - _schedule.cbegin());
+    _lap =elapsed / _period;
+}
 
-    std::sort( events.begin(), events.end(), [](const Event& a, const Event& b){ return a.timestamp < b.timestamp; } );
-    tq->events =events;
-    _tracks.append( tq );
+/** The number of MIDI bytes per lap that coalescing saves */
+int
+EventQueue::coalescedBytes() const {
+    int bytes =0;
+    for( const auto& m : _merges ) bytes += m.bytes;
+    return bytes;
 }
 
 void 
@@ -96,20 +645,21 @@ EventQueue::restart( qint64 origin, qint64 now ) {
         // Find the first event that has its timestamp in the future
         tq->startTime =_now;
         tq->running =tq->start =tq->track->autoStart();
-        int i =0;
-        for( ; i < tq->events.count(); i++ ) {
-            if( tq->events[i].timestamp >= elapsedTrackTime( tq ) % tq->length )
-                break;
-        }
-        tq->cursor =i == tq->events.count() ? 0 : i;
+        seek( tq, elapsedTrackTime( tq ) % tq->length );
+        if( tq->heap.isEmpty() ) seek( tq, 0 );
         tq->lap =elapsedTrackTime( tq ) / tq->length;
         //startTrack( tq );
     }
+    seekSchedule();
 }
 
 void 
 EventQueue::start( qint64 now ) {
-    if( now != -1 ) _now = now;
+    // The position in the composition stood still since stop(), so the origin moves along
+    if( now != -1 ) {
+        _origin += now - _now;
+        _now = now;
+    }
     for( auto tq : _tracks ) {
         if( tq->start ) startTrack( tq );
     }
@@ -125,6 +675,32 @@ EventQueue::stop( qint64 now ) {
     }
 }
 
+/** Put the queue in the state it has @position msec after playback started, stopped at @now.
+ *  The composition is played silently up to there, so the tracks that triggers start, stop
+ *  or reset are in the right state. Call start() to continue from there. */
+void
+EventQueue::seekTo( qint64 position, const Composition* comp, qint64 now ) {
+    for( auto tq : _tracks ) tq->runningTime =0;
+    restart( 0, 0 );
+    for( ;; ) {
+        Event* e =nullptr;
+        while( (e =takeFront()) ) apply( e, comp );
+        if( _now >= position ) break;
+        _now += qMax( (qint64)1, minTimeUntilNextEvent( position - _now ) );
+    }
+    stop();
+    _origin =now - position;
+    _now =now;
+}
+
+/** Continue at @now with the tracks as they are, after they were changed through the queue
+ *  that owns them */
+void
+EventQueue::resume( qint64 now ) {
+    _now =now;
+    seekSchedule();
+}
+
 void 
 EventQueue::startTrack( const Track* t, qint64 now ) {
     TrackQueue* tq =find( t );
@@ -161,47 +737,93 @@ EventQueue::resetTrack( const Track* t, qint64 now  ) {
 
 void 
 EventQueue::resetTrack( EventQueue::TrackQueue* tq, qint64 now ) {
-    if( !tq ) return;
+    if( !tq || tq->scheduled ) return;
     if( now != -1 ) _now = now;
     tq->running =tq->track->autoStart();
     tq->runningTime =0;
     tq->startTime =tq->running ? _now : 0;
-    tq->offset =0; tq->normalizedOffset =0.;
-    tq->lap =0; tq->cursor =0;
+    tq->lap =0;
+    seek( tq, 0 );
 }
 
 void 
 EventQueue::advance( qint64 now, bool computeOffsets ) {
     _now =now;
     if( computeOffsets ) {
-        for( auto tq : _tracks ) {
-            tq->offset = elapsedTrackTime( tq ) % tq->length;
-            // tq->lap = elapsedTrackTime( tq ) / tq->length;
-            tq->normalizedOffset = (double)tq->offset / (double)tq->length;
+        // The running times are gathered first, the tracks may be changed by other queues
+        const int n =_tracks.count();
+        double* elapsed =_offsets.data();
+        for( int i =0; i < n; i++ )
+            elapsed[i] =(double)elapsedTrackTime( _tracks[i] );
+        lapOffsets( elapsed, _lengths.constData(), _inverses.constData(),
+                    _offsets.data(), _laps.data(), _positions.data(), n );
+    }
+}
+
+/** Apply the effect of @e on the state of the queue, i.e. stop, start or reset tracks.
+ *  This is all that is needed to follow playback without producing any output. */
+void
+EventQueue::apply( const Event* e, const Composition* comp ) {
+    switch( e->type ) {
+    case TriggerEvent:
+        if( !e->event ) break;
+        switch( e->event->type ) {
+        case Trigger::StopEvent:
+            stopTrack( e->trackQueue );
+            break;
+        case Trigger::StartEvent:
+            startTrack( comp->trackById( e->event->target ) );
+            break;
+        case Trigger::ResetEvent:
+            resetTrack( comp->trackById( e->event->target ) );
+            break;
+        default:
+            break;
+        }
+        break;
+    case LoopBeginEvent: {
+        int maxLoop = e->trackQueue->track->loopCount();
+        if( maxLoop > 0 && maxLoop == e->trackQueue->lap )
+            stopTrack( e->trackQueue );
+        break;
         }
+    default: break;
     }
 }
 
 EventQueue::Event* 
 EventQueue::takeFront( qint64 now ) {
     if( now != -1 ) _now = now;
+
+    // The static tracks are played from a single array
+    if( _clock && _clock->running ) {
+        const Scheduled& s =_schedule[_cursor];
+        const qint64 elapsed =elapsedTrackTime( _clock );
+        if( s.timestamp <= elapsed % _period && _lap == elapsed / _period ) {
+            _lateness =elapsed % _period - s.timestamp;
+            if( ++_cursor == _schedule.count() ) {
+                _cursor =0;
+                _lap++;
+            }
+            return s.event;
+        }
+    }
+
     // Find the first track that has an event due
-    for( auto tq : _tracks ) {
-        if( tq->cursor >= tq->events.count() ) continue;
+    for( auto tq : _dynamic ) {
+        if( tq->heap.isEmpty() ) continue;
         if( tq->running == false ) continue;
 
-        qint64 timestamp = tq->events[tq->cursor].timestamp;
+        qint64 timestamp = tq->frontTimestamp();
         qint64 elapsedLap =elapsedTrackTime( tq ) % tq->length;
         qint64 lap =elapsedTrackTime( tq ) / tq->length;
         // The current event must be due in the current lap
         if( timestamp <= elapsedLap
             && tq->lap == lap ) { 
-            Event* e =&tq->events[tq->cursor];
-            // Increment the cursor and the lap number if needed
-            if( ++tq->cursor == tq->events.count() ) {
-                tq->cursor =0;
-                tq->lap++;
-            }
+            Event* e =&tq->events[tq->frontIndex()];
+            _lateness =elapsedLap - timestamp;
+            // Move on to the next event and the next lap if needed
+            next( tq );
             return e;
         }
     }
@@ -211,12 +833,22 @@ EventQueue::takeFront( qint64 now ) {
 qint64 
 EventQueue::minTimeUntilNextEvent( qint64 max ) const {
     qint64 time =max;
+    if( _clock && _clock->running ) {
+        const qint64 timestamp =_schedule[_cursor].timestamp;
+        const qint64 elapsedPeriod =elapsedTrackTime( _clock ) % _period;
+        const qint64 lap =elapsedTrackTime( _clock ) / _period;
+        if( _cursor == 0 && _lap == lap + 1 )
+            time =qMin( time, timestamp + (_period - elapsedPeriod) );
+        else if( timestamp >= elapsedPeriod && _lap == lap )
+            time =qMin( time, timestamp - elapsedPeriod );
+    }
+
     // Find the track that has an event due in the shortest amount of time
-    for( const auto tq : _tracks ) {
-        if( tq->cursor >= tq->events.count() ) continue;
+    for( const auto tq : _dynamic ) {
+        if( tq->heap.isEmpty() ) continue;
         if( tq->running == false ) continue;
 
-        qint64 timestamp = tq->events[tq->cursor].timestamp;
+        qint64 timestamp = tq->frontTimestamp();
         qint64 elapsedLap =elapsedTrackTime( tq ) % tq->length;
         qint64 lap =elapsedTrackTime( tq ) / tq->length;
 
@@ -224,19 +856,186 @@ EventQueue::minTimeUntilNextEvent( qint64 max ) const {
             time =qMin( time, timestamp + (tq->length - elapsedLap) );
         else if( timestamp >= elapsedLap
                  && tq->lap == lap )
-            time =qMin( time, tq->events[tq->cursor].timestamp - elapsedLap );
+            time =qMin( time, timestamp - elapsedLap );
     }
     return time;
 }
 
+/** Whether no track is running, so no event can become due until one is started */
+bool
+EventQueue::isIdle() const {
+    for( const auto tq : _tracks )
+        if( tq->running ) return false;
+    return true;
+}
+
+/** Position the cursors of all axles of @tq at the first event not before @timestamp */
+void
+EventQueue::seek( TrackQueue* tq, qint64 timestamp ) {
+    tq->heap.clear();
+    tq->cursor =0;
+    for( int k =0; k < tq->axles.count(); k++ ) {
+        const Axle& a =tq->axles[k];
+        int lo =0, hi =k == 0 ? tq->events.count() : tq->repeating.count();
+        while( lo < hi ) {
+            const int mid =(lo + hi) / 2;
+            const qint64 ts =k == 0 ? tq->events[mid].timestamp : played( tq, a, mid );
+            if( ts < timestamp ) lo =mid + 1;
+            else hi =mid;
+        }
+        const int patch =(int)(std::lower_bound( a.patches.cbegin(), a.patches.cend(), lo,
+            []( const Patch& p, int position ) { return p.position < position; } ) - a.patches.cbegin());
+        AxleCursor& c =tq->cursors[k];
+        c ={ 0, k, lo, 0, patch };
+        tq->cursor += lo;
+        if( fill( tq, c ) ) tq->heap.append( key( c ) );
+    }
+    std::make_heap( tq->heap.begin(), tq->heap.end(), std::greater<qint64>() );
+}
+
+/** Take the front event of @tq off the heap and replace it by the next one of its axle.
+ *  When all axles have played their events, the next lap starts. */
+void
+EventQueue::next( TrackQueue* tq ) {
+    qint64* h =tq->heap.data();
+    const int n =tq->heap.count();
+    AxleCursor& front =tq->cursors[(int)(h[0] & 0xffff)];
+    front.position++;
+    tq->cursor++;
+    if( !fill( tq, front ) ) {
+        std::pop_heap( tq->heap.begin(), tq->heap.end(), std::greater<qint64>() );
+        tq->heap.removeLast();
+        if( tq->heap.isEmpty() ) {
+            tq->lap++;
+            seek( tq, 0 );
+        }
+        return;
+    }
+
+    // Let the next event of the axle sink to its place, which is usually near the top
+    const qint64 c =key( front );
+    int i =0;
+    for( int child =1; child < n; child =2 * i + 1 ) {
+        child += child + 1 < n && h[child + 1] < h[child];
+        if( c <= h[child] ) break;
+        h[i] =h[child];
+        i =child;
+    }
+    h[i] =c;
+}
+
+/** Find the event of @c at or after its position and fill in its index and timestamp.
+ *  Returns false if the axle has no events left in this lap. */
+bool
+EventQueue::fill( TrackQueue* tq, AxleCursor& c ) {
+    if( c.axle == 0 ) {
+        const int n =tq->events.count();
+        for( ; c.position < n; c.position++ ) {
+            const Event& e =tq->events[c.position];
+            if( e.silent & 1 ) continue;
+            c.index =c.position;
+            c.timestamp =e.timestamp;
+            return true;
+        }
+        return false;
+    }
+
+    const Axle& a =tq->axles[c.axle];
+    const int m =tq->repeating.count();
+    const quint64 bit =c.axle < 64 ? 1ULL << c.axle : 0;
+    for( ; c.position < m; c.position++ ) {
+        int q;
+        if( c.patch < a.patches.count() && a.patches[c.patch].position == c.position ) {
+            q =a.patches[c.patch++].index;
+            if( q < 0 ) {
+                c.index =-1 - q;
+                c.timestamp =tq->events[c.index].timestamp;
+                return true;
+            }
+        } else
+            q =a.wrap + c.position < m ? a.wrap + c.position : a.wrap + c.position - m;
+        const int i =tq->repeating[q].index;
+        if( (tq->silent & bit) && (tq->events[i].silent & bit) ) continue;
+        c.index =i;
+        c.timestamp =shifted( tq, a, q );
+        return true;
+    }
+    return false;
+}
+
 EventQueue::TrackQueue* 
-EventQueue::find( const Track* t ) {
+EventQueue::find( const Track* t ) const {
     for( auto tq : _tracks ) {
         if( tq->track == t ) return tq;
     }
     return nullptr;
 }
 
+/** Return the normalized offset [0..1) of @tq at time @now, which may lie between
+ *  the timestamps the queue has been advanced to. Used to interpolate the display. */
+double
+EventQueue::trackPosition( const TrackQueue* tq, double now ) const {
+    if( !tq || tq->length <= 0 ) return 0.0;
+    double t =tq->runningTime;
+    if( tq->running )
+        t += qMax( 0.0, now - (double)tq->startTime );
+    return std::fmod( t, (double)tq->length ) / (double)tq->length;
+}
+
+/** Set @positions to the trackPosition() of every track at @now, all at once */
+void
+EventQueue::trackPositions( double now, QVector<double>* positions ) const {
+    const int n =_tracks.count();
+    positions->resize( n );
+    double* t =positions->data();
+    for( int i =0; i < n; i++ ) {
+        const TrackQueue* tq =_tracks[i];
+        t[i] =tq->runningTime;
+        if( tq->running )
+            t[i] += qMax( 0.0, now - (double)tq->startTime );
+    }
+    lapOffsets( t, _lengths.constData(), _inverses.constData(), t, t, t, n );
+}
+
+/** Return the time (msec) at which the next section of @tq starts, or -1.
+ *  A track that is not running does not reach a section, so then the next section of
+ *  the first running track is used. */
+qint64
+EventQueue::nextSection( const TrackQueue* tq, qint64 now ) const {
+    tq =runningTrack( tq );
+    if( !tq || tq->track->sections().isEmpty() ) return -1;
+
+    const Track* t =tq->track;
+    const double pos =trackPosition( tq, now ) * t->length();
+    double next =t->sections().first().offset + t->length();
+    for( const auto& sec : t->sections() ) {
+        if( sec.offset > pos ) {
+            next =sec.offset;
+            break;
+        }
+    }
+    return now + (qint64)std::ceil( (next - pos) / t->tempo() * 1000.0 );
+}
+
+/** Return the time (msec) at which the next lap of @tq starts, or -1. Like nextSection(),
+ *  the first running track is used if @tq is not running. */
+qint64
+EventQueue::nextLap( const TrackQueue* tq, qint64 now ) const {
+    tq =runningTrack( tq );
+    if( !tq || tq->length <= 0 ) return -1;
+    const qint64 elapsed =tq->runningTime + (now - tq->startTime);
+    return now + (tq->length - elapsed % tq->length);
+}
+
+/** Return @tq if it is running, or else the first track that is */
+const EventQueue::TrackQueue*
+EventQueue::runningTrack( const TrackQueue* tq ) const {
+    if( tq && tq->running ) return tq;
+    for( auto t : _tracks )
+        if( t->running ) return t;
+    return nullptr;
+}
+
 qint64 
 EventQueue::elapsedTrackTime( const TrackQueue* tq ) const {
     if( !tq ) return 0;
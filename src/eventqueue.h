@@ -8,6 +8,8 @@
 #pragma once
 
 #include <QVector>
+#include <QHash>
+#include <QSet>
 //#include "event.h"
 #include "composition.h"
 
@@ -17,6 +19,11 @@ class QMidiEvent;
 //class Trigger;
 //class Trigger::Event;
 
+// Minimum number of sections for which the tracks are flattened in parallel
+#define PARALLEL_INIT_THRESHOLD 4096
+// Maximum number of events in the precompiled schedule of static tracks
+#define SCHEDULE_MAX_EVENTS (1 << 20)
+
 class EventQueue {
 public:
     enum EventType {
@@ -32,33 +39,115 @@ public:
         const Trigger* trigger;
         const Track::Section* section;
         TrackQueue* trackQueue;
+        int merged;             // Identical NoteOns of the same track folded into this one
+        int borrowed;           // Identical NoteOns of other tracks folded into this one
+        quint64 silent;         // Axles that do not play it, as coalesce() folded it there
+        int axle;               // The only axle that plays it, for a copy made by coalesce(), or 0
     };
 
     typedef QVector<Event> EventVectorT;
 
+    // A NoteOn that was removed by coalesce(), because another one plays the same note
+    struct Merge {
+        int track;              // Id of the track that plays the note
+        int source;             // Id of the track the removed NoteOn belonged to
+        qint64 timestamp;
+        int channel, note;
+        int bytes;              // MIDI bytes saved per lap
+    };
+
+    // An event that every axle plays
+    struct Repeated {
+        qint64 timestamp;       // Of the first axle
+        int index;              // In TrackQueue::events
+    };
+
+    // Where an axle plays its events in another order than the first axle
+    struct Patch {
+        int position;           // In the order the axle plays them
+        int index;              // Of the event in TrackQueue::repeating, or -1 less that of a copy in events
+    };
+
+    struct Axle {
+        double angle;           // Distance behind the first axle
+        qint64 offset;          // Time by which the events of the first axle are shifted (msec), less 1
+        int wrap;               // Position in TrackQueue::repeating of its first event in the lap
+        QVector<quint64> rounding;  // 2 bits per repeating event, 0 to 3 msec added to the offset
+        QVector<Patch> patches;
+    };
+
+    struct AxleCursor {
+        qint64 timestamp;       // Timestamp of the next event of the axle in this lap
+        int axle;               // Below 65536, see TrackQueue::heap
+        int position;           // Number of events of the axle that are behind in this lap
+        int index;              // Index of the next event in TrackQueue::events
+        int patch;              // Index of the next patch of the axle
+    };
+
+    /** The events of a track are stored once, for the first axle. The other axles play its
+     *  MIDI events shifted in time, and the stream of all axles is merged while playing,
+     *  through a heap that holds the next event of every axle.
+     *
+     * The timestamp of an event is rounded down to the msec from the angle of its section plus
+     * that of the axle, so shifting it by a fixed time can be 1 msec off either way. Every axle
+     * keeps what has to be added for each event, and where this changes the order of the
+     * events, a patch that gives the right one. */
     struct TrackQueue {
-        qint64 length, offset;  // Length in timestamp (msec)
+        qint64 length;          // Length in timestamp (msec)
         const Track* track;     // Corresponding Track object
-        EventVectorT events;    // Vector of queued (midi)events
-        int cursor, lap;        // Index in the event vector, n-th repeat cycle
+        EventVectorT events;    // Vector of queued (midi)events of the first axle
+        int cursor, lap;        // Number of events behind in this lap, n-th repeat cycle
         bool start, running;    // Track should start when playback is started, track is currently running
         qint64 runningTime, startTime;  // Time running so far, timestamp of start point
-        double normalizedOffset;        // offset on [0..1)
+        int index;              // Index of the track in the composition
+        bool scheduled;         // Played from the precompiled schedule, see buildSchedule()
+        QVector<Repeated> repeating;
+        quint64 silent;         // Axles that do not play some of the events
+        QVector<Axle> axles;
+        QVector<AxleCursor> cursors;    // One per axle
+        QVector<qint64> heap;   // Timestamp << 16 | axle, of the axles with events left in this lap
+
+        qint64 frontTimestamp() const { return heap.at( 0 ) >> 16; }
+        int frontIndex() const { return cursors.at( (int)(heap.at( 0 ) & 0xffff) ).index; }
     };
 
     typedef QVector<TrackQueue*> TrackQueuePtrVectorT;
+
+    struct Scheduled {
+        qint64 timestamp;       // Time in the hyperperiod (msec)
+        Event* event;
+    };
     
     EventQueue();
     ~EventQueue();
     void clear();
 
     void initialize( const Composition* );
+    // Exchange the tracks and state with @other, without allocating
+    void swap( EventQueue& other );
+    // Play the tracks at @indices of @source, which keeps owning them, see SchedulerShard
+    void share( const EventQueue& source, const QVector<int>& indices, const Composition* );
+    bool isShared() const { return _source != nullptr; }
+    // The tracks of the last initialize() were flattened on the thread pool
+    bool initializedInParallel() const { return _parallel; }
+
+    // Merge simultaneous identical NoteOns when the queue is initialized (off by default)
+    void setCoalescing( bool on ) { _coalescing =on; }
+    bool coalescing() const { return _coalescing; }
+    const QVector<Merge>& merges() const { return _merges; }
+    int coalescedBytes() const;
 
     void restart( qint64 origin, qint64 now );
     void start( qint64 now =-1 );
     void stop( qint64 now =-1 );
+    void seekTo( qint64 position, const Composition*, qint64 now );
+    void resume( qint64 now );
 
     void advance( qint64 now, bool computeOffsets =false );
+    // Of the i-th track, as computed by the last advance() with computeOffsets
+    qint64 offset( int i ) const { return (qint64)_offsets[i]; }
+    qint64 lap( int i ) const { return (qint64)_laps[i]; }
+    double normalizedOffset( int i ) const { return _positions[i]; }
 
     void startTrack( const Track*, qint64 now =-1 );
     void startTrack( TrackQueue*, qint64 now =-1  );
@@ -67,23 +156,77 @@ public:
     void resetTrack( const Track*, qint64 now =-1 );
     void resetTrack( TrackQueue*, qint64 now =-1  );
 
+    // The timestamp of the returned event is that of the first axle, see lateness()
     Event* takeFront( qint64 now =-1 );
-    TrackQueue* find( const Track* );
+    void apply( const Event*, const Composition* );
+    TrackQueue* find( const Track* ) const;
+
+    // How late the event last returned by takeFront() was, in msec
+    qint64 lateness() const { return _lateness; }
 
     qint64 origin() const { return _origin; }
     qint64 now() const { return _now; }
     qint64 minTimeUntilNextEvent( qint64 max ) const;
     inline qint64 minTimeUntilNextEvent( qint64 max, qint64 now ) { _now=now; return minTimeUntilNextEvent( max ); }
+    bool isIdle() const;
     inline qint64 elapsedTime() const { return _now - _origin; }
 
+    double trackPosition( const TrackQueue*, double now ) const;
+    void trackPositions( double now, QVector<double>* ) const;
+    qint64 nextSection( const TrackQueue*, qint64 now ) const;
+    qint64 nextLap( const TrackQueue*, qint64 now ) const;
+
     inline const TrackQueuePtrVectorT& tracks() const { return _tracks; }
 
+    // The tracks that always play the same are merged into one schedule of this period (msec)
+    qint64 hyperperiod() const { return _period; }
+    int scheduleSize() const { return _schedule.count(); }
+    int scheduledTrackCount() const { return _tracks.count() - _dynamic.count(); }
+
+    // Ids of tracks that are started, stopped, reset or muted from outside the composition, e.g.
+    // by MIDI input. They are never scheduled nor coalesced. Takes effect on the next initialize().
+    void setControlledTracks( const QSet<int>& ids ) { _controlled =ids; }
+    const QSet<int>& controlledTrackIds() const { return _controlled; }
+    // All tracks can be controlled from outside, e.g. over OSC. Also on the next initialize().
+    void setAllControlled( bool on ) { _allControlled =on; }
+    bool allControlled() const { return _allControlled; }
+
 private:
-    void addTrack( const Track* t, const Composition* );
+    typedef QHash<int, const Trigger*> TriggerMapT;
+    void addTrack( TrackQueue*, const Composition*, const TriggerMapT& );
+    void addCompiledTrack( TrackQueue*, const Composition* );
+    void addAxles( TrackQueue* );
+    void coalesce( const Composition* );
+    QSet<const Track*> controlledTracks( const Composition* ) const;
+    void buildSchedule( const QSet<const Track*>& controlled );
+    void seekSchedule();
+    static void seek( TrackQueue*, qint64 timestamp );
+    static void next( TrackQueue* );
+    static bool fill( TrackQueue*, AxleCursor& );
     qint64 elapsedTrackTime( const TrackQueue* ) const;
+    const TrackQueue* runningTrack( const TrackQueue* ) const;
+    void layoutTracks();
 
     TrackQueuePtrVectorT _tracks;
+    const EventQueue* _source;          // Owner of the tracks of a shared queue
     qint64 _origin;
     qint64 _now;
+    qint64 _lateness;
+    bool _coalescing;
+    bool _parallel;
+    QVector<Merge> _merges;
+
+    QSet<int> _controlled;
+    bool _allControlled;
+    TrackQueuePtrVectorT _dynamic;      // Tracks that are not scheduled
+    QVector<Scheduled> _schedule;
+    int _cursor, _lap;                  // Position in the schedule, n-th hyperperiod
+    qint64 _period;
+    TrackQueue* _clock;                 // A scheduled track, they all share its running time
+
+    // The lap lengths of the tracks and the offsets, laps and normalized offsets of the last
+    // advance(), one array each so they are computed for several tracks per instruction
+    QVector<double> _lengths, _inverses;
+    QVector<double> _offsets, _laps, _positions;
 
 };
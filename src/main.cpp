@@ -6,24 +6,299 @@
  */
 
 #include <QApplication>
+#include <QCoreApplication>
+#include <QGuiApplication>
 #include <QSurfaceFormat>
+#include <QFile>
+#include <QScopedPointer>
+#include <QThreadPool>
 #include <cstdio>
 
 #include "mainwindow.h"
+#include "composition.h"
+#include "compiledcomposition.h"
+#include "scoreexporter.h"
+#include "playhost.h"
+
+/** Compile the JSON composition at @in to its binary form at @out */
+static int
+compile( const QString& in, const QString& out ) {
+    QFile file( in );
+    if( !file.open( QIODevice::ReadOnly | QIODevice::Text) ) {
+        fprintf( stderr, "Could not open '%s' for reading.\n", qPrintable( in ) );
+        return 1;
+    }
+
+    QString err;
+    Composition comp =Composition::fromJson( file.readAll(), &err );
+    if( !comp.isValid() ) {
+        fprintf( stderr, "%s: %s\n", qPrintable( in ), qPrintable( err ) );
+        return 1;
+    }
+
+    if( !CompiledComposition::save( &comp, out, &err ) ) {
+        fprintf( stderr, "%s: %s\n", qPrintable( out ), qPrintable( err ) );
+        return 1;
+    }
+    return 0;
+}
+
+/** Load either a JSON or a compiled composition, depending on the file's extension */
+static Composition*
+loadComposition( const QString& path, QString* error ) {
+    if( path.endsWith( ".mtc", Qt::CaseInsensitive ) )
+        return CompiledComposition::load( path, error );
+
+    QFile file( path );
+    if( !file.open( QIODevice::ReadOnly | QIODevice::Text) ) {
+        *error ="Could not open given file for reading.";
+        return nullptr;
+    }
+    return new Composition( Composition::fromJson( file.readAll(), error ) );
+}
+
+/** Parse the name of a late policy, as given to --late */
+static PlayThread::LatePolicy
+latePolicyFromStr( const QString& str ) {
+    if( str == "drop" ) return PlayThread::DropLate;
+    if( str == "compress" ) return PlayThread::CompressLate;
+    return PlayThread::PlayLate;
+}
+
+/** Render the visualisation of a composition to images without a display:
+ *  --export <input> <directory|-> [--size WxH] [--fps N] [--duration SEC] [--threads N] [--dark]
+ *  With '-' as output, raw RGBX frames are written to stdout. */
+static int
+exportFrames( int argc, char *argv[] ) {
+    // Rendering to images needs no windowing system
+    if( qEnvironmentVariableIsEmpty( "QT_QPA_PLATFORM" ) )
+        qputenv( "QT_QPA_PLATFORM", "offscreen" );
+    QGuiApplication app( argc, argv );
+
+    const QString in( argv[2] ), out( argv[3] );
+    QString err;
+    // Declared before the exporter, which refers to it until it is destroyed
+    QScopedPointer<Composition> comp( loadComposition( in, &err ) );
+    if( comp.isNull() || !comp->isValid() ) {
+        fprintf( stderr, "%s: %s\n", qPrintable( in ), qPrintable( err ) );
+        return 1;
+    }
+
+    ScoreExporter exporter( comp.data() );
+    for( int i =4; i < argc; i++ ) {
+        const QString arg( argv[i] );
+        const QString value =i+1 < argc ? QString( argv[i+1] ) : QString();
+        if( arg == "--dark" ) {
+            exporter.setDarkPalette( true );
+            continue;
+        }
+        if( value.isEmpty() ) {
+            fprintf( stderr, "Missing value for '%s'\n", qPrintable( arg ) );
+            return 1;
+        }
+        i++;
+        if( arg == "--size" )
+            exporter.setSize( QSize( value.section( 'x', 0, 0 ).toInt(), value.section( 'x', 1, 1 ).toInt() ) );
+        else if( arg == "--fps" )
+            exporter.setFrameRate( value.toDouble() );
+        else if( arg == "--duration" )
+            exporter.setDuration( value.toDouble() );
+        else if( arg == "--threads" )
+            QThreadPool::globalInstance()->setMaxThreadCount( qMax( 1, value.toInt() ) );
+        else {
+            fprintf( stderr, "Unknown option '%s'\n", qPrintable( arg ) );
+            return 1;
+        }
+    }
+    if( exporter.size().isEmpty() || exporter.frameRate() <= 0.0 ) {
+        fprintf( stderr, "Invalid frame size or rate\n" );
+        return 1;
+    }
+
+    bool ok;
+    if( out == "-" ) {
+        QFile stdOut;
+        stdOut.open( stdout, QIODevice::WriteOnly );
+        ok =exporter.exportRaw( &stdOut, &err );
+    } else {
+        ok =exporter.exportImages( out, &err );
+    }
+    if( !ok )
+        fprintf( stderr, "%s: %s\n", qPrintable( out ), qPrintable( err ) );
+    else
+        fprintf( stderr, "Exported %d frames of %dx%d\n", exporter.frameCount(), 
+                 exporter.size().width(), exporter.size().height() );
+
+    return ok ? 0 : 1;
+}
+
+/** Play the rooms of a rooms file without a window: --host <rooms.json> [--osc [<address>:]<port>] */
+static int
+host( int argc, char *argv[] ) {
+    QCoreApplication app( argc, argv );
+
+    PlayHost host;
+    QString err;
+    if( !host.load( QString( argv[2] ), &err ) ) {
+        fprintf( stderr, "%s: %s\n", argv[2], qPrintable( err ) );
+        return 1;
+    }
+    for( int i =3; i < argc; i++ ) {
+        const QString arg( argv[i] );
+        if( arg == "--osc" && i+1 < argc ) {
+            const QString value( argv[++i] );
+            if( !host.setOscServer( value.contains( ':' ) ? value.section( ':', 0, -2 ) : QString(),
+                                    value.section( ':', -1 ).toUShort() ) )
+                return 1;
+            continue;
+        }
+        fprintf( stderr, "Unknown option '%s'\n", qPrintable( arg ) );
+        return 1;
+    }
+
+    printf( "Hosting %d rooms on %d threads\n", host.rooms().count(), host.workerCount() );
+    for( int i =0; i < host.rooms().count(); i++ ) {
+        const PlayHost::Room& r =host.rooms()[i];
+        printf( "%d\t%s\t'%s'%s\n", i, qPrintable( r.name ), qPrintable( r.port ), r.autoplay ? "\tplaying" : "" );
+        if( r.autoplay ) host.play( i );
+    }
+    return app.exec();
+}
 
 int main(int argc, char *argv[])
 {
     //Q_INIT_RESOURCE(miditrain);
 
+    // Compile a composition without starting the GUI: --compile <input.json> <output.mtc>
+    if( argc == 4 && QString( argv[1] ) == "--compile" )
+        return compile( argv[2], argv[3] );
+    if( argc >= 4 && QString( argv[1] ) == "--export" )
+        return exportFrames( argc, argv );
+    if( argc >= 3 && QString( argv[1] ) == "--host" )
+        return host( argc, argv );
+
     QApplication app(argc, argv);
 
     MainWindow window;
     window.show();
 
+    QStringList scenes, peers;
+    QString sync;
      for( int i =1; i < argc; i++ ) {
         // TODO: make commandline flags
-        window.openJsonFile( QString( argv[i] ) );
+        const QString arg( argv[i] );
+        if( arg == "--trace" && i+1 < argc ) {
+            window.setTraceFile( QString( argv[++i] ) );
+            continue;
+        }
+        // Polyphony limits: --voices <n>, --channel-voices <channel>:<n>, --steal oldest|quietest|none
+        if( arg == "--voices" && i+1 < argc ) {
+            window.voices().setPortLimit( QString( argv[++i] ).toInt() );
+            continue;
+        }
+        if( arg == "--channel-voices" && i+1 < argc ) {
+            const QString value( argv[++i] );
+            window.voices().setChannelLimit( value.section( ':', 0, 0 ).toInt(), value.section( ':', 1, 1 ).toInt() );
+            continue;
+        }
+        if( arg == "--steal" && i+1 < argc ) {
+            const QString value( argv[++i] );
+            window.voices().setPolicy( value == "quietest" ? VoiceTable::StealQuietest
+                                     : value == "none" ? VoiceTable::DropNew 
+                                     : VoiceTable::StealOldest );
+            continue;
+        }
+        // Real-time mode: --rt <priority>, --rt-policy fifo|rr, --rt-cpu <n>
+        if( arg == "--rt" && i+1 < argc ) {
+            window.realtime().enabled =true;
+            window.realtime().priority =QString( argv[++i] ).toInt();
+            continue;
+        }
+        if( arg == "--rt-policy" && i+1 < argc ) {
+            window.realtime().policy =QString( argv[++i] ) == "rr" ? RealtimeOptions::RoundRobin : RealtimeOptions::Fifo;
+            continue;
+        }
+        if( arg == "--rt-cpu" && i+1 < argc ) {
+            window.realtime().cpu =QString( argv[++i] ).toInt();
+            continue;
+        }
+        // Live control from a MIDI controller: --midi-map <map.json>
+        if( arg == "--midi-map" && i+1 < argc ) {
+            window.setMidiInput( QString( argv[++i] ) );
+            continue;
+        }
+        // Open Sound Control server: --osc [<address>:]<port>
+        if( arg == "--osc" && i+1 < argc ) {
+            const QString value( argv[++i] );
+            window.setOscServer( value.contains( ':' ) ? value.section( ':', 0, -2 ) : QString(),
+                                 value.section( ':', -1 ).toUShort() );
+            continue;
+        }
+        // Prometheus metrics: --metrics <file> or --metrics unix:<socket>
+        if( arg == "--metrics" && i+1 < argc ) {
+            window.setMetricsTarget( QString( argv[++i] ) );
+            continue;
+        }
+        // Late events: --late play|drop|compress, --late-threshold <msec>, --late-ramp <msec>,
+        // --late-track <id>:<policy>, --late-type <event type>:<policy>
+        if( arg == "--late" && i+1 < argc ) {
+            window.playThread()->setLatePolicy( latePolicyFromStr( QString( argv[++i] ) ) );
+            continue;
+        }
+        if( arg == "--late-threshold" && i+1 < argc ) {
+            window.playThread()->setLateThreshold( QString( argv[++i] ).toInt() );
+            continue;
+        }
+        if( arg == "--late-ramp" && i+1 < argc ) {
+            window.playThread()->setLateRamp( QString( argv[++i] ).toInt() );
+            continue;
+        }
+        if( arg == "--late-track" && i+1 < argc ) {
+            const QString value( argv[++i] );
+            window.playThread()->setTrackLatePolicy( value.section( ':', 0, 0 ).toInt(), latePolicyFromStr( value.section( ':', 1, 1 ) ) );
+            continue;
+        }
+        if( arg == "--late-type" && i+1 < argc ) {
+            const QString value( argv[++i] );
+            window.playThread()->setTypeLatePolicy( eventTypeFromStr( value.section( ':', 0, 0 ) ), latePolicyFromStr( value.section( ':', 1, 1 ) ) );
+            continue;
+        }
+        // Find the due events of the tracks on several threads: --shards <n>
+        if( arg == "--shards" && i+1 < argc ) {
+            window.playThread()->setShards( QString( argv[++i] ).toInt() );
+            continue;
+        }
+        if( arg == "--coalesce" ) {
+            window.setCoalescing( true );
+            continue;
+        }
+        // The same, and append every merge to a file: --coalesce-log <file>
+        if( arg == "--coalesce-log" && i+1 < argc ) {
+            window.setCoalescing( true, QString( argv[++i] ) );
+            continue;
+        }
+        // Play in phase with other instances: --sync [<address>:]<port>, and --sync-peer
+        // <address>:<port> for every other instance
+        if( arg == "--sync" && i+1 < argc ) {
+            sync =QString( argv[++i] );
+            continue;
+        }
+        if( arg == "--sync-peer" && i+1 < argc ) {
+            peers.append( QString( argv[++i] ) );
+            continue;
+        }
+        // Compositions to switch between: --scene <file>, once for every scene. They are
+        // opened after all other options, which apply to all of them.
+        if( arg == "--scene" && i+1 < argc ) {
+            scenes.append( QString( argv[++i] ) );
+            continue;
+        }
+        window.openFile( arg );
     }
+    if( !scenes.isEmpty() )
+        window.openScenes( scenes );
+    if( !sync.isEmpty() )
+        window.setSync( sync.contains( ':' ) ? sync.section( ':', 0, -2 ) : QString(), sync.section( ':', -1 ).toUShort(), peers );
 
     return app.exec();
 }
@@ -10,11 +10,20 @@
 #include "composition.h"
 #include "playthread.h"
 #include "eventqueue.h"
+#include "compiledcomposition.h"
+#include "trace.h"
+#include "midiinput.h"
+#include "oscserver.h"
+#include "syncpeer.h"
 
 #include <QFile>
+#include <QFileDialog>
 #include <QMessageBox>
 #include <QAction>
 #include <QMenuBar>
+#include <QScreen>
+#include <QWindow>
+#include <QGuiApplication>
 #include <QMidiOut.h>
 #include <cstdio>
 
@@ -22,8 +31,19 @@ MainWindow::MainWindow() :
     QMainWindow(), 
     //_playhead( nullptr ),
     _composition( nullptr ), 
+    _scene( -1 ),
     _thread( nullptr ),
     _midiout( nullptr ),
+    _traceBuffer( nullptr ),
+    _traceWriter( nullptr ),
+    _midiin( nullptr ),
+    _osc( nullptr ),
+    _exporter( nullptr ),
+    _sync( nullptr ),
+    _syncRevision( 0 ),
+    _syncAuthor( 0 ),
+    _nudge( 0 ),
+    _following( false ),
     _playing( false ),
     _restart( true ) { 
 
@@ -39,12 +59,25 @@ MainWindow::MainWindow() :
     QMenu* fileMenu =menuBar()->addMenu( tr("&File" ) );
     QMenu* playbackMenu =menuBar()->addMenu( tr("&Playback" ) );
 
+    QAction* openAct =new QAction( tr("&Open..."), this );
+    openAct->setShortcut( QKeySequence::Open );
+    connect( openAct, &QAction::triggered, this, &MainWindow::open );
+    fileMenu->addAction( openAct );
+
+    QAction* saveCompiledAct =new QAction( tr("Save &compiled..."), this );
+    connect( saveCompiledAct, &QAction::triggered, this, &MainWindow::saveCompiled );
+    fileMenu->addAction( saveCompiledAct );
 
     QAction* playbackAct =new QAction( tr("Play/pause"), this );
     playbackAct->setShortcut( QKeySequence( Qt::Key_Space ) );
     connect( playbackAct, &QAction::triggered, this, &MainWindow::togglePlayback );
     playbackMenu->addAction( playbackAct );
 
+    QAction* nextSceneAct =new QAction( tr("&Next scene"), this );
+    nextSceneAct->setShortcut( QKeySequence( Qt::Key_N ) );
+    connect( nextSceneAct, &QAction::triggered, this, &MainWindow::nextScene );
+    playbackMenu->addAction( nextSceneAct );
+
     _midiout =new QMidiOut();
     auto devices =_midiout->devices();
     for( auto it =devices.begin(); it != devices.end(); it++ ) {
@@ -70,58 +103,372 @@ MainWindow::MainWindow() :
     //connect( _thread, &PlayThread::positionAdvanced, this, &MainWindow::updatePosition );
 
     _timer =new QTimer( this );
+    _timer->setTimerType( Qt::PreciseTimer );
+    _timer->setSingleShot( true );
     connect( _timer, &QTimer::timeout, this, &MainWindow::tick );
+
+    _syncTimer =new QTimer( this );
+    connect( _syncTimer, &QTimer::timeout, this, &MainWindow::syncTick );
+    _syncStart =new QTimer( this );
+    _syncStart->setTimerType( Qt::PreciseTimer );
+    _syncStart->setSingleShot( true );
+    connect( _syncStart, &QTimer::timeout, this, &MainWindow::startSynced );
     
     _time.start();
+    _clock.setTimer( _time );
     _thread->setTimer( _time );
 }
 
 MainWindow::~MainWindow() { 
+    // The other instances play on
+    delete _sync;
+    _sync =nullptr;
     stop();
-    _thread->requestInterruption();
+    // No more commands may be posted once the thread is gone
+    delete _midiin;
+    delete _osc;
+    delete _exporter;
+    _thread->stop();
     _thread->quit();
     _thread->wait();
     delete _thread;
+    // The writer drains what the thread left in the buffer
+    delete _traceWriter;
+    delete _traceBuffer;
     //delete _playhead;
 }
 
+/** Trace the play thread to @path, in the Chrome trace event format */
+bool
+MainWindow::setTraceFile( const QString& path ) {
+    if( _playing || _traceWriter != nullptr ) return false;
+
+    _traceBuffer =new TraceBuffer();
+    _traceWriter =new TraceWriter( _traceBuffer, path );
+    QString err;
+    if( !_traceWriter->open( &err ) ) {
+        fprintf( stderr, "Could not open trace file '%s': %s\n", qPrintable( path ), qPrintable( err ) );
+        delete _traceWriter; _traceWriter =nullptr;
+        delete _traceBuffer; _traceBuffer =nullptr;
+        return false;
+    }
+    _traceWriter->start( QThread::LowPriority );
+    _thread->setTrace( _traceBuffer );
+    return true;
+}
+
+/** Listen to the MIDI input described by the map at @path */
+bool
+MainWindow::setMidiInput( const QString& path ) {
+    if( _playing || _midiin != nullptr ) return false;
+
+    _midiin =new MidiInput( _thread );
+    QString err;
+    if( !_midiin->loadMap( path, &err ) || !_midiin->open( &err ) ) {
+        fprintf( stderr, "%s: %s\n", qPrintable( path ), qPrintable( err ) );
+        delete _midiin;
+        _midiin =nullptr;
+        return false;
+    }
+    printf( "Listening to MIDI input '%s' with %d mappings\n", qPrintable( _midiin->deviceId() ), _midiin->mappings().count() );
+    _midiin->setTimer( _time );
+    connect( _midiin, &MidiInput::commandPosted, this, &MainWindow::commandPosted, Qt::QueuedConnection );
+
+    // Tracks that can be started, stopped or muted at any time cannot be on the static
+    // schedule, nor share notes with other tracks. Like coalescing, this applies to the next
+    // composition.
+    _queue.setControlledTracks( _midiin->controlledTracks() );
+    _thread->queue().setControlledTracks( _midiin->controlledTracks() );
+    return true;
+}
+
+bool
+MainWindow::setOscServer( const QString& address, quint16 port ) {
+    if( _osc != nullptr ) return false;
+
+    _osc =new OscServer( _thread );
+    QString err;
+    const QHostAddress host =address.isEmpty() ? QHostAddress( QHostAddress::LocalHost ) : QHostAddress( address );
+    if( !_osc->listen( host, port, &err ) ) {
+        fprintf( stderr, "Could not listen for OSC on port %d: %s\n", (int)port, qPrintable( err ) );
+        delete _osc;
+        _osc =nullptr;
+        return false;
+    }
+    printf( "Listening for OSC on %s:%d\n", qPrintable( host.toString() ), (int)_osc->port() );
+    _osc->setTimer( _time );
+    connect( _osc, &OscServer::transportPosted, this, &MainWindow::transportPosted, Qt::QueuedConnection );
+    // Any track can be started, stopped or muted over OSC, see setMidiInput()
+    _queue.setAllControlled( true );
+    _thread->queue().setAllControlled( true );
+    _osc->start( QThread::HighPriority );
+    return true;
+}
+
+bool
+MainWindow::setMetricsTarget( const QString& target ) {
+    if( _exporter != nullptr ) return false;
+
+    _exporter =new MetricsExporter( &_thread->metrics(), &_metrics, target );
+    QString err;
+    if( !_exporter->open( &err ) ) {
+        fprintf( stderr, "Could not publish metrics to '%s': %s\n", qPrintable( target ), qPrintable( err ) );
+        delete _exporter;
+        _exporter =nullptr;
+        return false;
+    }
+    _exporter->start( QThread::LowPriority );
+    return true;
+}
+
+bool
+MainWindow::setSync( const QString& address, quint16 port, const QStringList& peers ) {
+    if( _sync != nullptr ) return false;
+
+    _sync =new SyncPeer();
+    QString err;
+    const QHostAddress host =address.isEmpty() ? QHostAddress( QHostAddress::AnyIPv4 ) : QHostAddress( address );
+    if( !_sync->listen( host, port, &err ) ) {
+        fprintf( stderr, "Could not listen for peers on port %d: %s\n", (int)port, qPrintable( err ) );
+        delete _sync;
+        _sync =nullptr;
+        return false;
+    }
+    for( const auto& peer : peers ) {
+        const QHostAddress peerHost( peer.section( ':', 0, -2 ) );
+        if( peerHost.isNull() ) {
+            fprintf( stderr, "Invalid peer address '%s'\n", qPrintable( peer ) );
+            continue;
+        }
+        _sync->addPeer( peerHost, peer.section( ':', -1 ).toUShort() );
+    }
+    printf( "Synchronising as %016llx on %s:%d with %d peers\n", (unsigned long long)_sync->id(),
+            qPrintable( host.toString() ), (int)_sync->port(), peers.count() );
+    _sync->setTimer( _time );
+    connect( _sync, &SyncPeer::timelineChanged, this, &MainWindow::followTimeline, Qt::QueuedConnection );
+    _sync->start( QThread::HighPriority );
+    _syncTimer->start( SYNC_CONTROL );
+    return true;
+}
+
+/** Open either a JSON or a compiled composition, depending on the file's extension */
+bool 
+MainWindow::openFile( const QString& path ) {
+    if( path.endsWith( ".mtc", Qt::CaseInsensitive ) )
+        return openCompiledFile( path );
+    return openJsonFile( path );
+}
+
 bool 
 MainWindow::openJsonFile( const QString& path ) {
     if( _composition != nullptr ) {
         // Maybe we should ask to save the file?
     }
+    Composition *comp =loadJsonFile( path );
+    if( comp == nullptr ) return false;
+
+    setComposition( comp );
+
+    return true;
+}
+
+bool 
+MainWindow::openCompiledFile( const QString& path ) {
+    Composition *comp =loadCompiledFile( path );
+    if( comp == nullptr ) return false;
+
+    setComposition( comp );
+
+    return true;
+}
+
+/** Parse the JSON composition at @path, or return null after telling what is wrong with it */
+Composition*
+MainWindow::loadJsonFile( const QString& path ) {
     QFile file( path );
     if( !file.open( QIODevice::ReadOnly | QIODevice::Text) ) {
         QMessageBox::critical( this, this->windowTitle(), "Could not open given file for reading." );
-        return false;
+        return nullptr;
     }
 
     QString err;
-    Composition *comp =new Composition();
-    *comp =Composition::fromJson( file.readAll(), &err );
+    Composition *comp =new Composition( Composition::fromJson( file.readAll(), &err ) );
 
     if( !comp->isValid() ) {
         QMessageBox::critical( this, this->windowTitle(), err );
         delete comp;
-        return false;
+        return nullptr;
     }
+    return comp;
+}
 
-    setComposition( comp );
+Composition*
+MainWindow::loadCompiledFile( const QString& path ) {
+    QString err;
+    Composition *comp =CompiledComposition::load( path, &err );
 
+    if( comp == nullptr || !comp->isValid() ) {
+        QMessageBox::critical( this, this->windowTitle(), err );
+        delete comp;
+        return nullptr;
+    }
+    return comp;
+}
+
+/** Open the compositions at @paths as scenes and show the first one. They are all parsed and
+ *  their event queues built here, so switching to another one while playing takes no time. */
+bool
+MainWindow::openScenes( const QStringList& paths ) {
+    QVector<Composition*> comps;
+    for( const auto& path : paths ) {
+        Composition* comp =path.endsWith( ".mtc", Qt::CaseInsensitive ) ? loadCompiledFile( path ) : loadJsonFile( path );
+        if( comp == nullptr ) {
+            qDeleteAll( comps );
+            return false;
+        }
+        comps.append( comp );
+    }
+    if( comps.isEmpty() ) return false;
+
+    clearComposition();
+    qint64 rebuild =0;
+    for( auto comp : comps ) {
+        EventQueue* q =new EventQueue();
+        q->setControlledTracks( _queue.controlledTrackIds() );
+        q->setAllControlled( _queue.allControlled() );
+        TimeVarT t0 =timeNow();
+        q->initialize( comp );
+        rebuild += durationUs( timeNow() - t0 );
+        _sceneQueues.append( q );
+        if( _thread->addScene( comp ) >= 0 ) rebuild += _thread->buildTime();
+    }
+    _scenes =comps;
+    _thread->setScene( 0 );
+    showScene( 0, _clock.elapsed() );
+    _metrics.rebuild.store( rebuild, std::memory_order_relaxed );
+    printf( "Built the event queues of %d scenes in %lld us\n", _scenes.count(), (long long)rebuild );
+    return true;
+}
+
+bool 
+MainWindow::saveCompiledFile( const QString& path ) {
+    if( _composition == nullptr ) return false;
+    QString err;
+    if( !CompiledComposition::save( _composition, path, &err ) ) {
+        QMessageBox::critical( this, this->windowTitle(), err );
+        return false;
+    }
     return true;
 }
+
+void
+MainWindow::open() {
+    QString path =QFileDialog::getOpenFileName( this, tr("Open composition"), QString(),
+        tr("Compositions (*.json *.mtc);;JSON compositions (*.json);;Compiled compositions (*.mtc)") );
+    if( !path.isEmpty() )
+        openFile( path );
+}
+
+void
+MainWindow::saveCompiled() {
+    if( _composition == nullptr ) return;
+    QString path =QFileDialog::getSaveFileName( this, tr("Save compiled composition"), QString(),
+        tr("Compiled compositions (*.mtc)") );
+    if( !path.isEmpty() )
+        saveCompiledFile( path );
+}
     
 void 
 MainWindow::setComposition( Composition* comp ) {
-    if( _composition != nullptr ) {
-        if( _playing ) stop();
-        delete _composition;
-    }
+    clearComposition();
     _composition =comp;
     //_playhead->initialize( comp );
+    // Only the event queues are timed, not the score or the shards
+    TimeVarT t0 =timeNow();
     _queue.initialize( comp );
+    qint64 rebuild =durationUs( timeNow() - t0 );
     _scoreWidget->setComposition( comp );
     _thread->setComposition( comp );
+    rebuild += _thread->buildTime();
+    _metrics.rebuild.store( rebuild, std::memory_order_relaxed );
+    printf( "Initialized event queues for %d tracks in %lld us%s\n", comp->tracks().count(), (long long)rebuild,
+            _queue.initializedInParallel() ? " on the thread pool" : "" );
+
+    const EventQueue& q =_thread->queue();
+    if( q.scheduledTrackCount() > 0 )
+        printf( "Scheduled %d static tracks: %d events over %lld ms\n",
+                q.scheduledTrackCount(), q.scheduleSize(), (long long)q.hyperperiod() );
+    if( q.coalescing() ) {
+        printf( "Coalesced %d notes, saving %d bytes per lap\n", q.merges().count(), q.coalescedBytes() );
+        if( !_coalescingLog.isEmpty() ) writeMerges( q );
+    }
+}
+
+/** Delete the composition, or all scenes */
+void
+MainWindow::clearComposition() {
+    if( _playing ) stop();
+    _thread->clearScenes();
+    if( _scenes.isEmpty() ) delete _composition;
+    qDeleteAll( _scenes );
+    qDeleteAll( _sceneQueues );
+    _scenes.clear();
+    _sceneQueues.clear();
+    _scene =-1;
+    _composition =nullptr;
+}
+
+/** Show scene @index from @now on, like the play thread plays it */
+void
+MainWindow::showScene( int index, qint64 now ) {
+    if( _scene >= 0 ) _queue.swap( *_sceneQueues[_scene] );
+    _queue.swap( *_sceneQueues[index] );
+    _queue.restart( now, now );
+    _scene =index;
+    _composition =_scenes[index];
+    _scoreWidget->setComposition( _composition );
+}
+
+/** Switch to scene @index. While playing, the switch waits for the next section (@quantize 1)
+ *  or lap (2) of the first running track, or is made right away (0). */
+void
+MainWindow::switchScene( int index, int quantize ) {
+    if( index < 0 || index >= _scenes.count() ) return;
+    if( _playing ) {
+        PlayThread::Command c ={ PlayThread::Command::Scene, quantize == 2 ? 1 : 0, index, quantize > 0, _time.nsecsElapsed(), 0 };
+        if( _thread->postCommand( c ) ) commandPosted();
+        return;
+    }
+    _thread->setScene( index );
+    showScene( index, _clock.elapsed() );
+    _restart =true;
+}
+
+void
+MainWindow::nextScene() {
+    if( !_scenes.isEmpty() )
+        switchScene( (_scene + 1) % _scenes.count() );
+}
+
+void
+MainWindow::setCoalescing( bool on, const QString& log ) {
+    _thread->queue().setCoalescing( on );
+    _coalescingLog =log;
+}
+
+/** Append the merges of @q to the coalescing log, with the name of the composition */
+void
+MainWindow::writeMerges( const EventQueue& q ) {
+    QFile file( _coalescingLog );
+    if( !file.open( QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text ) ) {
+        fprintf( stderr, "Could not open '%s' for writing\n", qPrintable( _coalescingLog ) );
+        return;
+    }
+    QByteArray out =("# " + _composition->name() + "\n").toUtf8();
+    for( const auto& m : q.merges() )
+        out += QString( "Coalesced note %1 on channel %2 at %3 ms: track %4 into track %5\n" )
+            .arg( m.note ).arg( m.channel ).arg( m.timestamp ).arg( m.source ).arg( m.track ).toUtf8();
+    file.write( out );
 }
 
 void
@@ -133,9 +480,24 @@ MainWindow::togglePlayback() {
 void 
 MainWindow::start() {
     if( _playing || _composition == nullptr) return;
+    if( _sync != nullptr && !_following ) {
+        SyncPeer::Timeline t =_sync->timeline();
+        // Join the others, or have all start a little later from where this one is
+        if( t.playing ) {
+            startSynced();
+            return;
+        }
+        t.playing =true;
+        t.anchor =_time.nsecsElapsed() + SYNC_LEAD * 1000000LL;
+        t.position =_restart ? 0 : (_stoptime - _queue.origin()) * 1000000;
+        t.scale =_clock.scale();
+        _sync->propose( t );
+        followTimeline();
+        return;
+    }
     _playing =true;
 
-    qint64 t =_time.elapsed();
+    qint64 t =_clock.elapsed();
     if( _restart ) {
         //_playhead->restart( t, t );
         _queue.restart( t, t );
@@ -149,29 +511,122 @@ MainWindow::start() {
         _thread->queue().start( t );
     }
     _thread->start(QThread::HighPriority);
-    _tick =0;
-    _timer->start( UPDATE_PRECISION );
+    scheduleFrame( true );
 }
 
 void 
 MainWindow::stop() {
+    // While waiting for the others to start, the start can still be called off
+    if( !_playing && (_sync == nullptr || !_syncStart->isActive()) ) return;
+    if( _sync != nullptr && !_following ) {
+        SyncPeer::Timeline t =_sync->timeline();
+        const qint64 wall =_time.nsecsElapsed();
+        t.position =t.positionAt( wall );
+        t.anchor =wall;
+        t.playing =false;
+        _sync->propose( t );
+        followTimeline();
+        return;
+    }
     if( !_playing ) return;
     _playing =false;
 
     _timer->stop();
-    qint64 t =_time.elapsed();
-    _thread->requestInterruption();
+    qint64 t =_clock.elapsed();
+    _thread->stop();
     _stoptime =t;
     _restart =false;
 
-    _queue.stop( t );
     while( _thread->isRunning() ) {}
     _thread->queue().stop( t );
+    // Catch up with what the thread did before it stopped, then play at the normal rate again
+    followExecuted();
+    _queue.stop( t );
+    if( _nudge != 0 ) {
+        const qint64 at =_clock.nsecsElapsed();
+        _clock.setNudge( 1.0, at );
+        _thread->clock().setNudge( 1.0, at );
+        _nudge =0;
+    }
+    if( _sync != nullptr ) reportSync();
+    const PlayThread::Latency& l =_thread->commandLatency();
+    if( l.count > 0 )
+        printf( "Carried out %llu commands, latency min %.1f avg %.1f max %.1f us\n", (unsigned long long)l.count,
+                l.min / 1e3, l.total / 1e3 / l.count, l.max / 1e3 );
+    if( _thread->ignoredCommands() > 0 )
+        printf( "Ignored %llu commands for tracks that are not in the composition or cannot be controlled\n",
+                (unsigned long long)_thread->ignoredCommands() );
+    if( _thread->droppedCommands() > 0 )
+        printf( "Dropped %llu commands as the mailbox of their shard was full\n",
+                (unsigned long long)_thread->droppedCommands() );
+    PlayMetrics::Snapshot metrics;
+    _thread->metrics().snapshot( &metrics );
+    if( metrics.late[PlayThread::PlayLate] + metrics.late[PlayThread::DropLate] + metrics.late[PlayThread::CompressLate] > 0 )
+        printf( "Late events: played %llu, dropped %llu, compressed %llu\n",
+                (unsigned long long)metrics.late[PlayThread::PlayLate],
+                (unsigned long long)metrics.late[PlayThread::DropLate],
+                (unsigned long long)metrics.late[PlayThread::CompressLate] );
+    if( _thread->queue().coalescing() )
+        printf( "Coalescing saved %llu bytes of MIDI output\n", (unsigned long long)_thread->coalescedBytes() );
 //    for( int i =0; i < 16; i++ )
 //        _midiout->controlChange( i, 123, 0 );
 //    _thread->debug();
 }
 
+/** Continue playback from @position msec after the start of the composition */
+void
+MainWindow::seek( qint64 position ) {
+    if( _composition == nullptr ) return;
+    if( _sync != nullptr && !_following ) {
+        SyncPeer::Timeline t =_sync->timeline();
+        t.anchor =_time.nsecsElapsed();
+        t.position =position * 1000000;
+        _sync->propose( t );
+        followTimeline();
+        return;
+    }
+    const bool playing =_playing;
+    stop();
+    const qint64 t =_clock.elapsed();
+    _queue.seekTo( position, _composition, t );
+    _thread->queue().seekTo( position, _composition, t );
+    _restart =false;
+    _stoptime =t;
+    if( playing )
+        start();
+    else {
+        _queue.advance( t, true );
+        _scoreWidget->updatePositions( t );
+    }
+}
+
+/** Play at @scale times the tempo of the composition */
+void
+MainWindow::setTempoScale( double scale ) {
+    if( scale <= 0.0 ) return;
+    if( _sync != nullptr && !_following ) {
+        SyncPeer::Timeline t =_sync->timeline();
+        const qint64 wall =_time.nsecsElapsed();
+        t.position =t.positionAt( wall );
+        t.anchor =wall;
+        // As precise as the play thread takes it
+        t.scale =qRound( scale * 1000.0 ) / 1000.0;
+        _sync->propose( t );
+        followTimeline();
+        return;
+    }
+    // While playing, the play thread decides when the new tempo takes effect and the
+    // display follows in tick()
+    if( _playing ) {
+        PlayThread::Command c ={ PlayThread::Command::Tempo, -1, qRound( scale * 1000.0 ), false, _time.nsecsElapsed(), 0 };
+        if( _thread->postCommand( c ) ) commandPosted();
+        return;
+    }
+    const qint64 at =_clock.nsecsElapsed();
+    _clock.setScale( scale, at );
+    _thread->clock().setScale( scale, at );
+}
+
 /*void 
 MainWindow::updatePosition( PlayHead ph ) {
    // *_playhead =ph;
@@ -181,55 +636,209 @@ MainWindow::updatePosition( PlayHead ph ) {
     
 void 
 MainWindow::tick() {
-    _queue.advance( _time.elapsed(), true );
-
-    bool debug =false;
+    _queue.advance( _clock.elapsed(), true );
 
     EventQueue::Event* e =nullptr;
+    quint64 applied =0;
     while( (e = _queue.takeFront()) ) {
-        if( debug ) printf( "%lld: ", _queue.now() );
-        switch( e->type ) {
-        case EventQueue::TriggerEvent:
-            if( debug ) printf( "(TRIGGER) " );
-            switch( e->event->type ) {
-            case Trigger::MidiEvent:
-                if( debug ) printf( "Midi Event " );
-                break;
-            case Trigger::StopEvent:
-                if( debug ) printf( "Stop " );
-                _queue.stopTrack( e->trackQueue );
-                break;
-            case Trigger::StartEvent:
-                if( debug ) printf( "Start " );
-                _queue.startTrack( _composition->trackById( e->event->target ) );
-                break;
-            case Trigger::ResetEvent:
-                if( debug ) printf( "Reset " );
-                _queue.resetTrack( _composition->trackById( e->event->target ) );
-                break;
-            case Trigger::NoEvent:
-            default:
-                break;
-            }
-            
-            break;
-        case EventQueue::LoopBeginEvent: {
-            if( debug ) printf( "(LOOPBEGIN) " );
-            int maxLoop = e->trackQueue->track->loopCount();
-            if( maxLoop > 0 && maxLoop == e->trackQueue->lap ) {
-                _queue.stopTrack( e->trackQueue );
-            }
-            break;
-            }
-        case EventQueue::ImplicitNoteOffEvent:
-            if( debug ) printf( "(IMPLICITNOTEOFF) " );
-        default: break;
-        } 
-        if( debug ) printf( "\n" );
+        _queue.apply( e, _composition );
+        applied++;
     }
+    addCounter( _metrics.applied, applied );
+    addCounter<quint64>( _metrics.frames, 1 );
+
+    followExecuted();
     
-    if( (_tick % DISPLAY_PRECISION) == 0 )
-        _scoreWidget->update();
+    // Draw the trains where they are now, rather than at the last whole millisecond
+    _scoreWidget->updatePositions( _clock.nsecsElapsed() / 1e6 );
+
+    // Stopped tracks can only be started by a running one, so if none are left
+    // nothing will move until playback is restarted
+    if( !isAnimating() ) return;
+    scheduleFrame( false );
+}
+
+/** Follow the tracks that were changed from the MIDI input or over OSC, and the clock */
+void
+MainWindow::followExecuted() {
+    PlayThread::Command c;
+    while( _thread->takeExecuted( &c ) ) {
+        if( c.type == PlayThread::Command::Tempo ) {
+            _clock.setScale( c.value / 1000.0, c.executed * 1000000 );
+            continue;
+        }
+        if( c.type == PlayThread::Command::Nudge ) {
+            _clock.setNudge( 1.0 + c.value / 1e6, c.executed * 1000000 );
+            continue;
+        }
+        if( c.type == PlayThread::Command::Scene ) {
+            showScene( c.value, c.executed );
+            continue;
+        }
+        EventQueue::TrackQueue* tq =_queue.find( _composition->trackById( c.track ) );
+        if( !tq ) continue;
+        if( c.type == PlayThread::Command::Start ) _queue.startTrack( tq, c.executed );
+        else if( c.type == PlayThread::Command::Stop ) _queue.stopTrack( tq, c.executed );
+        else if( c.type == PlayThread::Command::Reset ) _queue.resetTrack( tq, c.executed );
+    }
+}
+
+/** A track may have been started from the MIDI input, so the trains need to be drawn again */
+void
+MainWindow::commandPosted() {
+    if( _playing && !_timer->isActive() )
+        scheduleFrame( true );
+}
+
+/** Carry out the transport messages received over OSC */
+void
+MainWindow::transportPosted() {
+    OscServer::Transport t;
+    while( _osc->takeTransport( &t ) ) {
+        // The window has a single composition
+        if( t.room != 0 ) continue;
+        switch( t.type ) {
+        case OscServer::Transport::Play: start(); break;
+        case OscServer::Transport::Stop: stop(); break;
+        case OscServer::Transport::Seek: seek( (qint64)t.value ); break;
+        case OscServer::Transport::Tempo: setTempoScale( t.value ); break;
+        case OscServer::Transport::Load: openFile( QString::fromLocal8Bit( t.path ) ); break;
+        case OscServer::Transport::Scene: switchScene( (int)t.value, t.quantize ); break;
+        default: break;
+        }
+    }
+}
+
+/** Play along with the timeline, after this or another instance changed it */
+void
+MainWindow::followTimeline() {
+    if( _sync == nullptr ) return;
+    const SyncPeer::Timeline t =_sync->timeline();
+    if( t.revision == _syncRevision && t.author == _syncAuthor ) return;
+    _syncRevision =t.revision;
+    _syncAuthor =t.author;
+
+    _following =true;
+    _syncStart->stop();
+    // Stopped first, so the play thread does not miss a change of tempo
+    if( !t.playing ) stop();
+    if( qAbs( t.scale - _clock.scale() ) > 1e-6 ) setTempoScale( t.scale );
+    const qint64 wall =_time.nsecsElapsed();
+    if( !t.playing ) {
+        const qint64 position =_restart ? 0 : _stoptime - _queue.origin();
+        if( qAbs( position - t.position / 1000000 ) > SYNC_SEEK )
+            seek( t.position / 1000000 );
+    } else if( !_playing ) {
+        // Start when the others do, or join them if they did already
+        const qint64 wait =(t.anchor - wall + 999999) / 1000000;
+        if( wait > 0 )
+            _syncStart->start( (int)wait );
+        else
+            startSynced();
+    } else {
+        // Seeked, or the tempo changed
+        followExecuted();
+        const qint64 error =_clock.fromWall( wall ) - _queue.origin() * 1000000 - t.positionAt( wall );
+        if( qAbs( error ) > SYNC_SEEK * 1000000LL )
+            seek( qMax( (qint64)0, t.positionAt( _time.nsecsElapsed() ) / 1000000 ) );
+    }
+    _following =false;
+}
+
+/** Start playing where the timeline is now */
+void
+MainWindow::startSynced() {
+    const SyncPeer::Timeline t =_sync->timeline();
+    if( _playing || !t.playing || _composition == nullptr ) return;
+    _following =true;
+    seek( qMax( (qint64)0, t.positionAt( _time.nsecsElapsed() ) / 1000000 ) );
+    start();
+    _following =false;
+}
+
+/** Nudge the play clock towards the timeline, so the instances stay in phase */
+void
+MainWindow::syncTick() {
+    if( _sync == nullptr ) return;
+    followExecuted();
+    const SyncPeer::Timeline t =_sync->timeline();
+    qint64 phase =SYNC_NO_PHASE;
+    if( _playing && t.playing ) {
+        const qint64 wall =_time.nsecsElapsed();
+        phase =_clock.fromWall( wall ) - _queue.origin() * 1000000 - t.positionAt( wall );
+        if( qAbs( phase ) > SYNC_JUMP * 1000000LL ) {
+            // Too far off to catch up unnoticed
+            _following =true;
+            seek( qMax( (qint64)0, t.positionAt( _time.nsecsElapsed() ) / 1000000 ) );
+            _following =false;
+            phase =SYNC_NO_PHASE;
+        } else {
+            // Make up for the error in SYNC_SLEW msec, but never run much faster or slower
+            const qint32 nudge =(qint32)qBound( (qint64)-SYNC_MAX_NUDGE, -phase / SYNC_SLEW, (qint64)SYNC_MAX_NUDGE );
+            if( nudge != _nudge ) {
+                PlayThread::Command c ={ PlayThread::Command::Nudge, -1, nudge, false, _time.nsecsElapsed(), 0 };
+                if( _thread->postCommand( c ) ) _nudge =nudge;
+            }
+        }
+    }
+    _sync->setPhase( phase );
+
+    // The peers report their phase the same way, the difference is how far apart the two play
+    const auto peers =_sync->peers();
+    qint64 offset =0, rtt =0;
+    for( const auto& p : peers ) {
+        rtt =qMax( rtt, p.rtt );
+        if( phase != SYNC_NO_PHASE && p.phase != SYNC_NO_PHASE )
+            offset =qMax( offset, qAbs( phase - p.phase ) );
+    }
+    _metrics.syncPeers.store( peers.count(), std::memory_order_relaxed );
+    _metrics.syncOffset.store( offset, std::memory_order_relaxed );
+    _metrics.syncRtt.store( rtt, std::memory_order_relaxed );
+}
+
+/** Print how far this instance was from every peer when playback stopped */
+void
+MainWindow::reportSync() {
+    const qint64 phase =_sync->phase();
+    for( const auto& p : _sync->peers() ) {
+        if( phase != SYNC_NO_PHASE && p.phase != SYNC_NO_PHASE )
+            printf( "Peer %016llx: %+.3f ms ahead, clock offset %+.3f ms, round trip %.3f ms\n", (unsigned long long)p.id,
+                    (phase - p.phase) / 1e6, p.offset / 1e6, p.rtt / 1e6 );
+        else
+            printf( "Peer %016llx: clock offset %+.3f ms, round trip %.3f ms\n", (unsigned long long)p.id,
+                    p.offset / 1e6, p.rtt / 1e6 );
+    }
+}
+
+/** Return the time between two frames on the screen the window is on, in nsec */
+qint64
+MainWindow::frameInterval() const {
+    QScreen* screen =windowHandle() ? windowHandle()->screen() : QGuiApplication::primaryScreen();
+    qreal rate =screen ? screen->refreshRate() : 0.0;
+    if( rate <= 0.0 ) rate =DEFAULT_REFRESH_RATE;
+    return (qint64)(1e9 / rate);
+}
+
+/** Start the timer for the next frame, or the first one when @restart. The frames are kept
+ *  on a grid of the exact refresh interval, so they do not drift against the screen the way
+ *  a timer of whole milliseconds would. The interval is read every frame, as the window may
+ *  have been moved to a screen with a different refresh rate. */
+void
+MainWindow::scheduleFrame( bool restart ) {
+    const qint64 now =_time.nsecsElapsed();
+    const qint64 interval =frameInterval();
+    if( restart ) _nextFrame =now;
+    _nextFrame += interval;
+    // Frames that were missed are skipped rather than drawn in a hurry
+    if( _nextFrame <= now )
+        _nextFrame += ((now - _nextFrame) / interval + 1) * interval;
+    _timer->start( (int)((_nextFrame - now + 500000) / 1000000) );
+}
 
-    _tick += UPDATE_PRECISION;
+/** Return true if any of the trains is moving */
+bool
+MainWindow::isAnimating() const {
+    for( auto tq : _queue.tracks() )
+        if( tq->running ) return true;
+    return false;
 }
@@ -14,8 +14,8 @@
 #include <QTimer>
 #include <QElapsedTimer>
 
-#define UPDATE_PRECISION 5
-#define DISPLAY_PRECISION 30
+// Used when the refresh rate of the screen cannot be determined
+#define DEFAULT_REFRESH_RATE 60
 
 class ScoreWidget;
 class Composition;
@@ -23,6 +23,12 @@ class EventQueue;
 //class PlayHead;
 //class PlayThread;
 class QMidiOut;
+class TraceBuffer;
+class TraceWriter;
+class MidiInput;
+class OscServer;
+class MetricsExporter;
+class SyncPeer;
 
 class MainWindow : public QMainWindow
 {
@@ -32,33 +38,106 @@ public:
     MainWindow();
     ~MainWindow();
 
+    bool openFile( const QString& path );
     bool openJsonFile( const QString& path );
+    bool openCompiledFile( const QString& path );
+    // Open several compositions at once, to switch between them with switchScene()
+    bool openScenes( const QStringList& paths );
+    bool saveCompiledFile( const QString& path );
+
+    bool setTraceFile( const QString& path );
+
+    // Start, stop, reset and mute tracks from a MIDI controller, as described by the map at @path.
+    // Applies to the next composition.
+    bool setMidiInput( const QString& mapPath );
+
+    // Accept Open Sound Control messages on @port of @address
+    bool setOscServer( const QString& address, quint16 port );
+
+    // Publish metrics in the Prometheus text format to a file, or to a socket as "unix:<path>"
+    bool setMetricsTarget( const QString& target );
+
+    // Play in phase with the instances at @peers ("<address>:<port>"), from @port of @address
+    bool setSync( const QString& address, quint16 port, const QStringList& peers );
+
+    // Polyphony limits of the MIDI output
+    VoiceTable& voices() { return _thread->voices(); }
+
+    // Real-time scheduling of the play thread
+    RealtimeOptions& realtime() { return _thread->realtime(); }
+
+    // The play thread, to configure how it handles late events
+    PlayThread* playThread() const { return _thread; }
+
+    // Merge simultaneous identical notes before they are sent, applies to the next composition.
+    // Every merge is appended to @log when given.
+    void setCoalescing( bool on, const QString& log =QString() );
 
     void setComposition( Composition* );
     Composition* composition() const { return _composition; }
 
 public slots:
+    void open();
+    void saveCompiled();
     void togglePlayback();
     void start();
     void stop();
+    void seek( qint64 position );
+    void setTempoScale( double scale );
+    void switchScene( int index, int quantize =1 );
+    void nextScene();
     //void updatePosition( PlayHead );
 
 private slots:
     void tick();
+    void commandPosted();
+    void transportPosted();
+    void followTimeline();
+    void startSynced();
+    void syncTick();
+
+private:
+    qint64 frameInterval() const;
+    void scheduleFrame( bool restart );
+    bool isAnimating() const;
+    Composition* loadJsonFile( const QString& path );
+    Composition* loadCompiledFile( const QString& path );
+    void clearComposition();
+    void showScene( int index, qint64 now );
+    void followExecuted();
+    void reportSync();
+    void writeMerges( const EventQueue& q );
 
 private:
     ScoreWidget* _scoreWidget;
     //PlayHead *_playhead;
     EventQueue _queue;
     Composition* _composition;
+    QVector<Composition*> _scenes;      // Owned, _composition is one of them if there are any
+    QVector<EventQueue*> _sceneQueues;  // For the display, see PlayThread::addScene()
+    int _scene;
     PlayThread* _thread;
     QMidiOut *_midiout;
+    TraceBuffer* _traceBuffer;
+    TraceWriter* _traceWriter;
+    MidiInput* _midiin;
+    OscServer* _osc;
+    MetricsExporter* _exporter;
+    SyncPeer* _sync;
+    QTimer* _syncTimer;         // Corrects the phase while synchronising
+    QTimer* _syncStart;         // Starts playback at the time all instances start
+    quint64 _syncRevision, _syncAuthor;  // Of the timeline that was followed last
+    qint32 _nudge;              // Of the play clock, in millionths
+    bool _following;            // Playing along with the timeline, rather than changing it
+    DisplayMetrics _metrics;
+    QString _coalescingLog;
     bool _playing;
     bool _restart;
     qint64 _stoptime;
-    qint64 _tick;
-    QTimer* _timer;
+    QTimer* _timer;             // Paced to the refresh rate of the screen, runs only while trains move
+    qint64 _nextFrame;          // nsec on _time
     TimeVarT _previous;
     QElapsedTimer _time;
+    PlayClock _clock;           // Time of the composition, see PlayThread::clock()
 };
 
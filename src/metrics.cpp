@@ -0,0 +1,299 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "metrics.h"
+
+#include <QSaveFile>
+#include <QFile>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <cstdio>
+#include <cstring>
+
+#define SOCKET_PREFIX "unix:"
+#define SOCKET_TIMEOUT 100      // msec to wait for a request or for the answer to be written
+
+PlayMetrics::PlayMetrics() :
+    _events( 0 ),
+    _wakeups( 0 ),
+    _latenessSum( 0 ),
+    _maxLateness( 0 ),
+    _tracks( nullptr ) {
+    for( int i =0; i < LATENESS_BUCKETS; i++ ) _lateness[i].store( 0 );
+    for( int i =0; i < LATE_POLICIES; i++ ) _late[i].store( 0 );
+    for( int i =0; i < VoiceTable::Channels; i++ ) _voices[i].store( 0 );
+}
+
+PlayMetrics::TrackCounters::TrackCounters( const QVector<int>& ids ) :
+    ids( ids ),
+    events( new std::atomic<quint64>[qMax( 1, ids.count() )] ) {
+    for( int i =0; i < qMax( 1, ids.count() ); i++ ) events[i].store( 0 );
+}
+
+/** Make a block of counters for the tracks of a composition, with @ids in the order of its
+ *  tracks. Returns the block to pass to useTracks(). Must not be called while playing. */
+int
+PlayMetrics::addTracks( const QVector<int>& ids ) {
+    QSharedPointer<TrackCounters> block( new TrackCounters( ids ) );
+    QMutexLocker locker( &_layout );
+    _blocks.append( block );
+    return _blocks.count() - 1;
+}
+
+/** Remove all blocks. Must not be called while playing. */
+void
+PlayMetrics::clearTracks() {
+    QMutexLocker locker( &_layout );
+    _tracks.store( nullptr, std::memory_order_release );
+    _blocks.clear();
+}
+
+/** The counters of @block start again from 0 and are counted for from now on */
+void
+PlayMetrics::useTracks( int block ) {
+    TrackCounters* t =_blocks.at( block ).data();
+    for( int i =0; i < t->ids.count(); i++ ) t->events[i].store( 0, std::memory_order_relaxed );
+    _tracks.store( t, std::memory_order_release );
+}
+
+void
+PlayMetrics::snapshot( Snapshot* s ) const {
+    s->events =_events.load( std::memory_order_relaxed );
+    s->wakeups =_wakeups.load( std::memory_order_relaxed );
+    for( int i =0; i < LATE_POLICIES; i++ )
+        s->late[i] =_late[i].load( std::memory_order_relaxed );
+    s->latenessSum =_latenessSum.load( std::memory_order_relaxed );
+    s->maxLateness =_maxLateness.load( std::memory_order_relaxed );
+    for( int i =0; i < LATENESS_BUCKETS; i++ )
+        s->lateness[i] =_lateness[i].load( std::memory_order_relaxed );
+    for( int i =0; i < VoiceTable::Channels; i++ )
+        s->voices[i] =_voices[i].load( std::memory_order_relaxed );
+
+    // Hold on to the block rather than the mutex while copying it
+    QSharedPointer<TrackCounters> t;
+    {
+        QMutexLocker locker( &_layout );
+        const TrackCounters* current =_tracks.load( std::memory_order_acquire );
+        for( const auto& b : _blocks )
+            if( b.data() == current ) t =b;
+    }
+    if( t.isNull() ) {
+        s->tracks.clear();
+        s->trackEvents.clear();
+        return;
+    }
+    s->tracks =t->ids;
+    s->trackEvents.resize( t->ids.count() );
+    for( int i =0; i < t->ids.count(); i++ )
+        s->trackEvents[i] =t->events[i].load( std::memory_order_relaxed );
+}
+
+MetricsExporter::MetricsExporter( const PlayMetrics* play, const DisplayMetrics* display,
+                                  const QString& target, QObject* parent ) :
+    QThread( parent ),
+    _play( play ),
+    _display( display ),
+    _target( target ),
+    _server( nullptr ),
+    _interval( METRICS_INTERVAL ) {
+    _play->snapshot( &_previous );
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+    delete _server;
+}
+
+bool
+MetricsExporter::open( QString* error ) {
+    if( _target.startsWith( SOCKET_PREFIX ) ) {
+        const QString path =_target.mid( strlen( SOCKET_PREFIX ) );
+        // A socket left behind by an earlier run would make listening fail
+        QLocalServer::removeServer( path );
+        _server =new QLocalServer();
+        if( !_server->listen( path ) ) {
+            if( error ) *error =_server->errorString();
+            delete _server;
+            _server =nullptr;
+            return false;
+        }
+        // The server is only used by run()
+        _server->moveToThread( this );
+        return true;
+    }
+
+    // Find out early whether the file can be written at all
+    QSaveFile file( _target );
+    if( !file.open( QIODevice::WriteOnly ) ) {
+        if( error ) *error =file.errorString();
+        return false;
+    }
+    file.cancelWriting();
+    return true;
+}
+
+void
+MetricsExporter::stop() {
+    if( isRunning() ) {
+        requestInterruption();
+        wait();
+    }
+}
+
+void
+MetricsExporter::run() {
+    QElapsedTimer timer;
+    timer.start();
+    qint64 last =0;
+    collect( 0 );
+    while( !isInterruptionRequested() ) {
+        const qint64 remaining =last + _interval - timer.elapsed();
+        if( remaining > 0 ) {
+            if( _server ) serve( (int)remaining );
+            else msleep( remaining );
+            continue;
+        }
+        collect( timer.elapsed() - last );
+        last =timer.elapsed();
+        if( !_server ) write();
+    }
+}
+
+/** Replace the file with the metrics collected last */
+void
+MetricsExporter::write() {
+    QSaveFile file( _target );
+    if( !file.open( QIODevice::WriteOnly ) ) return;
+    file.write( _text );
+    file.commit();
+}
+
+/** Answer the connections that come in within @timeout msec. Clients that send an HTTP
+ *  request get an HTTP response, so curl --unix-socket and proxies can scrape it. */
+void
+MetricsExporter::serve( int timeout ) {
+    if( !_server->waitForNewConnection( timeout ) ) return;
+    while( QLocalSocket* socket =_server->nextPendingConnection() ) {
+        socket->waitForReadyRead( SOCKET_TIMEOUT );
+        if( socket->readAll().startsWith( "GET " ) ) {
+            socket->write( "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " );
+            socket->write( QByteArray::number( _text.size() ) + "\r\n\r\n" );
+        }
+        socket->write( _text );
+        socket->waitForBytesWritten( SOCKET_TIMEOUT );
+        socket->disconnectFromServer();
+        delete socket;
+    }
+}
+
+static void
+metric( QByteArray& out, const char* name, const char* type, const char* help ) {
+    out += QByteArray( "# HELP " ) + name + " " + help + "\n";
+    out += QByteArray( "# TYPE " ) + name + " " + type + "\n";
+}
+
+static void
+sample( QByteArray& out, const char* name, double value, const char* labels =nullptr ) {
+    char buf[256];
+    snprintf( buf, sizeof( buf ), "%s%s%s%s %.9g\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", value );
+    out += buf;
+}
+
+/** Take a snapshot of all metrics and format them. Rates and the 99th percentile of the
+ *  lateness cover the last @elapsed msec. */
+void
+MetricsExporter::collect( qint64 elapsed ) {
+    PlayMetrics::Snapshot s;
+    _play->snapshot( &s );
+    const double seconds =elapsed / 1000.0;
+    QByteArray& out =_text;
+    out.clear();
+    char labels[64];
+
+    metric( out, "miditrain_events_total", "counter", "Events dispatched by the play thread." );
+    sample( out, "miditrain_events_total", s.events );
+    metric( out, "miditrain_events_per_second", "gauge", "Events dispatched per second, over the last interval." );
+    sample( out, "miditrain_events_per_second", seconds > 0 ? (s.events - _previous.events) / seconds : 0 );
+
+    metric( out, "miditrain_track_events_total", "counter", "Events dispatched per track." );
+    for( int i =0; i < s.tracks.count(); i++ ) {
+        snprintf( labels, sizeof( labels ), "track=\"%d\"", s.tracks[i] );
+        sample( out, "miditrain_track_events_total", s.trackEvents[i], labels );
+    }
+
+    static const char* const policies[LATE_POLICIES] ={ "play", "drop", "compress" };
+    metric( out, "miditrain_late_events_total", "counter", "Events due longer ago than the late threshold, by how they were handled." );
+    for( int i =0; i < LATE_POLICIES; i++ ) {
+        snprintf( labels, sizeof( labels ), "policy=\"%s\"", policies[i] );
+        sample( out, "miditrain_late_events_total", s.late[i], labels );
+    }
+
+    metric( out, "miditrain_dispatch_lateness_seconds", "histogram", "Time between when events were due and when they were dispatched." );
+    quint64 cumulative =0;
+    for( int i =0; i < LATENESS_BUCKETS; i++ ) {
+        cumulative += s.lateness[i];
+        if( i < LATENESS_BUCKETS - 1 )
+            snprintf( labels, sizeof( labels ), "le=\"%g\"", (1ULL << i) / 1e6 );
+        else
+            snprintf( labels, sizeof( labels ), "le=\"+Inf\"" );
+        sample( out, "miditrain_dispatch_lateness_seconds_bucket", cumulative, labels );
+    }
+    sample( out, "miditrain_dispatch_lateness_seconds_sum", s.latenessSum / 1e6 );
+    sample( out, "miditrain_dispatch_lateness_seconds_count", cumulative );
+    metric( out, "miditrain_dispatch_lateness_max_seconds", "gauge", "Largest lateness of any event since the start." );
+    sample( out, "miditrain_dispatch_lateness_max_seconds", s.maxLateness / 1e6 );
+
+    // The 99th percentile of the last interval, interpolated within its bucket
+    quint64 total =0;
+    for( int i =0; i < LATENESS_BUCKETS; i++ ) total += s.lateness[i] - _previous.lateness[i];
+    double p99 =0.0;
+    if( total > 0 ) {
+        const double rank =0.99 * total;
+        quint64 below =0;
+        for( int i =0; i < LATENESS_BUCKETS; i++ ) {
+            const quint64 n =s.lateness[i] - _previous.lateness[i];
+            if( below + n >= rank ) {
+                const double lo =i == 0 ? 0.0 : (double)(1ULL << (i - 1));
+                const double hi =i < LATENESS_BUCKETS - 1 ? (double)(1ULL << i) : qMax( lo, (double)s.maxLateness );
+                p99 =(lo + (hi - lo) * (rank - below) / n) / 1e6;
+                break;
+            }
+            below += n;
+        }
+    }
+    metric( out, "miditrain_dispatch_lateness_p99_seconds", "gauge", "99th percentile of the lateness over the last interval." );
+    sample( out, "miditrain_dispatch_lateness_p99_seconds", p99 );
+
+    metric( out, "miditrain_wakeups_total", "counter", "Times the play thread woke up." );
+    sample( out, "miditrain_wakeups_total", s.wakeups );
+    metric( out, "miditrain_wakeups_per_second", "gauge", "Wakeups of the play thread per second, over the last interval." );
+    sample( out, "miditrain_wakeups_per_second", seconds > 0 ? (s.wakeups - _previous.wakeups) / seconds : 0 );
+
+    metric( out, "miditrain_active_voices", "gauge", "Notes sounding per MIDI channel." );
+    for( int i =0; i < VoiceTable::Channels; i++ ) {
+        snprintf( labels, sizeof( labels ), "channel=\"%d\"", i );
+        sample( out, "miditrain_active_voices", s.voices[i], labels );
+    }
+
+    metric( out, "miditrain_queue_rebuild_seconds", "gauge", "Time it took to build the event queues of the current composition." );
+    sample( out, "miditrain_queue_rebuild_seconds", _display->rebuild.load( std::memory_order_relaxed ) / 1e6 );
+    metric( out, "miditrain_frames_total", "counter", "Frames drawn by the display." );
+    sample( out, "miditrain_frames_total", _display->frames.load( std::memory_order_relaxed ) );
+    metric( out, "miditrain_display_events_total", "counter", "Events followed by the display." );
+    sample( out, "miditrain_display_events_total", _display->applied.load( std::memory_order_relaxed ) );
+
+    metric( out, "miditrain_sync_peers", "gauge", "Other instances that play in phase with this one." );
+    sample( out, "miditrain_sync_peers", _display->syncPeers.load( std::memory_order_relaxed ) );
+    metric( out, "miditrain_sync_offset_seconds", "gauge", "Largest difference in play time with any of them." );
+    sample( out, "miditrain_sync_offset_seconds", _display->syncOffset.load( std::memory_order_relaxed ) / 1e9 );
+    metric( out, "miditrain_sync_round_trip_seconds", "gauge", "Largest round trip to any of them." );
+    sample( out, "miditrain_sync_round_trip_seconds", _display->syncRtt.load( std::memory_order_relaxed ) / 1e9 );
+
+    _previous =s;
+}
@@ -0,0 +1,148 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QThread>
+#include <QMutex>
+#include <QVector>
+#include <QByteArray>
+#include <QString>
+#include <QSharedPointer>
+#include <atomic>
+#include "voicetable.h"
+
+#define LATENESS_BUCKETS 21     // Upper bounds of 1, 2, 4, ... usec, the last one is unbounded
+#define LATE_POLICIES 3         // Ways to handle late events, see PlayThread::LatePolicy
+#define METRICS_INTERVAL 1000   // msec between two exports
+
+class QLocalServer;
+
+/** Add @n to a counter that only the calling thread writes. Unlike fetch_add, this needs
+ *  no locked instruction, while readers on other threads still see whole values. */
+template<typename T> inline void
+addCounter( std::atomic<T>& a, T n ) {
+    a.store( a.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+}
+
+/** Counters and gauges of the play thread.
+ *
+ * Only the play thread updates them and it never waits for a reader. The counters of the
+ * tracks come in blocks, one for every composition or scene, that are made when it is loaded.
+ * Switching to another block is a single atomic store, so a scene switch takes no lock. The
+ * mutex only keeps readers from a block that is being removed, which happens while not playing.
+ */
+class PlayMetrics {
+public:
+    struct Snapshot {
+        quint64 events, wakeups;
+        quint64 late[LATE_POLICIES];    // Late events by the way they were handled
+        quint64 lateness[LATENESS_BUCKETS];
+        quint64 latenessSum;    // usec
+        qint64 maxLateness;     // usec
+        int voices[VoiceTable::Channels];
+        QVector<int> tracks;    // Ids
+        QVector<quint64> trackEvents;
+    };
+
+    PlayMetrics();
+
+    // Only while not playing
+    void setTracks( const QVector<int>& ids ) { clearTracks(); useTracks( addTracks( ids ) ); }
+    int addTracks( const QVector<int>& ids );
+    void clearTracks();
+    // Count for the tracks of another block while playing, e.g. of another scene. Locks and
+    // allocates nothing.
+    void useTracks( int block );
+
+    /** Count an event of the track at @index that was dispatched @lateness nsec after it was due */
+    inline void dispatched( int index, qint64 lateness ) {
+        const quint64 us =lateness > 0 ? (quint64)lateness / 1000 : 0;
+        int bucket =0;
+        while( bucket < LATENESS_BUCKETS - 1 && (1ULL << bucket) < us ) bucket++;
+        addCounter<quint64>( _events, 1 );
+        addCounter<quint64>( _tracks.load( std::memory_order_relaxed )->events[index], 1 );
+        addCounter<quint64>( _lateness[bucket], 1 );
+        addCounter<quint64>( _latenessSum, us );
+        if( (qint64)us > _maxLateness.load( std::memory_order_relaxed ) )
+            _maxLateness.store( us, std::memory_order_relaxed );
+    }
+
+    /** Count an event that was later than the late threshold and handled by @policy */
+    inline void late( int policy ) { addCounter<quint64>( _late[policy], 1 ); }
+
+    inline void wakeup() { addCounter<quint64>( _wakeups, 1 ); }
+
+    inline void setVoices( const VoiceTable& voices ) {
+        for( int i =0; i < VoiceTable::Channels; i++ )
+            _voices[i].store( voices.channelCount( i ), std::memory_order_relaxed );
+    }
+
+    void snapshot( Snapshot* ) const;
+
+private:
+    struct TrackCounters {
+        TrackCounters( const QVector<int>& ids );
+        ~TrackCounters() { delete[] events; }
+        QVector<int> ids;
+        std::atomic<quint64>* events;
+    };
+
+    std::atomic<quint64> _events, _wakeups, _latenessSum;
+    std::atomic<quint64> _late[LATE_POLICIES];
+    std::atomic<qint64> _maxLateness;
+    std::atomic<quint64> _lateness[LATENESS_BUCKETS];
+    std::atomic<int> _voices[VoiceTable::Channels];
+    QVector<QSharedPointer<TrackCounters> > _blocks;
+    std::atomic<TrackCounters*> _tracks;        // The block that is counted for, one of _blocks
+    mutable QMutex _layout;     // Guards _blocks against readers
+};
+
+/** Counters and gauges of the window, only updated by the GUI thread */
+struct DisplayMetrics {
+    DisplayMetrics() : frames( 0 ), applied( 0 ), rebuild( 0 ), syncPeers( 0 ), syncOffset( 0 ), syncRtt( 0 ) {}
+
+    std::atomic<quint64> frames;        // Frames drawn while playing
+    std::atomic<quint64> applied;       // Events followed by the display queue
+    std::atomic<qint64> rebuild;        // Time the last composition took to initialize its queues, usec
+    std::atomic<int> syncPeers;         // Instances this one plays in phase with, see SyncPeer
+    std::atomic<qint64> syncOffset;     // Largest difference in play time with any of them, nsec
+    std::atomic<qint64> syncRtt;        // Largest round trip to any of them, nsec
+};
+
+/** Publishes the metrics in the Prometheus text format, from a thread of its own.
+ *
+ * The target is either a file, which is replaced atomically at every interval (as the
+ * textfile collector of node_exporter expects), or "unix:" followed by the path of a local
+ * socket that answers every connection with the current metrics.
+ */
+class MetricsExporter : public QThread {
+    Q_OBJECT
+public:
+    MetricsExporter( const PlayMetrics*, const DisplayMetrics*, const QString& target, QObject* parent =0 );
+    ~MetricsExporter();
+
+    bool open( QString* error =nullptr );
+    void stop();
+
+    void setInterval( int msec ) { _interval =qMax( 10, msec ); }
+
+    void run() override;
+
+private:
+    void collect( qint64 elapsed );
+    void write();
+    void serve( int timeout );
+
+    const PlayMetrics* _play;
+    const DisplayMetrics* _display;
+    QString _target;
+    QLocalServer* _server;
+    int _interval;
+    PlayMetrics::Snapshot _previous;
+    QByteArray _text;           // The metrics as they were collected last
+};
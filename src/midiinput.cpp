@@ -0,0 +1,190 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "midiinput.h"
+
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QMidiIn.h>
+#include <cstring>
+
+// Channel of key() that matches any channel
+#define ANY_CHANNEL 16
+
+MidiInput::MidiInput( PlayThread* thread, QObject* parent ) :
+    QObject( parent ),
+    _thread( thread ),
+    _midiin( nullptr ),
+    _dropped( 0 ) {
+    _timer.start();
+    memset( _controls, 0, sizeof( _controls ) );
+}
+
+MidiInput::~MidiInput() {
+    close();
+}
+
+/** Read which notes and controllers control which tracks from the JSON file at @path:
+ *  { "Device": "pads", "Quantize": false,
+ *    "Mappings": [ { "Note": 36, "Channel": 9, "Action": "Start", "Track": 1 }, ... ] } */
+bool
+MidiInput::loadMap( const QString& path, QString* error ) {
+    QString etxt;
+    QJsonParseError err;
+    QJsonDocument doc;
+    QJsonObject root;
+    QJsonArray array;
+    bool quantize;
+
+    QFile file( path );
+    if( !file.open( QIODevice::ReadOnly | QIODevice::Text ) ) { etxt ="Could not open given file for reading."; goto ERROR; }
+
+    doc =QJsonDocument::fromJson( file.readAll(), &err );
+    if( err.error != QJsonParseError::NoError ) { etxt =err.errorString() + " at " + QString::number( err.offset ); goto ERROR; }
+    if( !doc.isObject() ) { etxt ="Expected a root-level object in the document"; goto ERROR; }
+
+    root =doc.object();
+    _device =root.value( "Device" ).toString();
+    quantize =root.value( "Quantize" ).toBool( false );
+    _mappings.clear();
+    _lookup.clear();
+
+    array =root.value( "Mappings" ).toArray();
+    for( auto it =array.begin(); it != array.end(); it++ ) {
+        const QJsonObject json =(*it).toObject();
+        Mapping m;
+        if( json.contains( "Note" ) ) {
+            m.source =Mapping::Note;
+            m.number =json.value( "Note" ).toInt( -1 );
+        } else {
+            m.source =Mapping::Control;
+            m.number =json.value( "Control" ).toInt( -1 );
+        }
+        if( m.number < 0 || m.number > 127 ) { etxt ="Mapping without a valid Note or Control"; goto ERROR; }
+        m.channel =json.value( "Channel" ).toInt( -1 );
+        if( m.channel < -1 || m.channel > 15 ) { etxt ="Invalid channel"; goto ERROR; }
+
+        const QString action =json.value( "Action" ).toString();
+        if( action == "Start" ) m.command.type =PlayThread::Command::Start;
+        else if( action == "Stop" ) m.command.type =PlayThread::Command::Stop;
+        else if( action == "Reset" ) m.command.type =PlayThread::Command::Reset;
+        else if( action == "Mute" ) m.command.type =PlayThread::Command::Mute;
+        else { etxt ="No or incorrect action"; goto ERROR; }
+
+        m.command.track =json.value( "Track" ).toInt( -1 );
+        if( m.command.track < 0 ) { etxt ="Mapping without a track"; goto ERROR; }
+        m.command.value =-1;
+        m.command.quantize =json.value( "Quantize" ).toBool( quantize );
+        m.command.posted =0;
+        m.command.executed =0;
+
+        _lookup.insert( key( m.source, m.channel < 0 ? ANY_CHANNEL : m.channel, m.number ), _mappings.count() );
+        _mappings.append( m );
+    }
+    return true;
+ERROR:
+    if( error != nullptr ) *error ="Incorrect MIDI input map - " + etxt;
+    _mappings.clear();
+    _lookup.clear();
+    return false;
+}
+
+/** Connect to the device named in the map, or the first one, and start listening */
+bool
+MidiInput::open( QString* error ) {
+    close();
+    const auto devices =QMidiIn::devices();
+    QString id;
+    for( auto it =devices.begin(); it != devices.end() && id.isEmpty(); it++ ) {
+        if( _device.isEmpty() || it.key() == _device || it.value().contains( _device, Qt::CaseInsensitive ) )
+            id =it.key();
+    }
+    if( id.isEmpty() ) {
+        if( error != nullptr )
+            *error =_device.isEmpty() ? "No MIDI input devices found" : "No MIDI input device matches '" + _device + "'";
+        return false;
+    }
+
+    _midiin =new QMidiIn( this );
+    if( !_midiin->connect( id ) ) {
+        if( error != nullptr ) *error ="Could not connect to MIDI input '" + id + "'";
+        delete _midiin;
+        _midiin =nullptr;
+        return false;
+    }
+    _deviceId =id;
+    // Handle messages on the thread of the backend, the event loop would only add latency
+    QObject::connect( _midiin, &QMidiIn::midiEvent, this, &MidiInput::receive, Qt::DirectConnection );
+    _midiin->start();
+    return true;
+}
+
+void
+MidiInput::close() {
+    if( _midiin == nullptr ) return;
+    _midiin->stop();
+    _midiin->disconnect();
+    delete _midiin;
+    _midiin =nullptr;
+    _deviceId.clear();
+}
+
+/** Return the ids of the tracks that can be started, stopped, reset or muted from the input */
+QSet<int>
+MidiInput::controlledTracks() const {
+    QSet<int> ids;
+    for( const auto& m : _mappings )
+        ids.insert( m.command.track );
+    return ids;
+}
+
+/** Called by the MIDI backend for every message that arrives */
+void
+MidiInput::receive( quint32 message, quint32 timing ) {
+    Q_UNUSED( timing );
+    const qint64 now =_timer.nsecsElapsed();
+    const int status =message & 0xff;
+    const int number =(message >> 8) & 0x7f;
+    const int value =(message >> 16) & 0x7f;
+    const int channel =status & 0x0f;
+
+    int source;
+    switch( status & 0xf0 ) {
+    case 0x90:
+        // NoteOn with velocity 0 is a NoteOff
+        if( value == 0 ) return;
+        source =Mapping::Note;
+        break;
+    case 0xb0: {
+        // Controllers act like a switch that is pressed when they go from below 64 to 64 or
+        // above, so a fader that is moved through the upper half only acts once
+        const bool pressed =value >= 64 && _controls[channel][number] < 64;
+        _controls[channel][number] =(quint8)value;
+        if( !pressed ) return;
+        source =Mapping::Control;
+        break;
+    }
+    default:
+        return;
+    }
+
+    bool posted =false;
+    for( int ch : { channel, ANY_CHANNEL } ) {
+        for( auto it =_lookup.constFind( key( source, ch, number ) ); it != _lookup.constEnd() && it.key() == key( source, ch, number ); it++ ) {
+            PlayThread::Command c =_mappings.at( it.value() ).command;
+            c.posted =now;
+            if( _thread->postCommand( c ) )
+                posted =true;
+            else
+                _dropped.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+    if( posted )
+        emit commandPosted();
+}
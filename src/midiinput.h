@@ -0,0 +1,71 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QMultiHash>
+#include <QSet>
+#include <QElapsedTimer>
+#include <atomic>
+#include "playthread.h"
+
+class QMidiIn;
+
+/** Turns notes and controllers from a MIDI input into commands for the play thread.
+ *
+ * Which note or controller starts, stops, resets or mutes which track is read from a
+ * JSON map (see README.md). Messages are handled on the thread of the MIDI backend and
+ * posted to the play thread through its lock-free command queue, so they take effect
+ * without going through the event loop of the window.
+ */
+class MidiInput : public QObject {
+    Q_OBJECT
+public:
+    struct Mapping {
+        enum Source { Note, Control };
+        int source;
+        int channel;                    // 0-15, -1 for any
+        int number;                     // Note or controller number
+        PlayThread::Command command;
+    };
+
+    MidiInput( PlayThread*, QObject* parent =0 );
+    ~MidiInput();
+
+    bool loadMap( const QString& path, QString* error =nullptr );
+    bool open( QString* error =nullptr );
+    void close();
+
+    // Use the clock of the play thread to time commands
+    void setTimer( const QElapsedTimer& t ) { _timer =t; }
+
+    const QVector<Mapping>& mappings() const { return _mappings; }
+    QSet<int> controlledTracks() const;
+    QString deviceId() const { return _deviceId; }
+    quint64 droppedCount() const { return _dropped.load( std::memory_order_relaxed ); }
+
+    void receive( quint32 message, quint32 timing );
+
+signals:
+    void commandPosted();
+
+private:
+    static quint32 key( int source, int channel, int number ) {
+        return (quint32)source << 16 | (quint32)(channel & 0xff) << 8 | (quint32)number;
+    }
+
+    PlayThread* _thread;
+    QMidiIn* _midiin;
+    QElapsedTimer _timer;
+    QString _device;                    // Device id or part of its name, from the map
+    QString _deviceId;
+    QVector<Mapping> _mappings;
+    QMultiHash<quint32, int> _lookup;   // Index of the mappings by key()
+    std::atomic<quint64> _dropped;      // Commands that did not fit in the queue
+    quint8 _controls[16][128];          // Last value of every controller, only used by receive()
+};
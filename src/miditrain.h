@@ -11,6 +11,7 @@
 typedef std::chrono::high_resolution_clock::time_point TimeVarT;
 
 #define duration(a) std::chrono::duration_cast<std::chrono::milliseconds>(a).count()
+#define durationUs(a) std::chrono::duration_cast<std::chrono::microseconds>(a).count()
 #define timeNow() std::chrono::high_resolution_clock::now()
 /* End Chrono part */
 
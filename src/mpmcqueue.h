@@ -0,0 +1,88 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QtGlobal>
+#include <atomic>
+
+/** Bounded, lock-free queue for any number of producer and consumer threads.
+ *
+ * Every slot carries a sequence number that tells whether it is free to be written or ready
+ * to be read in the current round, so producers and consumers only contend on their own
+ * position counter. Nothing is allocated after construction, which makes it safe to use from
+ * the play thread. @T must be trivially copyable.
+ */
+template<typename T>
+class MpmcQueue {
+public:
+    MpmcQueue( int capacity =1024 ) : _head( 0 ), _tail( 0 ) {
+        // Round the capacity up to a power of two, so the index can be masked
+        quint64 size =1;
+        while( size < (quint64)qMax( 2, capacity ) ) size <<= 1;
+        _mask =size - 1;
+        _slots =new Slot[size];
+        for( quint64 i =0; i < size; i++ )
+            _slots[i].sequence.store( i, std::memory_order_relaxed );
+    }
+
+    ~MpmcQueue() {
+        delete[] _slots;
+    }
+
+    /** Append @value, returns false if the queue is full */
+    bool push( const T& value ) {
+        quint64 pos =_tail.load( std::memory_order_relaxed );
+        for( ;; ) {
+            Slot& s =_slots[pos & _mask];
+            const qint64 diff =(qint64)(s.sequence.load( std::memory_order_acquire ) - pos);
+            if( diff == 0 ) {
+                if( _tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                    s.value =value;
+                    s.sequence.store( pos + 1, std::memory_order_release );
+                    return true;
+                }
+            } else if( diff < 0 )
+                return false;
+            else
+                pos =_tail.load( std::memory_order_relaxed );
+        }
+    }
+
+    /** Take the oldest value and copy it to @value, returns false if the queue is empty */
+    bool pop( T* value ) {
+        quint64 pos =_head.load( std::memory_order_relaxed );
+        for( ;; ) {
+            Slot& s =_slots[pos & _mask];
+            const qint64 diff =(qint64)(s.sequence.load( std::memory_order_acquire ) - (pos + 1));
+            if( diff == 0 ) {
+                if( _head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                    *value =s.value;
+                    s.sequence.store( pos + _mask + 1, std::memory_order_release );
+                    return true;
+                }
+            } else if( diff < 0 )
+                return false;
+            else
+                pos =_head.load( std::memory_order_relaxed );
+        }
+    }
+
+    int capacity() const { return (int)_mask + 1; }
+
+private:
+    struct Slot {
+        std::atomic<quint64> sequence;
+        T value;
+    };
+
+    Slot* _slots;
+    quint64 _mask;
+    // Written by producers and consumers respectively, so keep them on separate cache lines
+    alignas(64) std::atomic<quint64> _head;
+    alignas(64) std::atomic<quint64> _tail;
+};
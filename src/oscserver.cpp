@@ -0,0 +1,317 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "oscserver.h"
+
+#include <QUdpSocket>
+#include <QtEndian>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#define OSC_MAX_ARGS 4
+#define OSC_MAX_DEPTH 8         // Nesting of bundles
+#define OSC_IMMEDIATELY 1       // Time tag of bundles that are due on arrival
+// Seconds from the NTP epoch (1900) to the Unix epoch (1970)
+#define NTP_UNIX_OFFSET 2208988800LL
+
+namespace {
+struct Argument {
+    char type;
+    qint64 i;
+    double d;
+    const char* s;
+};
+}
+
+/** Return the length of the OSC string at @data, including its padding, or -1 if it is not terminated */
+static int
+stringLength( const char* data, int size ) {
+    const void* end =memchr( data, 0, size );
+    if( !end ) return -1;
+    const int length =(int)(static_cast<const char*>( end ) - data) + 1;
+    return qMin( size, (length + 3) & ~3 );
+}
+
+OscServer::OscServer( PlayThread* thread, QObject* parent ) :
+    QThread( parent ),
+    _socket( nullptr ),
+    _port( 0 ),
+    _now( 0 ),
+    _transport( 64 ),
+    _received( 0 ),
+    _rejected( 0 ),
+    _dropped( 0 ) {
+    _timer.start();
+    _timed.reserve( OSC_MAX_TIMED );
+    _threads.append( thread );
+}
+
+int
+OscServer::addThread( PlayThread* thread ) {
+    if( isRunning() ) return -1;
+    _threads.append( thread );
+    return _threads.count() - 1;
+}
+
+OscServer::~OscServer() {
+    requestInterruption();
+    wait();
+    delete _socket;
+}
+
+/** Bind to @port on @address. The server is started with start(). */
+bool
+OscServer::listen( const QHostAddress& address, quint16 port, QString* error ) {
+    if( isRunning() || _socket != nullptr ) return false;
+
+    _socket =new QUdpSocket();
+    if( !_socket->bind( address, port ) ) {
+        if( error != nullptr ) *error =_socket->errorString();
+        delete _socket;
+        _socket =nullptr;
+        return false;
+    }
+    _port =_socket->localPort();
+    // The socket is only used by run()
+    _socket->moveToThread( this );
+    return true;
+}
+
+void
+OscServer::run() {
+    if( _socket == nullptr ) return;
+    while( !isInterruptionRequested() ) {
+        // Datagrams are read as soon as they arrive, no event loop is involved
+        if( _socket->hasPendingDatagrams() || _socket->waitForReadyRead( (int)timeUntilDue() ) ) {
+            while( _socket->hasPendingDatagrams() ) {
+                const qint64 size =_socket->readDatagram( _buffer, sizeof( _buffer ) );
+                _now =_timer.nsecsElapsed();
+                if( size <= 0 ) continue;
+                _received.fetch_add( 1, std::memory_order_relaxed );
+                receive( _buffer, (int)size, _now );
+            }
+        }
+        dispatchDue();
+    }
+}
+
+/** Handle the message or bundle at @data, which is due at @due */
+void
+OscServer::receive( const char* data, int size, qint64 due, int depth ) {
+    if( size >= 16 && memcmp( data, "#bundle", 8 ) == 0 ) {
+        if( depth >= OSC_MAX_DEPTH ) goto ERROR;
+        // A bundle cannot be due before the bundle that contains it
+        due =qMax( due, fromTimeTag( qFromBigEndian<quint64>( reinterpret_cast<const uchar*>( data + 8 ) ) ) );
+        for( int offset =16; offset < size; ) {
+            if( size - offset < 4 ) goto ERROR;
+            const qint32 length =qFromBigEndian<qint32>( reinterpret_cast<const uchar*>( data + offset ) );
+            offset += 4;
+            if( length <= 0 || length > size - offset || length % 4 != 0 ) goto ERROR;
+            receive( data + offset, length, due, depth + 1 );
+            offset += length;
+        }
+        return;
+    }
+
+    {
+        Message m;
+        if( !parseMessage( data, size, &m ) ) goto ERROR;
+        if( due <= _now ) {
+            dispatch( m );
+        } else if( _timed.count() < OSC_MAX_TIMED ) {
+            Timed t;
+            t.due =due;
+            t.message =m;
+            _timed.append( t );
+        } else
+            _dropped.fetch_add( 1, std::memory_order_relaxed );
+    }
+    return;
+ERROR:
+    _rejected.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void
+OscServer::dispatch( Message& m ) {
+    if( m.transport ) {
+        m.t.posted =_now;
+        if( !_transport.push( m.t ) ) {
+            _dropped.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        }
+        emit transportPosted();
+    } else {
+        m.command.posted =_now;
+        if( m.room >= _threads.count() || !_threads[m.room]->postCommand( m.command ) )
+            _dropped.fetch_add( 1, std::memory_order_relaxed );
+    }
+}
+
+/** Dispatch the bundles whose time has come, in the order of their time tags */
+void
+OscServer::dispatchDue() {
+    while( !_timed.isEmpty() ) {
+        _now =_timer.nsecsElapsed();
+        int first =-1;
+        for( int i =0; i < _timed.count(); i++ )
+            if( _timed[i].due <= _now && (first < 0 || _timed[i].due < _timed[first].due) )
+                first =i;
+        if( first < 0 ) return;
+        Message m =_timed[first].message;
+        _timed.remove( first );
+        dispatch( m );
+    }
+}
+
+/** Return the time until the first bundle is due in msec, rounded up, at most OSC_MAX_WAIT */
+qint64
+OscServer::timeUntilDue() const {
+    qint64 wait =OSC_MAX_WAIT;
+    const qint64 now =_timer.nsecsElapsed();
+    for( const auto& t : _timed )
+        wait =qMin( wait, qMax( (qint64)0, (t.due - now + 999999) / 1000000 ) );
+    return wait;
+}
+
+/** Convert an NTP time tag to nsec on the timer */
+qint64
+OscServer::fromTimeTag( quint64 tag ) const {
+    if( tag == OSC_IMMEDIATELY ) return 0;
+    const qint64 seconds =(qint64)(tag >> 32) - NTP_UNIX_OFFSET;
+    const qint64 fraction =(qint64)(((tag & 0xffffffffULL) * 1000000000ULL) >> 32);
+    const qint64 epoch =std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch() ).count();
+    return _timer.nsecsElapsed() + (seconds * 1000000000LL + fraction - epoch);
+}
+
+bool
+OscServer::parseMessage( const char* data, int size, Message* m ) {
+    Argument args[OSC_MAX_ARGS];
+    int count =0;
+    const char* address =data;
+    const char* tags;
+    int offset =stringLength( data, size );
+    if( offset < 0 || address[0] != '/' ) return false;
+
+    // Messages for another composition than the first start with /room/<index>
+    m->room =0;
+    if( strncmp( address, "/room/", 6 ) == 0 ) {
+        char* end;
+        const long room =strtol( address + 6, &end, 10 );
+        if( end == address + 6 || *end != '/' || room < 0 || room > 0xffff ) return false;
+        m->room =(qint32)room;
+        address =end;
+    }
+
+    // Messages without arguments may leave out the type tags
+    tags =offset < size ? data + offset : ",";
+    if( offset < size ) {
+        const int length =stringLength( tags, size - offset );
+        if( length < 0 || tags[0] != ',' ) return false;
+        offset += length;
+    }
+    for( const char* t =tags + 1; *t; t++ ) {
+        if( count == OSC_MAX_ARGS ) return false;
+        Argument& a =args[count++];
+        a.type =*t;
+        a.i =0; a.d =0.0; a.s =nullptr;
+        const uchar* p =reinterpret_cast<const uchar*>( data + offset );
+        switch( *t ) {
+        case 'i':
+            if( size - offset < 4 ) return false;
+            a.i =qFromBigEndian<qint32>( p );
+            a.d =a.i;
+            offset += 4;
+            break;
+        case 'f': {
+            if( size - offset < 4 ) return false;
+            const quint32 bits =qFromBigEndian<quint32>( p );
+            float f;
+            memcpy( &f, &bits, sizeof( f ) );
+            a.d =f;
+            a.i =(qint64)f;
+            offset += 4;
+            break;
+        }
+        case 'h':
+            if( size - offset < 8 ) return false;
+            a.i =qFromBigEndian<qint64>( p );
+            a.d =a.i;
+            offset += 8;
+            break;
+        case 'd': {
+            if( size - offset < 8 ) return false;
+            const quint64 bits =qFromBigEndian<quint64>( p );
+            memcpy( &a.d, &bits, sizeof( a.d ) );
+            a.i =(qint64)a.d;
+            offset += 8;
+            break;
+        }
+        case 's': {
+            const int length =stringLength( data + offset, size - offset );
+            if( length < 0 ) return false;
+            a.s =data + offset;
+            offset += length;
+            break;
+        }
+        case 'T': a.i =1; a.d =1.0; break;
+        case 'F': break;
+        default:
+            return false;
+        }
+    }
+
+    const bool number =count > 0 && args[0].type != 's';
+    m->transport =true;
+    m->t.room =m->room;
+    m->t.value =0.0;
+    m->t.quantize =0;
+    m->t.posted =0;
+    m->t.path[0] =0;
+    if( strcmp( address, "/miditrain/play" ) == 0 ) {
+        m->t.type =Transport::Play;
+    } else if( strcmp( address, "/miditrain/stop" ) == 0 ) {
+        m->t.type =Transport::Stop;
+    } else if( strcmp( address, "/miditrain/seek" ) == 0 ) {
+        if( !number || args[0].d < 0.0 ) return false;
+        m->t.type =Transport::Seek;
+        m->t.value =args[0].d;
+    } else if( strcmp( address, "/miditrain/tempo" ) == 0 ) {
+        if( !number || args[0].d <= 0.0 ) return false;
+        m->t.type =Transport::Tempo;
+        m->t.value =args[0].d;
+    } else if( strcmp( address, "/miditrain/load" ) == 0 ) {
+        if( count < 1 || args[0].type != 's' || strlen( args[0].s ) >= OSC_MAX_PATH ) return false;
+        m->t.type =Transport::Load;
+        strcpy( m->t.path, args[0].s );
+    } else if( strcmp( address, "/miditrain/scene" ) == 0 ) {
+        if( !number || args[0].i < 0 ) return false;
+        m->t.type =Transport::Scene;
+        m->t.value =(double)args[0].i;
+        // Scenes switch at the next section unless told otherwise
+        m->t.quantize =count > 1 ? (int)qBound( (qint64)0, args[1].i, (qint64)2 ) : 1;
+    } else if( strncmp( address, "/miditrain/track/", 17 ) == 0 ) {
+        const char* action =address + 17;
+        PlayThread::Command& c =m->command;
+        m->transport =false;
+        if( strcmp( action, "start" ) == 0 ) c.type =PlayThread::Command::Start;
+        else if( strcmp( action, "stop" ) == 0 ) c.type =PlayThread::Command::Stop;
+        else if( strcmp( action, "reset" ) == 0 ) c.type =PlayThread::Command::Reset;
+        else if( strcmp( action, "mute" ) == 0 ) c.type =PlayThread::Command::Mute;
+        else return false;
+        if( !number ) return false;
+        c.track =(qint32)args[0].i;
+        // The second argument is the state for Mute, and whether to quantise for the others
+        c.value =c.type == PlayThread::Command::Mute && count > 1 ? (args[1].i != 0) : -1;
+        c.quantize =c.type != PlayThread::Command::Mute && count > 1 && args[1].i != 0;
+        c.posted =0;
+        c.executed =0;
+    } else
+        return false;
+    return true;
+}
@@ -0,0 +1,102 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QThread>
+#include <QVector>
+#include <QHostAddress>
+#include <QElapsedTimer>
+#include <atomic>
+#include "playthread.h"
+#include "mpmcqueue.h"
+
+#define OSC_MAX_PACKET 8192     // Largest datagram that is read
+#define OSC_MAX_PATH 1024       // Longest path of a composition to load
+#define OSC_MAX_TIMED 256       // Bundles that can wait for their time tag
+#define OSC_MAX_WAIT 100        // msec between checks for interruption
+
+class QUdpSocket;
+
+/** Receives Open Sound Control messages over UDP on its own thread.
+ *
+ * Messages for tracks are posted straight to the play thread. Transport messages (play, stop,
+ * seek, tempo, load and scene) are queued for the window, which announces them with transportPosted().
+ * Bundles with a time tag in the future are held until then. The address space is described
+ * in README.md.
+ */
+class OscServer : public QThread {
+    Q_OBJECT
+public:
+    /** A message for the window */
+    struct Transport {
+        enum Type { Play, Stop, Seek, Tempo, Load, Scene };
+        qint32 type;
+        qint32 room;            // Index of the composition, see addThread()
+        double value;           // Seek: position in msec, Tempo: scale, Scene: index
+        qint32 quantize;        // Scene: 0 to switch right away, 1 at the next section, 2 at the next lap
+        qint64 posted;          // Time the message was received, nsec on the timer
+        char path[OSC_MAX_PATH];// Load: path of the composition, 0-terminated
+    };
+
+    /** A parsed message, for either the play thread or the window */
+    struct Message {
+        bool transport;
+        qint32 room;
+        PlayThread::Command command;
+        Transport t;
+    };
+
+    OscServer( PlayThread*, QObject* parent =0 );
+    ~OscServer();
+
+    // Also control the composition of @thread, with messages that start with /room/<index>.
+    // Returns the index. Only before the server is started.
+    int addThread( PlayThread* thread );
+
+    bool listen( const QHostAddress& address, quint16 port, QString* error =nullptr );
+    quint16 port() const { return _port; }
+
+    // The same timer as the play thread, to time messages
+    void setTimer( const QElapsedTimer& t ) { _timer =t; }
+
+    bool takeTransport( Transport* t ) { return _transport.pop( t ); }
+
+    quint64 receivedCount() const { return _received.load( std::memory_order_relaxed ); }
+    quint64 rejectedCount() const { return _rejected.load( std::memory_order_relaxed ); }
+    quint64 droppedCount() const { return _dropped.load( std::memory_order_relaxed ); }
+
+    /** Parse the OSC message at @data into @m. Returns false if it is malformed or unknown. */
+    static bool parseMessage( const char* data, int size, Message* m );
+
+    void run() override;
+
+signals:
+    void transportPosted();
+
+private:
+    struct Timed {
+        qint64 due;             // nsec on the timer
+        Message message;
+    };
+
+    void receive( const char* data, int size, qint64 due, int depth =0 );
+    void dispatch( Message& m );
+    void dispatchDue();
+    qint64 timeUntilDue() const;
+    qint64 fromTimeTag( quint64 tag ) const;
+
+    QVector<PlayThread*> _threads;      // The first one gets the messages without a room
+    QUdpSocket* _socket;
+    quint16 _port;
+    QElapsedTimer _timer;
+    qint64 _now;                // Time the datagram being handled was received
+    MpmcQueue<Transport> _transport;
+    QVector<Timed> _timed;      // Bundles that wait for their time tag
+    char _buffer[OSC_MAX_PACKET];
+    std::atomic<quint64> _received, _rejected, _dropped;
+};
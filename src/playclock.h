@@ -0,0 +1,44 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QElapsedTimer>
+
+/** The time of playback, which runs at an adjustable rate relative to a QElapsedTimer.
+ *
+ * The play thread and the window each keep their own copy. As long as both change the rate
+ * at the same play time, with setScale() or setNudge(), they keep telling the same time.
+ */
+class PlayClock {
+public:
+    PlayClock() : _wall( 0 ), _base( 0 ), _scale( 1.0 ), _nudge( 1.0 ) {}
+
+    void setTimer( const QElapsedTimer& t ) { _timer =t; _wall =_base =0; _scale =_nudge =1.0; }
+    const QElapsedTimer& timer() const { return _timer; }
+
+    qint64 nsecsElapsed() const { return fromWall( _timer.nsecsElapsed() ); }
+    qint64 elapsed() const { return nsecsElapsed() / 1000000; }
+
+    double scale() const { return _scale; }
+    // Play at @scale times the normal speed from play time @at (nsec) on
+    void setScale( double scale, qint64 at ) { _wall =toWall( at ); _base =at; _scale =scale; }
+
+    // Run @nudge times as fast as the scale says from play time @at on, to catch up with or
+    // wait for other instances, see SyncPeer
+    double nudge() const { return _nudge; }
+    void setNudge( double nudge, qint64 at ) { _wall =toWall( at ); _base =at; _nudge =nudge; }
+
+    // Convert between nsec of the timer and nsec of playback
+    qint64 fromWall( qint64 wall ) const { return _base + (qint64)((wall - _wall) * _scale * _nudge); }
+    qint64 toWall( qint64 t ) const { return _wall + (qint64)((t - _base) / (_scale * _nudge)); }
+
+private:
+    QElapsedTimer _timer;
+    qint64 _wall, _base;        // Play time _base was at _wall on the timer
+    double _scale, _nudge;
+};
@@ -0,0 +1,330 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "playhost.h"
+#include "composition.h"
+#include "compiledcomposition.h"
+#include "oscserver.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QHostAddress>
+#include <QMidiOut.h>
+#include <algorithm>
+#include <cstdio>
+
+HostWorker::HostWorker( const QElapsedTimer& timer, QObject* parent ) :
+    QThread( parent ),
+    _timer( timer ),
+    _mailbox( HOST_MAILBOX ),
+    _load( 0 ) {}
+
+HostWorker::~HostWorker() {
+    shutdown();
+    wait();
+}
+
+void
+HostWorker::play( PlayThread* player ) {
+    // Commands that are posted from now on wake this worker
+    player->_wake.store( &_waiter, std::memory_order_release );
+    player->_hosted.store( true, std::memory_order_release );
+    const Request r ={ player, true };
+    while( !_mailbox.push( r ) ) yieldCurrentThread();
+    _waiter.wake();
+}
+
+void
+HostWorker::stop( PlayThread* player ) {
+    if( !player->isPlaying() ) return;
+    const Request r ={ player, false };
+    while( !_mailbox.push( r ) ) yieldCurrentThread();
+    _waiter.wake();
+    while( player->isPlaying() ) usleep( 100 );
+}
+
+void
+HostWorker::run() {
+    while( !isInterruptionRequested() ) {
+        Request r;
+        while( _mailbox.pop( &r ) ) {
+            const int i =_players.indexOf( r.player );
+            if( r.play ) {
+                if( i >= 0 ) continue;
+                r.player->begin();
+                _players.append( r.player );
+                continue;
+            }
+            if( i >= 0 ) {
+                r.player->end();
+                _players.remove( i );
+            }
+            r.player->_wake.store( &r.player->_waiter, std::memory_order_release );
+            r.player->_hosted.store( false, std::memory_order_release );
+        }
+
+        // Sleep until the first composition has something due
+        qint64 until =-1;
+        for( auto p : _players ) {
+            const qint64 next =p->step();
+            if( next >= 0 && (until < 0 || next < until) ) until =next;
+        }
+        _waiter.wait( _timer, until );
+        for( auto p : _players ) p->_metrics.wakeup();
+    }
+
+    for( auto p : _players ) {
+        p->end();
+        p->_wake.store( &p->_waiter, std::memory_order_release );
+        p->_hosted.store( false, std::memory_order_release );
+    }
+    _players.clear();
+}
+
+PlayHost::PlayHost( QObject* parent ) :
+    QObject( parent ),
+    _osc( nullptr ) {
+    _timer.start();
+}
+
+PlayHost::~PlayHost() {
+    clear();
+}
+
+/** Load either a JSON or a compiled composition, depending on the file's extension */
+static Composition*
+loadComposition( const QString& path, QString* error ) {
+    if( path.endsWith( ".mtc", Qt::CaseInsensitive ) )
+        return CompiledComposition::load( path, error );
+
+    QFile file( path );
+    if( !file.open( QIODevice::ReadOnly | QIODevice::Text) ) {
+        *error ="Could not open given file for reading.";
+        return nullptr;
+    }
+    return new Composition( Composition::fromJson( file.readAll(), error ) );
+}
+
+/** The number of events per lap of all tracks of @player */
+static qint64
+eventsPerLap( PlayThread* player ) {
+    qint64 size =0;
+    for( auto tq : player->queue().tracks() )
+        size += (qint64)tq->events.count() * qMax( 1, tq->axles.count() );
+    return size;
+}
+
+bool
+PlayHost::load( const QString& path, QString* error ) {
+    QString etxt;
+    QJsonParseError err;
+    QJsonDocument doc;
+    QJsonObject root;
+    QJsonArray array;
+    QHash<QString, qint64> ports;       // Events per lap of the rooms of every port
+    QList<QString> order;
+    int threads;
+    const QDir dir =QFileInfo( path ).dir();
+
+    clear();
+    QFile file( path );
+    if( !file.open( QIODevice::ReadOnly | QIODevice::Text ) ) { etxt ="Could not open given file for reading."; goto ERROR; }
+
+    doc =QJsonDocument::fromJson( file.readAll(), &err );
+    if( err.error != QJsonParseError::NoError ) { etxt =err.errorString() + " at " + QString::number( err.offset ); goto ERROR; }
+    if( !doc.isObject() ) { etxt ="Expected a root-level object in the document"; goto ERROR; }
+
+    root =doc.object();
+    array =root.value( "Rooms" ).toArray();
+    if( array.isEmpty() ) { etxt ="No rooms"; goto ERROR; }
+    for( auto it =array.begin(); it != array.end(); it++ ) {
+        const QJsonObject json =(*it).toObject();
+        Room r;
+        r.name =json.value( "Name" ).toString( QString::number( _rooms.count() ) );
+        r.port =json.value( "Port" ).toString();
+        r.autoplay =json.value( "Autoplay" ).toBool( true );
+        r.player =nullptr;
+        r.worker =nullptr;
+        r.playing =false;
+        r.restart =true;
+
+        const QString comp =json.value( "Composition" ).toString();
+        if( comp.isEmpty() ) { etxt ="Room '" + r.name + "' without a composition"; goto ERROR; }
+        QString cerr;
+        r.comp =loadComposition( dir.absoluteFilePath( comp ), &cerr );
+        if( r.comp == nullptr || !r.comp->isValid() ) {
+            delete r.comp;
+            etxt =comp + ": " + cerr;
+            goto ERROR;
+        }
+        _rooms.append( r );
+    }
+
+    // One output per port, shared by all rooms that send to it
+    for( auto& r : _rooms ) {
+        if( !_outputs.contains( r.port ) ) {
+            QMidiOut* out =new QMidiOut();
+            _outputs.insert( r.port, out );
+            const auto devices =out->devices();
+            QString id;
+            for( auto it =devices.begin(); it != devices.end() && id.isEmpty(); it++ ) {
+                if( r.port.isEmpty() || it.key() == r.port || it.value().contains( r.port, Qt::CaseInsensitive ) )
+                    id =it.key();
+            }
+            if( id.isEmpty() || !out->connect( id ) ) { etxt ="Could not connect to MIDI device '" + r.port + "'"; goto ERROR; }
+        }
+        r.player =new PlayThread();
+        r.player->setMidiOut( _outputs.value( r.port ) );
+        r.player->setTimer( _timer );
+        r.player->setComposition( r.comp );
+        ports[r.port] += eventsPerLap( r.player );
+    }
+
+    // Rooms on the same port stay on one worker. The busiest ports are placed first, each
+    // on the worker that has the fewest events.
+    threads =qBound( 1, root.value( "Threads" ).toInt( qMin( _rooms.count(), QThread::idealThreadCount() ) ), _rooms.count() );
+    for( int i =0; i < threads; i++ )
+        _workers.append( new HostWorker( _timer ) );
+    order =ports.keys();
+    std::stable_sort( order.begin(), order.end(), [&]( const QString& a, const QString& b ) { return ports[a] > ports[b]; } );
+    for( const auto& port : order ) {
+        HostWorker* w =*std::min_element( _workers.begin(), _workers.end(),
+            []( const HostWorker* a, const HostWorker* b ) { return a->load() < b->load(); } );
+        w->addLoad( ports[port] );
+        for( auto& r : _rooms )
+            if( r.port == port ) r.worker =w;
+    }
+    for( auto w : _workers )
+        w->start( QThread::HighPriority );
+    return true;
+ERROR:
+    if( error != nullptr ) *error ="Incorrect rooms file - " + etxt;
+    clear();
+    return false;
+}
+
+/** Accept the OSC messages of the window on @port of @address, localhost when empty. Messages for the first room
+ *  have no prefix, those for the others start with /room/<index>. */
+bool
+PlayHost::setOscServer( const QString& address, quint16 port ) {
+    if( _osc != nullptr || _rooms.isEmpty() ) return false;
+
+    _osc =new OscServer( _rooms[0].player );
+    for( int i =1; i < _rooms.count(); i++ )
+        _osc->addThread( _rooms[i].player );
+    QString err;
+    const QHostAddress host =address.isEmpty() ? QHostAddress( QHostAddress::LocalHost ) : QHostAddress( address );
+    if( !_osc->listen( host, port, &err ) ) {
+        fprintf( stderr, "Could not listen for OSC on port %d: %s\n", (int)port, qPrintable( err ) );
+        delete _osc;
+        _osc =nullptr;
+        return false;
+    }
+    printf( "Listening for OSC on %s:%d\n", qPrintable( host.toString() ), (int)_osc->port() );
+    // Any track can be started, stopped or muted over OSC, so none may be on the precompiled
+    // schedule. The queues of the rooms that are not playing yet are built again.
+    for( auto& r : _rooms ) {
+        r.player->queue().setAllControlled( true );
+        if( !r.playing ) r.player->setComposition( r.comp );
+    }
+    _osc->setTimer( _timer );
+    connect( _osc, &OscServer::transportPosted, this, &PlayHost::transportPosted, Qt::QueuedConnection );
+    _osc->start( QThread::HighPriority );
+    return true;
+}
+
+void
+PlayHost::clear() {
+    for( int i =0; i < _rooms.count(); i++ )
+        stop( i );
+    // The server posts to the rooms
+    delete _osc;
+    _osc =nullptr;
+    qDeleteAll( _workers );
+    _workers.clear();
+    for( auto& r : _rooms ) {
+        delete r.player;
+        delete r.comp;
+    }
+    _rooms.clear();
+    qDeleteAll( _outputs );
+    _outputs.clear();
+}
+
+/** Start or continue playback of @room */
+void
+PlayHost::play( int room ) {
+    if( room < 0 || room >= _rooms.count() ) return;
+    Room& r =_rooms[room];
+    if( r.playing ) return;
+    const qint64 t =r.player->clock().elapsed();
+    if( r.restart )
+        r.player->queue().restart( t, t );
+    else
+        r.player->queue().start( t );
+    r.playing =true;
+    r.worker->play( r.player );
+}
+
+void
+PlayHost::stop( int room ) {
+    if( room < 0 || room >= _rooms.count() ) return;
+    Room& r =_rooms[room];
+    if( !r.playing ) return;
+    r.worker->stop( r.player );
+    r.player->queue().stop( r.player->clock().elapsed() );
+    r.playing =false;
+    r.restart =false;
+    if( r.player->ignoredCommands() > 0 )
+        printf( "Room '%s' ignored %llu commands for tracks that are not in its composition\n",
+                qPrintable( r.name ), (unsigned long long)r.player->ignoredCommands() );
+}
+
+/** Continue @room from @position msec after the start of its composition */
+void
+PlayHost::seek( int room, qint64 position ) {
+    if( room < 0 || room >= _rooms.count() ) return;
+    Room& r =_rooms[room];
+    const bool playing =r.playing;
+    stop( room );
+    r.player->queue().seekTo( position, r.comp, r.player->clock().elapsed() );
+    r.restart =false;
+    if( playing ) play( room );
+}
+
+/** Play @room at @scale times the tempo of its composition */
+void
+PlayHost::setTempoScale( int room, double scale ) {
+    if( room < 0 || room >= _rooms.count() || scale <= 0.0 ) return;
+    Room& r =_rooms[room];
+    if( r.playing ) {
+        const PlayThread::Command c ={ PlayThread::Command::Tempo, -1, qRound( scale * 1000.0 ), false, _timer.nsecsElapsed(), 0 };
+        r.player->postCommand( c );
+        return;
+    }
+    r.player->clock().setScale( scale, r.player->clock().nsecsElapsed() );
+}
+
+/** Carry out the transport messages received over OSC */
+void
+PlayHost::transportPosted() {
+    OscServer::Transport t;
+    while( _osc->takeTransport( &t ) ) {
+        switch( t.type ) {
+        case OscServer::Transport::Play: play( t.room ); break;
+        case OscServer::Transport::Stop: stop( t.room ); break;
+        case OscServer::Transport::Seek: seek( t.room, (qint64)t.value ); break;
+        case OscServer::Transport::Tempo: setTempoScale( t.room, t.value ); break;
+        // The compositions of the rooms are given by the rooms file
+        default: break;
+        }
+    }
+}
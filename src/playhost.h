@@ -0,0 +1,108 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QThread>
+#include <QVector>
+#include <QHash>
+#include <QElapsedTimer>
+#include "playthread.h"
+#include "mpmcqueue.h"
+#include "waiter.h"
+
+#define HOST_MAILBOX 64         // Compositions that can be waiting to start or stop on a worker
+
+class Composition;
+class OscServer;
+class QMidiOut;
+
+/** Plays the compositions of a PlayHost that were given to it, on a thread of its own.
+ *
+ * The PlayThread of every composition does the work of one pass of its loop in step(), and
+ * the worker sleeps until the first of them has something due, or a command is posted to one.
+ */
+class HostWorker : public QThread {
+    Q_OBJECT
+public:
+    HostWorker( const QElapsedTimer& timer, QObject* parent =0 );
+    ~HostWorker();
+
+    // Start or stop playing the composition of @player. Stopping waits until it has stopped.
+    void play( PlayThread* player );
+    void stop( PlayThread* player );
+    void shutdown() { requestInterruption(); _waiter.wake(); }
+
+    // Events per lap of the compositions it was given, to spread them over the workers
+    qint64 load() const { return _load; }
+    void addLoad( qint64 events ) { _load += events; }
+
+    void run() override;
+
+private:
+    struct Request {
+        PlayThread* player;
+        bool play;
+    };
+
+    QElapsedTimer _timer;
+    Waiter _waiter;
+    MpmcQueue<Request> _mailbox;
+    QVector<PlayThread*> _players;      // Only used by run()
+    qint64 _load;
+};
+
+/** Plays several independent compositions in one process, e.g. one for every room of an
+ *  installation.
+ *
+ * Every room has its own composition, clock, transport and MIDI output port, but there is no
+ * window and no thread per room. A few HostWorkers play all rooms between them and the
+ * rooms that send to the same port share one QMidiOut. Such rooms are played by the same
+ * worker, so only one thread ever writes to a port. Rooms are controlled over OSC, with the
+ * messages of the window prefixed by /room/<index>.
+ */
+class PlayHost : public QObject {
+    Q_OBJECT
+public:
+    struct Room {
+        QString name;
+        QString port;           // Id or part of the name of the MIDI output, empty for the first device
+        bool autoplay;
+        Composition* comp;
+        PlayThread* player;     // Never started, a worker plays it
+        HostWorker* worker;
+        bool playing, restart;
+    };
+
+    PlayHost( QObject* parent =0 );
+    ~PlayHost();
+
+    // Read the rooms from the JSON file at @path, load their compositions and open their ports
+    bool load( const QString& path, QString* error =nullptr );
+    bool setOscServer( const QString& address, quint16 port );
+
+    const QVector<Room>& rooms() const { return _rooms; }
+    int workerCount() const { return _workers.count(); }
+
+    void play( int room );
+    void stop( int room );
+    void seek( int room, qint64 position );
+    void setTempoScale( int room, double scale );
+
+private slots:
+    void transportPosted();
+
+private:
+    void clear();
+
+    QElapsedTimer _timer;
+    QVector<Room> _rooms;
+    QVector<HostWorker*> _workers;
+    QHash<QString, QMidiOut*> _outputs;
+    OscServer* _osc;
+};
@@ -7,45 +7,207 @@
 
 #include "playthread.h"
 #include "composition.h"
+#include "trace.h"
+#include "schedulershard.h"
 #include <QMidiOut.h>
 #include <QTimer>
 #include <QMidiFile.h>
 #include <QElapsedTimer>
+#include <algorithm>
 #include <cstdio>
+#include <cstdint>
 
 PlayThread::PlayThread( QObject *parent ) :
     QThread( parent ),
     _comp( nullptr ),
-    _midiout( nullptr ) {
+    _midiout( nullptr ),
+    _trace( nullptr ),
+    _coalesced( 0 ),
+    _wake( &_waiter ),
+    _hosted( false ),
+    _shardCount( 1 ),
+    _scene( -1 ),
+    _lateThreshold( LATE_THRESHOLD ),
+    _lateRamp( LATE_RAMP ),
+    _latePolicy( PlayLate ),
+    _rampHead( 0 ),
+    _rampScheduled( 0 ) {
+    _pending.reserve( MAX_PENDING_COMMANDS );
+    _latency ={ 0, 0, 0, 0 };
+    _ignored =0;
+    _dropped =0;
+    _buildTime =0;
+    _ramp.reserve( LATE_RAMP_CAPACITY );
+    for( int i =0; i < LATE_TYPES; i++ ) _lateTypes[i] =-1;
 }
 
 PlayThread::~PlayThread() {
+    qDeleteAll( _shards );
+    for( auto& s : _scenes ) delete s.queue;
 }
 
 void 
 PlayThread::setComposition( const Composition* comp ) {
-    if( isRunning() ) return;
+    if( isPlaying() ) return;
+    clearScenes();
     _comp =comp;
+    const TimeVarT t0 =timeNow();
     _queue.initialize( comp );
+    _buildTime =durationUs( timeNow() - t0 );
+    _voices.setTrackCount( comp ? comp->tracks().count() : 0 );
+    _muted.fill( false, comp ? comp->tracks().count() : 0 );
+    QVector<int> ids;
+    if( comp )
+        for( const auto& t : comp->tracks() ) ids.append( t.id() );
+    _metrics.setTracks( ids );
+    _lateTracks.fill( -1, ids.count() );
+    for( int i =0; i < ids.count(); i++ )
+        if( _lateTrackIds.contains( ids[i] ) ) _lateTracks[i] =_lateTrackIds.value( ids[i] );
+    _ramp.resize( 0 );
+    _rampHead =_rampScheduled =0;
+    _pending.clear();
+    buildShards();
+}
+
+/** Divide the tracks over the shards, so they all have about the same number of events per
+ *  lap. The largest tracks are placed first, each on the shard that has the fewest events. */
+void
+PlayThread::buildShards() {
+    qDeleteAll( _shards );
+    _shards.clear();
+    _heads.clear();
+    const EventQueue::TrackQueuePtrVectorT& tracks =_queue.tracks();
+    const int count =qMin( _shardCount, tracks.count() );
+    if( count <= 1 ) return;
+
+    QVector<int> order;
+    for( int i =0; i < tracks.count(); i++ ) order.append( i );
+    auto size =[&]( int i ) { return (qint64)tracks[i]->events.count() * qMax( 1, tracks[i]->axles.count() ); };
+    std::stable_sort( order.begin(), order.end(), [&]( int a, int b ) { return size( a ) > size( b ); } );
+
+    QVector<QVector<int>> indices( count );
+    QVector<qint64> load( count, 0 );
+    _owners.fill( 0, tracks.count() );
+    for( int i : order ) {
+        const int shard =(int)(std::min_element( load.begin(), load.end() ) - load.begin());
+        indices[shard].append( i );
+        load[shard] += size( i );
+        _owners[i] =shard;
+    }
+    for( int i =0; i < count; i++ ) {
+        _shards.append( new SchedulerShard( i, &_waiter, &_executed ) );
+        // The tracks of a shard are played in the order of the composition, like without shards
+        std::sort( indices[i].begin(), indices[i].end() );
+    }
+    for( int i =0; i < count; i++ )
+        _shards[i]->setTracks( _comp, _queue, indices[i], &_shards, &_owners );
+    const Due none ={ nullptr, nullptr, 0 };
+    _heads.fill( none, count );
+    printf( "Divided %d tracks over %d shards, %lld to %lld events per lap each\n", tracks.count(), count,
+            (long long)*std::min_element( load.begin(), load.end() ), (long long)*std::max_element( load.begin(), load.end() ) );
+}
+
+/** Prepare @comp to be played as a scene, returns its index */
+int
+PlayThread::addScene( const Composition* comp ) {
+    if( isPlaying() || !comp ) return -1;
+    Scene s;
+    s.comp =comp;
+    s.queue =new EventQueue();
+    s.queue->setCoalescing( _queue.coalescing() );
+    s.queue->setControlledTracks( _queue.controlledTrackIds() );
+    s.queue->setAllControlled( _queue.allControlled() );
+    const TimeVarT t0 =timeNow();
+    s.queue->initialize( comp );
+    _buildTime =durationUs( timeNow() - t0 );
+    s.lateTracks.fill( -1, comp->tracks().count() );
+    for( int i =0; i < comp->tracks().count(); i++ ) {
+        s.ids.append( comp->tracks()[i].id() );
+        if( _lateTrackIds.contains( s.ids[i] ) ) s.lateTracks[i] =_lateTrackIds.value( s.ids[i] );
+    }
+    s.metrics =_metrics.addTracks( s.ids );
+    _scenes.append( s );
+    return _scenes.count() - 1;
+}
+
+/** Play scene @index when playback starts */
+void
+PlayThread::setScene( int index ) {
+    if( isPlaying() || index < 0 || index >= _scenes.count() ) return;
+    if( _shardCount > 1 && !_shards.isEmpty() )
+        printf( "Scenes are played without shards\n" );
+    qDeleteAll( _shards );
+    _shards.clear();
+    _heads.clear();
+
+    // Everything per track gets room for the largest scene, so switching allocates nothing
+    int largest =0;
+    for( const auto& s : _scenes ) largest =qMax( largest, s.ids.count() );
+    _voices.setTrackCount( largest );
+    _muted.fill( false, largest );
+    switchScene( index, _clock.elapsed() );
+}
+
+/** Remove all scenes, after which a composition has to be set */
+void
+PlayThread::clearScenes() {
+    if( isPlaying() ) return;
+    // The queue of the scene that plays is the one of the thread
+    if( _scene >= 0 ) {
+        _queue.clear();
+        _comp =nullptr;
+        _metrics.clearTracks();
+    }
+    for( auto& s : _scenes ) delete s.queue;
+    _scenes.clear();
+    _scene =-1;
+}
+
+/** Play scene @index from @now on, from its start. Allocates nothing, so it can be done while playing. */
+void
+PlayThread::switchScene( int index, qint64 now ) {
+    // The notes of the scene that played end here. Events that were held back and quantised
+    // commands were meant for its tracks.
+    allNotesOff();
+    _ramp.resize( 0 );
+    _rampHead =_rampScheduled =0;
+    _pending.resize( 0 );
 
+    if( _scene >= 0 ) _queue.swap( *_scenes[_scene].queue );
+    Scene& s =_scenes[index];
+    _queue.swap( *s.queue );
+    _queue.restart( now, now );
+    _scene =index;
+    _comp =s.comp;
+    // Shared with the scene rather than copied
+    _lateTracks =s.lateTracks;
+    _muted.fill( false );
+    _metrics.useTracks( s.metrics );
 }
 
 /*void 
 PlayThread::setPlayHead( const PlayHead& ph ) {
-    if( isRunning() ) return;
+    if( isPlaying() ) return;
     _playhead =ph;
 }*/
 
 void 
 PlayThread::setMidiOut( QMidiOut* midiout ) {
-    if( isRunning() ) return;
+    if( isPlaying() ) return;
     _midiout =midiout;
 }
 
+void 
+PlayThread::setTrace( TraceBuffer* trace ) {
+    if( isPlaying() ) return;
+    _trace =trace;
+}
+
 void 
 PlayThread::setTimer( const QElapsedTimer& t ) {
     _timer =t;
-    _queue.restart( 0, t.elapsed() );
+    _clock.setTimer( t );
+    _queue.restart( 0, _clock.elapsed() );
 }
 
 /*void 
@@ -59,26 +221,200 @@ PlayThread::run() {
         exit(0);
         return;
     }
-    while( 1 ) {
-        if( isInterruptionRequested() ) {
-            // TODO: keep track of actually used channels
-            allNotesOff();
-        //    for( int i =0; i < 16; i++ )
-        //        _midiout->controlChange( i, 120, 0 );
-            exit(0);
-            return;
-        }
-
+    // Started before entering real-time mode, so they are not pinned to the CPU of this thread
+    begin();
+    if( _realtime.enabled ) {
+        QString err;
+        if( !enterRealtime( _realtime, &err ) )
+            fprintf( stderr, "Real-time mode is incomplete:\n%s\n", qPrintable( err ) );
+        // From here on, nothing may be allocated until playback stops
+        AllocationCounter::arm();
+    }
+    while( !isInterruptionRequested() ) {
 //        if( tick % BROADCAST_DIVISION )
 //            emit positionAdvanced( _playhead );
 
+        const qint64 until =step();
+#ifndef QT_NO_DEBUG
+        if( _realtime.enabled && AllocationCounter::count() > 0 ) {
+            AllocationCounter::disarm();
+            qFatal( "The play thread allocated memory %llu times in real-time mode",
+                    (unsigned long long)AllocationCounter::count() );
+        }
+#endif
+        // Tracing costs a single branch when it is disabled
+        if( _trace ) {
+            traceSleep( TraceBuffer::Sleep, until );
+            _waiter.wait( _timer, until );
+            traceSleep( TraceBuffer::Wakeup, until );
+        } else
+            _waiter.wait( _timer, until );
+        _metrics.wakeup();
+        //msleep( 1 );
+    }
+    AllocationCounter::disarm();
+    end();
+    exit(0);
+}
+
+/** Get ready to play, on the thread that will call step() */
+void
+PlayThread::begin() {
+    for( auto shard : _shards ) shard->play( _clock, _realtime );
+}
+
+/** Play what is due now. Returns when there will be more to do, in nsec on the timer, or -1 if
+ *  no track runs and nothing is pending, so only a command or stopping can bring work. */
+qint64
+PlayThread::step() {
+    processCommands();
+
+    if( _shards.isEmpty() ) {
         EventQueue::Event* e =nullptr;
-        while( (e = _queue.takeFront( _timer.elapsed() ) ) ) {
-           processEvent( e );
+        while( (e = _queue.takeFront( _clock.elapsed() ) ) )
+            dispatch( e, _queue.now() - _queue.lateness() );
+    } else
+        mergeShards();
+    scheduleRamp( _clock.elapsed() );
+    releaseRamp( _clock.elapsed() );
+    _metrics.setVoices( _voices );
+
+    const qint64 now =_clock.elapsed();
+    const qint64 idle =timeUntilPending( _shards.isEmpty() ? _queue.minTimeUntilNextEvent( MAX_IDLE, now ) : MAX_IDLE );
+    // Shards find the due events themselves and wake this thread when they have some
+    const bool waiting =!_pending.isEmpty() || _rampHead < _ramp.count();
+    const bool idleQueue =_shards.isEmpty() ? _queue.isIdle() : true;
+    return idleQueue && !waiting ? -1 : _clock.toWall( (now + idle) * 1000000 );
+}
+
+/** Stop playing: what was due or held back is not played anymore and all notes are ended */
+void
+PlayThread::end() {
+    for( auto shard : _shards ) shard->stop();
+    for( int i =0; i < _shards.count(); i++ ) {
+        _shards[i]->wait();
+        // Events that were due but not sent yet are not played anymore
+        while( _shards[i]->take( &_heads[i] ) ) {}
+        _heads[i].track =nullptr;
+    }
+    // Events that were held back are not played anymore
+    _ramp.resize( 0 );
+    _rampHead =_rampScheduled =0;
+    // TODO: keep track of actually used channels
+    allNotesOff();
+//    for( int i =0; i < 16; i++ )
+//        _midiout->controlChange( i, 120, 0 );
+}
+
+void
+PlayThread::setTypeLatePolicy( int type, LatePolicy p ) {
+    if( type >= 0 && type < LATE_TYPES ) _lateTypes[type] =p;
+}
+
+/** Process @e, or hold it back or leave it out if it is late, as the late policy says.
+ *  Once events are held back, all events after them have to wait their turn. */
+void
+PlayThread::dispatch( const EventQueue::Event* e, qint64 due ) {
+    const qint64 now =_timer.nsecsElapsed();
+    const qint64 scheduled =_clock.toWall( due * 1000000 );
+    if( _trace ) traceEvent( e, now, scheduled );
+    _metrics.dispatched( e->trackQueue->index, now - scheduled );
+
+    LatePolicy policy =PlayLate;
+    if( _clock.fromWall( now ) / 1000000 - due > _lateThreshold ) {
+        policy =latePolicy( e );
+        const bool noteOn =e->type == EventQueue::TriggerEvent && e->event && e->event->type == Trigger::MidiEvent
+                           && e->event->midiEvent.type() == QMidiEvent::NoteOn;
+        if( policy == DropLate && !noteOn ) policy =PlayLate;
+        _metrics.late( policy );
+        if( policy == DropLate ) return;
+    }
+
+    if( policy != CompressLate && _rampHead == _ramp.count() ) {
+        processEvent( e );
+        return;
+    }
+    // Nothing may be allocated here, so when the ramp is full its events are played right away
+    if( _ramp.count() == LATE_RAMP_CAPACITY ) {
+        releaseRamp( 0, true );
+        processEvent( e );
+        return;
+    }
+    Ramped r ={ due, -1, _ramp.count(), e };
+    _ramp.append( r );
+}
+
+/** Dispatch the events that the shards found due, in the order they were due. An event is
+ *  held back until every shard with an empty outbox has passed its due time, so a shard that
+ *  wakes up later cannot have an earlier event overtaken by those of the others. */
+void
+PlayThread::mergeShards() {
+    for( ;; ) {
+        int first =-1;
+        qint64 mark =INT64_MAX;
+        for( int i =0; i < _shards.count(); i++ ) {
+            Due& h =_heads[i];
+            if( !h.track ) {
+                // Whatever was due before the watermark is in the outbox by now
+                const qint64 watermark =_shards[i]->watermark();
+                if( !_shards[i]->take( &h ) ) {
+                    mark =qMin( mark, watermark );
+                    continue;
+                }
+            }
+            if( first < 0 || h.due < _heads[first].due ) first =i;
         }
+        // The shards wake this thread when their watermark moves
+        if( first < 0 || _heads[first].due >= mark ) return;
+        Due& h =_heads[first];
+        if( h.event ) dispatch( h.event, h.due );
+        else allTrackNotesOff( h.track );
+        h.track =nullptr;
+    }
+}
 
-        msleep( _queue.minTimeUntilNextEvent( MAX_IDLE, _timer.elapsed() ) );
-        //msleep( 1 );
+PlayThread::LatePolicy
+PlayThread::latePolicy( const EventQueue::Event* e ) const {
+    if( _lateTracks[e->trackQueue->index] >= 0 )
+        return (LatePolicy)_lateTracks[e->trackQueue->index];
+    int type =-1;
+    if( e->type == EventQueue::ImplicitNoteOffEvent )
+        type =QMidiEvent::NoteOff;
+    else if( e->type == EventQueue::TriggerEvent && e->event && e->event->type == Trigger::MidiEvent )
+        type =e->event->midiEvent.type();
+    if( type >= 0 && type < LATE_TYPES && _lateTypes[type] >= 0 )
+        return (LatePolicy)_lateTypes[type];
+    return _latePolicy;
+}
+
+/** Give the events that were added to the ramp since the last call their release times.
+ *  They follow the events before them and keep their order and spacing, but when they
+ *  span more than the ramp time they are squeezed into it. */
+void
+PlayThread::scheduleRamp( qint64 now ) {
+    if( _rampScheduled == _ramp.count() ) return;
+    const auto first =_ramp.begin() + _rampScheduled, last =_ramp.end();
+    std::sort( first, last, []( const Ramped& a, const Ramped& b ) {
+        return a.due < b.due || (a.due == b.due && a.order < b.order);
+    } );
+    const qint64 start =_rampScheduled > 0 ? qMax( now, _ramp[_rampScheduled - 1].release ) : now;
+    const qint64 span =(last - 1)->due - first->due;
+    const qint64 length =qMin( span, (qint64)_lateRamp );
+    for( auto it =first; it != last; it++ )
+        it->release =start + (span > 0 ? (it->due - first->due) * length / span : 0);
+    _rampScheduled =_ramp.count();
+}
+
+/** Process the events of the ramp that are due at @now, or all of them */
+void
+PlayThread::releaseRamp( qint64 now, bool all ) {
+    const int end =all ? _ramp.count() : _rampScheduled;
+    while( _rampHead < end && (all || _ramp[_rampHead].release <= now) )
+        processEvent( _ramp[_rampHead++].event );
+    // Keeps the capacity, so nothing is allocated when the next events are held back
+    if( _rampHead == _ramp.count() ) {
+        _ramp.resize( 0 );
+        _rampHead =_rampScheduled =0;
     }
 }
 
@@ -95,10 +431,24 @@ PlayThread::processEvent( const EventQueue::Event* e ) {
                 midi.setVoice( e->trackQueue->track->midiChannel() );
             midi.setNote( midi.note() + e->section->transpose );
             
-            // Update the list of sounding midi notes for NoteOn and NoteOff events
-            if( e->event->midiEvent.type() == QMidiEvent::NoteOn )
-                _amnotes[e->trackQueue][midi.voice()][midi.note()]++;
-            else if( e->event->midiEvent.type() == QMidiEvent::NoteOff ) {
+            // Update the table of sounding voices for NoteOn and NoteOff events
+            if( e->event->midiEvent.type() == QMidiEvent::NoteOn ) {
+                // A track may have been stopped while the note was held back by the ramp. The
+                // tracks of shards belong to their threads, which stop them right away.
+                if( _muted[e->trackQueue->index] || (_shards.isEmpty() && !e->trackQueue->running) ) return;
+                VoiceTable::Voice stolen;
+                switch( _voices.noteOn( e->trackQueue->index, midi.voice(), midi.note(), midi.velocity(), 
+                                        _clock.elapsed(), &stolen, 1 + e->merged + e->borrowed, e->borrowed ) ) {
+                case VoiceTable::Dropped:
+                    return;
+                case VoiceTable::Stolen:
+                    _midiout->noteOff( stolen.note, stolen.channel, 0 );
+                    break;
+                default:
+                    break;
+                }
+                _coalesced += e->merged + e->borrowed;
+            } else if( e->event->midiEvent.type() == QMidiEvent::NoteOff ) {
                 trackNoteOff( e->trackQueue, midi.voice(), midi.note(), midi.velocity() );
                 break;
             }
@@ -107,18 +457,19 @@ PlayThread::processEvent( const EventQueue::Event* e ) {
 
             break;
         }
+        // With shards, the tracks were changed already when the event was found due
         case Trigger::StopEvent:
             allTrackNotesOff( e->trackQueue );
-            _queue.stopTrack( e->trackQueue );
+            if( _shards.isEmpty() ) _queue.stopTrack( e->trackQueue );
             break;
         case Trigger::StartEvent:
-            _queue.startTrack( _comp->trackById( e->event->target ) );
+            if( _shards.isEmpty() ) _queue.startTrack( _comp->trackById( e->event->target ) );
             break;
         case Trigger::ResetEvent: {
             EventQueue::TrackQueue* tq = _queue.find( _comp->trackById( e->event->target ) );
             if( !tq ) break;
             allTrackNotesOff( tq );
-            _queue.resetTrack( tq );
+            if( _shards.isEmpty() ) _queue.resetTrack( tq );
             break;
         }
         case Trigger::NoEvent:
@@ -140,7 +491,7 @@ PlayThread::processEvent( const EventQueue::Event* e ) {
     }
     case EventQueue::LoopBeginEvent: {
         int maxLoop = e->trackQueue->track->loopCount();
-        if( maxLoop > 0 && maxLoop == e->trackQueue->lap )
+        if( _shards.isEmpty() && maxLoop > 0 && maxLoop == e->trackQueue->lap )
             _queue.stopTrack( e->trackQueue );
         break;
         }
@@ -148,69 +499,194 @@ PlayThread::processEvent( const EventQueue::Event* e ) {
 
 }
 
+bool
+PlayThread::postCommand( const Command& c ) {
+    // Commands would otherwise wait until playback starts again
+    if( !isPlaying() || !_commands.push( c ) ) return false;
+    _wake.load( std::memory_order_acquire )->wake();
+    return true;
+}
+
+/** Carry out the commands that were posted, or keep them until their section starts */
+void
+PlayThread::processCommands() {
+    Command c;
+    while( _commands.pop( &c ) ) {
+        // With shards, the shard of the track quantises and carries out the command. A Mute
+        // is always carried out right away then, the tracks cannot be read from here.
+        const bool shard =!_shards.isEmpty() && c.type != Command::Mute && c.type != Command::Tempo
+                          && c.type != Command::Nudge && c.type != Command::Scene;
+        const qint64 due =c.quantize && _shards.isEmpty() ? nextSection( c ) : -1;
+        if( shard ) {
+            const EventQueue::TrackQueue* tq =_queue.find( _comp->trackById( c.track ) );
+            if( !tq ) _ignored++;
+            else if( !_shards[_owners[tq->index]]->post( c, true ) ) _dropped++;
+        } else if( due > _clock.elapsed() && _pending.count() < MAX_PENDING_COMMANDS ) {
+            c.executed =due;
+            _pending.append( c );
+        } else
+            executeCommand( c );
+
+        // The time a command waits for its section is intended, so it is not counted
+        const qint64 latency =_timer.nsecsElapsed() - c.posted;
+        _latency.min =_latency.count == 0 ? latency : qMin( _latency.min, latency );
+        _latency.max =qMax( _latency.max, latency );
+        _latency.total += latency;
+        _latency.count++;
+    }
+
+    const qint64 now =_clock.elapsed();
+    for( int i =0; i < _pending.count(); ) {
+        if( _pending[i].executed <= now ) {
+            c =_pending[i];
+            _pending.remove( i );
+            executeCommand( c );
+        } else
+            i++;
+    }
+}
+
+void
+PlayThread::executeCommand( Command& c ) {
+    const qint64 now =_clock.elapsed();
+    if( c.type == Command::Tempo ) {
+        if( c.value <= 0 ) return;
+        _clock.setScale( c.value / 1000.0, now * 1000000 );
+        c.executed =now;
+        _executed.push( c );
+        for( auto shard : _shards ) shard->post( c, false );
+        return;
+    }
+    if( c.type == Command::Nudge ) {
+        _clock.setNudge( 1.0 + c.value / 1e6, now * 1000000 );
+        c.executed =now;
+        _executed.push( c );
+        for( auto shard : _shards ) shard->post( c, false );
+        return;
+    }
+    if( c.type == Command::Scene ) {
+        if( c.value < 0 || c.value >= _scenes.count() ) return;
+        switchScene( c.value, now );
+        c.executed =now;
+        _executed.push( c );
+        return;
+    }
+
+    EventQueue::TrackQueue* tq =_queue.find( _comp->trackById( c.track ) );
+    // Tracks on the precompiled schedule cannot be started or stopped on their own. They are
+    // only there if nothing outside the composition controls them, see EventQueue::setControlledTracks().
+    if( !tq || (tq->scheduled && c.type != Command::Mute) ) {
+        _ignored++;
+        return;
+    }
+
+    switch( c.type ) {
+    case Command::Start:
+        _queue.startTrack( tq, now );
+        break;
+    case Command::Stop:
+        allTrackNotesOff( tq );
+        _queue.stopTrack( tq, now );
+        break;
+    case Command::Reset:
+        allTrackNotesOff( tq );
+        _queue.resetTrack( tq, now );
+        break;
+    case Command::Mute:
+        _muted[tq->index] =c.value < 0 ? !_muted[tq->index] : c.value != 0;
+        if( _muted[tq->index] ) allTrackNotesOff( tq );
+        break;
+    default:
+        return;
+    }
+    c.executed =now;
+    _executed.push( c );
+}
+
+/** Return the time (msec) at which the next section of the track of @c starts, or -1.
+ *  A scene is switched at the next section or lap of the first track that runs. */
+qint64
+PlayThread::nextSection( const Command& c ) const {
+    if( c.type == Command::Scene )
+        return c.track == 1 ? _queue.nextLap( nullptr, _clock.elapsed() ) : _queue.nextSection( nullptr, _clock.elapsed() );
+    return _queue.nextSection( _queue.find( _comp->trackById( c.track ) ), _clock.elapsed() );
+}
+
+/** Return @max, or the time until the first quantised command or held back event is due if that is sooner */
+qint64
+PlayThread::timeUntilPending( qint64 max ) const {
+    const qint64 now =_clock.elapsed();
+    for( const auto& c : _pending )
+        max =qMin( max, qMax( (qint64)0, c.executed - now ) );
+    if( _rampHead < _rampScheduled )
+        max =qMin( max, qMax( (qint64)0, _ramp[_rampHead].release - now ) );
+    return max;
+}
+
+void
+PlayThread::traceEvent( const EventQueue::Event* e, qint64 now, qint64 scheduled ) {
+    const Track* track =e->trackQueue->track;
+    TraceBuffer::Record r;
+    r.time =now;
+    r.scheduled =scheduled;
+    r.kind =TraceBuffer::Dispatch;
+    r.type =e->type;
+    r.trigger =e->event ? e->event->type : -1;
+    r.track =track->id();
+    r.section =e->section ? (int)(e->section - track->sections().constData()) : -1;
+    r.reserved =0;
+    _trace->push( r );
+}
+
+void
+PlayThread::traceSleep( int kind, qint64 until ) {
+    TraceBuffer::Record r;
+    r.time =_timer.nsecsElapsed();
+    r.scheduled =until;
+    r.kind =kind;
+    r.type =r.trigger =r.track =r.section =-1;
+    r.reserved =0;
+    _trace->push( r );
+}
+
+/** The commands for tracks that are missing or on the schedule, also those of the shards */
+quint64
+PlayThread::ignoredCommands() const {
+    quint64 ignored =_ignored;
+    for( auto shard : _shards ) ignored += shard->ignoredCount();
+    return ignored;
+}
+
+/** The number of MIDI bytes that were not sent because identical NoteOns were coalesced:
+ *  the NoteOns that were folded into another one and the NoteOffs that were left out for them. */
+quint64
+PlayThread::coalescedBytes() const {
+    return 3 * (_coalesced + _voices.suppressedCount());
+}
+
 void PlayThread::debug() {
     printf( "\n" );
 
-    for( auto it = _amnotes.begin(); it != _amnotes.end(); it++ ) {
-        const EventQueue::TrackQueue* tq =it.key();
-        for( auto it2 = it.value().begin(); it2 != it.value().end(); it2++ ) {
-            int c = it2.key();
-            for( auto it3 = it2.value().begin(); it3 != it2.value().end(); it3++ ) {
-                printf( "[%d] channel %d: note: %d count %d\n", tq->track->id(), c, it3.key(), it3.value() );
-                for( int i=0; i < it3.value(); i++ ) {
-                    _midiout->noteOff( it3.key(), c, 0 );
-                }
-            }
-            it2.value().clear();
-        }
-        it.value().clear();
-    }
-    _amnotes.clear();
+    _voices.releaseAll( [this]( const VoiceTable::Voice& v ) {
+        printf( "[%d] channel %d: note: %d velocity %d\n", _comp->tracks()[v.track].id(), v.channel, v.note, v.velocity );
+        _midiout->noteOff( v.note, v.channel, 0 );
+    } );
 }
 
 
 /** Send note-off events for all notes played from all tracks.
  * If the same note is activated multiple times, an identical amount of note-offs will be sent.*/
 void PlayThread::allNotesOff() {
-//    printf( "\n" );
-
-    // We iterate over all notes activated on each channel by each track
-    // ... so this is what a triple nested STL-style iterator looks like ...
-    for( auto it = _amnotes.begin(); it != _amnotes.end(); it++ ) {
-        const EventQueue::TrackQueue* tq =it.key();
-        for( auto it2 = it.value().begin(); it2 != it.value().end(); it2++ ) {
-            int c = it2.key();
-            for( auto it3 = it2.value().begin(); it3 != it2.value().end(); it3++ ) {
-                //printf( "[%d] channel %d: note: %d count %d\n", tq->track->id(), c, it3.key(), it3.value() );
-                for( int i=0; i < it3.value(); i++ ) {
-                    _midiout->noteOff( it3.key(), c, 0 );
-                }
-            }
-            it2.value().clear();
-        }
-        it.value().clear();
-    }
-    _amnotes.clear();
+    _voices.releaseAll( [this]( const VoiceTable::Voice& v ) {
+        _midiout->noteOff( v.note, v.channel, 0 );
+    } );
 }
     
 void 
 PlayThread::allTrackNotesOff( const EventQueue::TrackQueue* tq ) {
-    // Check if this track has any used channels, if not return
-    if( !_amnotes.contains(tq) || _amnotes[tq].isEmpty() ) return;
-
-    // Iterate over all channels for this track
-    for( auto it = _amnotes[tq].begin(); it != _amnotes[tq].end(); it++ ) {
-        for( auto it2 = it.value().begin(); it2 != it.value().end(); it2++ ) {
-            int n =it2.key(), c = it.key();
-            while( it2.value() > 0 ) {
-           
-                _midiout->noteOff( n, c, 0 );
-                _amnotes[tq][c][n]--;
-            }
-        }
-        it.value().clear();
-    }
-    _amnotes[tq].clear();
+    _voices.releaseTrack( tq->index, [this]( const VoiceTable::Voice& v ) {
+        _midiout->noteOff( v.note, v.channel, 0 );
+    } );
 }
 
 
@@ -219,22 +695,9 @@ PlayThread::allTrackNotesOff( const EventQueue::TrackQueue* tq ) {
  */
 void 
 PlayThread::trackNoteOff( const EventQueue::TrackQueue* tq, int channel, int note, int velocity, bool all ) {
-
-    int n = note, c = channel;
-    // Check if this track has used notes in @channel
-    if( _amnotes.contains(tq) &&  _amnotes[tq].contains( c ) ) {
- 
-            if( _amnotes[tq][c].contains( n ) && _amnotes[tq][c][n] > 0 ) {
-                do {
-                    _midiout->noteOff( n, c, velocity );
-                    _amnotes[tq][c][n]--;
-                } while( all && _amnotes[tq][c][n] > 0 );
-                if( _amnotes[tq][c][n] == 0 )
-                    _amnotes[tq][c].remove( n );
-            }
-        
-            if( _amnotes[tq][c].isEmpty() )
-                _amnotes[tq].remove( c );
-
-    }
+    // Notes that were stolen or dropped have no voice anymore and are not sent again
+    if( !_voices.noteOff( tq->index, channel, note ) ) return;
+    do {
+        _midiout->noteOff( note, channel, velocity );
+    } while( all && _voices.noteOff( tq->index, channel, note ) );
 }
@@ -14,11 +14,27 @@
 #include <QElapsedTimer>
 #include "miditrain.h"
 #include "eventqueue.h"
+#include "voicetable.h"
+#include "realtime.h"
+#include "mpmcqueue.h"
+#include "playclock.h"
+#include "metrics.h"
+#include "waiter.h"
+#include <atomic>
 
 #define PRECISION 2 // msec
-#define MAX_IDLE 500
+#define MAX_IDLE 500    // msec, longest sleep while tracks are running
+#define MAX_PENDING_COMMANDS 64    // Commands that wait for the next section
+#define LATE_THRESHOLD 20       // msec, default for events that are handled by the late policy
+#define LATE_RAMP 20            // msec, default time over which compressed late events are spread
+#define LATE_RAMP_CAPACITY 1024 // Events that can be held back by the ramp
+#define LATE_TYPES 9            // QMidiEvent::EventType values a late policy can be set for
+#define MAX_SHARDS 64
 
 class Composition;
+class TraceBuffer;
+class SchedulerShard;
+class HostWorker;
 class QMidiOut;
 class QMidiEvent;
 
@@ -28,6 +44,38 @@ public:
 //    typedef QMultiMap<double /*time*/,QMidiEvent*> EventQueueT;
 //    typedef QMap<int /*track*/,int /*section*/> SectionQueueT;
 
+    /** A request from outside the composition to change a track while playing */
+    struct Command {
+        enum Type { Start, Stop, Reset, Mute, Tempo, Scene, Nudge };
+        qint32 type;
+        qint32 track;           // Track id, not used for Tempo and Nudge. Scene: 1 to wait for the next lap rather than section
+        qint32 value;           // Mute: 1 to mute, 0 to unmute, -1 to toggle. Tempo: scale in 1/1000. Scene: index.
+                                // Nudge: change of the rate of the clock in millionths, see PlayClock::setNudge()
+        bool quantize;          // Wait until the next section of the track starts, or for a Scene of the first running track
+        qint64 posted;          // Time the command was posted, nsec on the timer
+        qint64 executed;        // Time the command took effect, msec on the play clock
+    };
+
+    /** An event that a SchedulerShard found due, or the stop or reset of a track by a command */
+    struct Due {
+        const EventQueue::Event* event;         // Null for a stop or reset
+        const EventQueue::TrackQueue* track;
+        qint64 due;             // msec on the play clock
+    };
+
+    /** What to do with events that were due longer ago than the late threshold, e.g. when
+     *  the thread wakes up late after the system stalled */
+    enum LatePolicy {
+        PlayLate,               // Send them all right away
+        DropLate,               // Leave out the NoteOns, so only notes that sound are stopped
+        CompressLate            // Spread them over the ramp time, in the order they were due
+    };
+
+    struct Latency {
+        quint64 count;
+        qint64 min, max, total; // nsec from posting a command until it was carried out
+    };
+
     PlayThread( QObject *parent =0 );
     ~PlayThread();
 
@@ -39,22 +87,97 @@ public:
 
     EventQueue& queue() { return _queue; }
 
+    // Polyphony limits and voice stealing can only be configured while not playing
+    VoiceTable& voices() { return _voices; }
+    quint64 coalescedBytes() const;
+
+    // Real-time scheduling of the thread, can only be configured while not playing
+    RealtimeOptions& realtime() { return _realtime; }
+
+    // Handling of late events, can only be configured while not playing. The policy of a
+    // track takes precedence over that of a type of MIDI event, which takes precedence
+    // over the default policy.
+    void setLateThreshold( int msec ) { _lateThreshold =qMax( 0, msec ); }
+    int lateThreshold() const { return _lateThreshold; }
+    void setLateRamp( int msec ) { _lateRamp =qMax( 1, msec ); }
+    int lateRamp() const { return _lateRamp; }
+    void setLatePolicy( LatePolicy p ) { _latePolicy =p; }
+    void setTrackLatePolicy( int id, LatePolicy p ) { _lateTrackIds.insert( id, p ); }
+    void setTypeLatePolicy( int type, LatePolicy p );
+
+    // Find the due events of the tracks on @count threads, see SchedulerShard. Only while
+    // not playing, applies to the next composition.
+    void setShards( int count ) { _shardCount =qBound( 1, count, MAX_SHARDS ); }
+    int shards() const { return _shardCount; }
+
+    // Compositions to switch between while playing, with a Scene command. The event queues of
+    // every scene are built when it is added and stay, so a switch allocates nothing. Scenes are
+    // played without shards. Only while not playing; setComposition() removes them.
+    int addScene( const Composition* );
+    void setScene( int index );
+    void clearScenes();
+    int sceneCount() const { return _scenes.count(); }
+    int scene() const { return _scene; }
+
     void setMidiOut( QMidiOut* );
     QMidiOut* midiOut() const { return _midiout; }
 
     void setTimer( const QElapsedTimer& t );
+    // Only to be changed while not playing, otherwise post a Tempo command
+    PlayClock& clock() { return _clock; }
+
+    // Record dispatched events and wakeups to @trace, which is not owned. Null to disable.
+    void setTrace( TraceBuffer* trace );
+    TraceBuffer* trace() const { return _trace; }
 //    void setStartTime( qint64 origin, qint64 now );
 
     void run() override;
 
-    void stop() { requestInterruption(); }
+    // Stop playing, also when the thread is asleep
+    void stop() { requestInterruption(); _waiter.wake(); }
+    // Whether the thread plays, or a HostWorker plays the composition, see PlayHost
+    bool isPlaying() const { return isRunning() || _hosted.load( std::memory_order_acquire ); }
+
+    // Can be called from any thread, returns false if not playing or too many commands are waiting
+    bool postCommand( const Command& );
+    // Commands that were carried out, so the display can follow them
+    bool takeExecuted( Command* c ) { return _executed.pop( c ); }
+    // Only valid while not playing
+    const Latency& commandLatency() const { return _latency; }
+    // Commands for tracks that are not in the composition or are on the precompiled schedule,
+    // only valid while not playing
+    quint64 ignoredCommands() const;
+    // Commands that were lost as the mailbox of the shard of their track was full, only valid
+    // while not playing
+    quint64 droppedCommands() const { return _dropped; }
+    // Time the event queue of the last setComposition() or addScene() took to build, usec
+    qint64 buildTime() const { return _buildTime; }
+    // Can be read from any thread
+    const PlayMetrics& metrics() const { return _metrics; }
 
 //signals:
 //    void positionAdvanced( PlayHead );
     void debug();
 
 private:
+    friend class HostWorker;
+    void begin();
+    qint64 step();
+    void end();
+    void dispatch( const EventQueue::Event*, qint64 due );
     void processEvent( const EventQueue::Event* );
+    void buildShards();
+    void switchScene( int index, qint64 now );
+    void mergeShards();
+    LatePolicy latePolicy( const EventQueue::Event* ) const;
+    void scheduleRamp( qint64 now );
+    void releaseRamp( qint64 now, bool all =false );
+    void processCommands();
+    void executeCommand( Command& );
+    qint64 nextSection( const Command& ) const;
+    qint64 timeUntilPending( qint64 max ) const;
+    void traceEvent( const EventQueue::Event*, qint64 now, qint64 scheduled );
+    void traceSleep( int kind, qint64 until );
 
     void allNotesOff();
     void allTrackNotesOff( const EventQueue::TrackQueue* );
@@ -64,10 +187,55 @@ private:
     //PlayHead _playhead;
     EventQueue _queue;
     QElapsedTimer _timer;
+    PlayClock _clock;           // Time of the composition, runs at the tempo scale
     QMidiOut* _midiout;
+    TraceBuffer* _trace;
     bool _stop;
     TimeVarT _previous;
-    QHash<const EventQueue::TrackQueue*, QHash<int, QHash<int, int>>> _amnotes;
+    VoiceTable _voices;         // Notes that are sounding
+    quint64 _coalesced;         // NoteOns that were not sent, see EventQueue::coalesce()
+    RealtimeOptions _realtime;
+    MpmcQueue<Command> _commands, _executed;
+    Waiter _waiter;             // Woken when a command is posted or playback stops
+    std::atomic<Waiter*> _wake; // _waiter, or that of the HostWorker that plays the composition
+    std::atomic<bool> _hosted;
+    QVector<Command> _pending;  // Quantised commands, executed is the time they are due
+    QVector<bool> _muted;       // Per track index
+    Latency _latency;
+    quint64 _ignored;
+    quint64 _dropped;
+    qint64 _buildTime;
+    PlayMetrics _metrics;
+
+    int _shardCount;
+    QVector<SchedulerShard*> _shards;   // Empty if the thread finds the due events itself
+    QVector<int> _owners;               // Index of the shard of every track
+    QVector<Due> _heads;                // First event taken from every shard, track is null if none
+
+    struct Scene {
+        const Composition* comp;
+        EventQueue* queue;              // Holds the queue of the scene while another one plays
+        QVector<int> ids;               // Of the tracks
+        int metrics;                    // Block of the track counters, see PlayMetrics::addTracks()
+        QVector<qint8> lateTracks;
+    };
+    QVector<Scene> _scenes;
+    int _scene;                         // The scene that plays, -1 without scenes
+
+    struct Ramped {
+        qint64 due;             // Time the event was due (msec)
+        qint64 release;         // Time it will be processed, -1 if not known yet
+        int order;              // Order in which it was taken from the queue
+        const EventQueue::Event* event;
+    };
+    int _lateThreshold, _lateRamp;
+    LatePolicy _latePolicy;
+    qint8 _lateTypes[LATE_TYPES];       // Per QMidiEvent::EventType, -1 to use the default
+    QHash<int, int> _lateTrackIds;
+    QVector<qint8> _lateTracks;         // Per track index, -1 to use the policy of the type
+    QVector<Ramped> _ramp;              // Events held back, in the order they are processed
+    int _rampHead;                      // Index of the first event in _ramp that is left
+    int _rampScheduled;                 // Number of events in _ramp with a release time
     //EventQueueT _eventq;
     //SectionQueueT _sectionq;
 };
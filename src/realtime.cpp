@@ -0,0 +1,161 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "realtime.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#if defined( Q_OS_LINUX ) && defined( __GLIBC__ ) && !defined( QT_NO_DEBUG )
+#define COUNT_ALLOCATIONS
+#endif
+
+#define PAGE_SIZE_GUESS 4096
+
+#ifdef Q_OS_LINUX
+static QString
+limitString( int resource ) {
+    struct rlimit rl;
+    if( getrlimit( resource, &rl ) != 0 ) return "unknown";
+    if( rl.rlim_cur == RLIM_INFINITY ) return "unlimited";
+    return QString::number( (quint64)rl.rlim_cur );
+}
+
+/** Touch @bytes of stack below the caller, so the pages are mapped (and locked) already */
+static void
+prefaultStack( int bytes ) {
+    volatile char stack[REALTIME_PREFAULT];
+    for( int i =0; i < qMin( bytes, (int)sizeof( stack ) ); i += PAGE_SIZE_GUESS )
+        stack[i] =0;
+}
+
+/** Grow the heap of this thread by @bytes and keep it, so later allocations do not fault */
+static void
+prefaultHeap( int bytes ) {
+    // Freed memory stays in the heap instead of being returned to the system
+    mallopt( M_TRIM_THRESHOLD, -1 );
+    mallopt( M_MMAP_MAX, 0 );
+    char* p =static_cast<char*>( malloc( bytes ) );
+    if( !p ) return;
+    for( int i =0; i < bytes; i += PAGE_SIZE_GUESS )
+        p[i] =0;
+    free( p );
+}
+#endif
+
+bool
+enterRealtime( const RealtimeOptions& options, QString* error ) {
+    QStringList errors;
+#ifdef Q_OS_LINUX
+    const int policy =options.policy == RealtimeOptions::RoundRobin ? SCHED_RR : SCHED_FIFO;
+    const int lo =sched_get_priority_min( policy ), hi =sched_get_priority_max( policy );
+    struct sched_param param;
+    std::memset( &param, 0, sizeof( param ) );
+    param.sched_priority =qBound( lo, options.priority, hi );
+    if( param.sched_priority != options.priority )
+        errors << QString( "Priority %1 is out of range, using %2" ).arg( options.priority ).arg( param.sched_priority );
+
+    int ret =pthread_setschedparam( pthread_self(), policy, &param );
+    if( ret == EPERM )
+        errors << QString( "Not allowed to use %1 with priority %2 (RLIMIT_RTPRIO is %3). "
+                           "Grant 'rtprio' in /etc/security/limits.conf or CAP_SYS_NICE." )
+                  .arg( policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO" )
+                  .arg( param.sched_priority ).arg( limitString( RLIMIT_RTPRIO ) );
+    else if( ret != 0 )
+        errors << QString( "Could not set the scheduling policy: %1" ).arg( strerror( ret ) );
+
+    if( options.cpu >= 0 ) {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( options.cpu, &set );
+        ret =pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+        if( ret != 0 )
+            errors << QString( "Could not pin the play thread to CPU %1: %2" ).arg( options.cpu ).arg( strerror( ret ) );
+    }
+
+    if( options.lockMemory && mlockall( MCL_CURRENT | MCL_FUTURE ) != 0 ) {
+        const int err =errno;
+        errors << QString( "Could not lock memory: %1 (RLIMIT_MEMLOCK is %2). "
+                           "Grant 'memlock' in /etc/security/limits.conf or CAP_IPC_LOCK." )
+                  .arg( strerror( err ) ).arg( limitString( RLIMIT_MEMLOCK ) );
+    }
+
+    if( options.prefault > 0 ) {
+        prefaultStack( options.prefault );
+        prefaultHeap( options.prefault );
+    }
+#else
+    Q_UNUSED( options );
+    errors << "Real-time scheduling is only supported on Linux";
+#endif
+    if( error ) *error =errors.join( "\n" );
+    return errors.isEmpty();
+}
+
+#ifdef COUNT_ALLOCATIONS
+// Thread-locals of the executable itself live in static TLS and never allocate
+static thread_local bool t_armed =false;
+static thread_local quint64 t_count =0;
+
+// All allocations end up here, including those of operator new and of the Qt containers
+extern "C" {
+void* __libc_malloc( size_t );
+void* __libc_calloc( size_t, size_t );
+void* __libc_realloc( void*, size_t );
+void* __libc_memalign( size_t, size_t );
+
+void* malloc( size_t size ) __THROW {
+    if( t_armed ) t_count++;
+    return __libc_malloc( size );
+}
+
+void* calloc( size_t n, size_t size ) __THROW {
+    if( t_armed ) t_count++;
+    return __libc_calloc( n, size );
+}
+
+void* realloc( void* p, size_t size ) __THROW {
+    if( t_armed ) t_count++;
+    return __libc_realloc( p, size );
+}
+
+void* memalign( size_t alignment, size_t size ) __THROW {
+    if( t_armed ) t_count++;
+    return __libc_memalign( alignment, size );
+}
+
+void* aligned_alloc( size_t alignment, size_t size ) __THROW {
+    if( t_armed ) t_count++;
+    return __libc_memalign( alignment, size );
+}
+
+int posix_memalign( void** p, size_t alignment, size_t size ) __THROW {
+    if( alignment % sizeof( void* ) != 0 || (alignment & (alignment - 1)) != 0 ) return EINVAL;
+    if( t_armed ) t_count++;
+    *p =__libc_memalign( alignment, size );
+    return *p ? 0 : ENOMEM;
+}
+}
+
+bool AllocationCounter::available() { return true; }
+void AllocationCounter::arm() { t_count =0; t_armed =true; }
+void AllocationCounter::disarm() { t_armed =false; }
+quint64 AllocationCounter::count() { return t_count; }
+#else
+bool AllocationCounter::available() { return false; }
+void AllocationCounter::arm() { }
+void AllocationCounter::disarm() { }
+quint64 AllocationCounter::count() { return 0; }
+#endif
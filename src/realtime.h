@@ -0,0 +1,51 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QtGlobal>
+#include <QString>
+#include <QStringList>
+
+// Default amount of stack and heap that is touched before playing, so it does not fault later
+#define REALTIME_PREFAULT (512 * 1024)
+
+/** How the play thread should be scheduled in real-time mode */
+struct RealtimeOptions {
+    enum Policy {
+        Fifo,                   // SCHED_FIFO: run until blocked
+        RoundRobin              // SCHED_RR: time-sliced between threads of equal priority
+    };
+
+    RealtimeOptions() : enabled( false ), policy( Fifo ), priority( 70 ), cpu( -1 ),
+                        lockMemory( true ), prefault( REALTIME_PREFAULT ) {}
+
+    bool enabled;
+    Policy policy;
+    int priority;               // 1 (lowest) to 99
+    int cpu;                    // CPU to pin the thread to, -1 for any
+    bool lockMemory;            // Keep all memory of the process resident
+    int prefault;               // Bytes of stack and heap to touch in advance
+};
+
+/** Switch the calling thread to real-time scheduling as described by @options.
+ *  Every step that fails is described in @error, and the thread continues with whatever
+ *  did succeed. Returns true if all steps succeeded. */
+bool enterRealtime( const RealtimeOptions& options, QString* error =nullptr );
+
+/** Counts the heap allocations made by a thread while it is armed.
+ *
+ * Only available in debug builds on Linux with glibc, where malloc() and friends are
+ * interposed. Elsewhere count() stays 0 and available() returns false.
+ */
+class AllocationCounter {
+public:
+    static bool available();
+    static void arm();
+    static void disarm();
+    static quint64 count();
+};
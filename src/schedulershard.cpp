@@ -0,0 +1,229 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "schedulershard.h"
+#include "composition.h"
+#include <cstdint>
+
+SchedulerShard::SchedulerShard( int index, Waiter* output, MpmcQueue<PlayThread::Command>* executed, QObject* parent ) :
+    QThread( parent ),
+    _index( index ),
+    _comp( nullptr ),
+    _shards( nullptr ),
+    _owners( nullptr ),
+    _output( output ),
+    _executed( executed ),
+    _mailbox( SHARD_MAILBOX ),
+    _outbox( SHARD_OUTBOX ),
+    _ignored( 0 ),
+    _watermark( 0 ),
+    _held( 0 ) {
+    _pending.reserve( MAX_PENDING_COMMANDS );
+}
+
+SchedulerShard::~SchedulerShard() {
+    stop();
+    wait();
+}
+
+void
+SchedulerShard::setTracks( const Composition* comp, const EventQueue& source, const QVector<int>& indices,
+                           const QVector<SchedulerShard*>* shards, const QVector<int>* owners ) {
+    if( isRunning() ) return;
+    _comp =comp;
+    _queue.share( source, indices, comp );
+    _shards =shards;
+    _owners =owners;
+    _pending.clear();
+}
+
+void
+SchedulerShard::play( const PlayClock& clock, const RealtimeOptions& realtime ) {
+    if( isRunning() ) return;
+    _clock =clock;
+    _realtime =realtime;
+    _queue.resume( _clock.elapsed() );
+    // Nothing was looked at yet
+    _watermark.store( _clock.elapsed(), std::memory_order_release );
+    start( QThread::HighPriority );
+}
+
+bool
+SchedulerShard::post( const PlayThread::Command& c, bool report ) {
+    const Message m ={ c, report };
+    const bool held =!report && (c.type == PlayThread::Command::Start || c.type == PlayThread::Command::Reset);
+    if( held ) hold( c.executed );
+    const bool posted =_mailbox.push( m );
+    if( !posted && held ) _held.fetch_sub( 1 );
+    // Also when it was full, so the shard raises its watermark again
+    _waiter.wake();
+    return posted;
+}
+
+/** Keep the play thread from sending events due at or after @due until the start or reset
+ *  that was posted for then is carried out, as this shard may have published a later
+ *  watermark already. */
+void
+SchedulerShard::hold( qint64 due ) {
+    _held.fetch_add( 1 );
+    qint64 mark =_watermark.load();
+    while( due < mark && !_watermark.compare_exchange_weak( mark, due ) );
+}
+
+void
+SchedulerShard::run() {
+    if( _realtime.enabled ) {
+        // The play thread reports what could not be set up, and memory is locked for the
+        // whole process already. Pinning all shards to its CPU would defeat their purpose.
+        _realtime.cpu =-1;
+        _realtime.lockMemory =false;
+        enterRealtime( _realtime );
+    }
+
+    while( !isInterruptionRequested() ) {
+        // Another shard may hold the watermark for a start or reset it posts, see hold()
+        qint64 published =_watermark.load();
+        processMailbox();
+
+        bool found =false;
+        EventQueue::Event* e =nullptr;
+        const qint64 scanned =_clock.elapsed();
+        while( (e =_queue.takeFront( scanned )) ) {
+            const PlayThread::Due d ={ e, e->trackQueue, _queue.now() - _queue.lateness() };
+            push( d );
+            apply( e, d.due );
+            found =true;
+        }
+
+        const qint64 now =_clock.elapsed();
+        qint64 idle =_queue.minTimeUntilNextEvent( MAX_IDLE, now );
+        for( const auto& m : _pending )
+            idle =qMin( idle, qMax( (qint64)0, m.command.executed - now ) );
+        // With no track running and nothing pending, only the mailbox can bring work
+        const bool waiting =_queue.isIdle() && _pending.isEmpty();
+        const qint64 until =waiting ? -1 : _clock.toWall( (now + idle) * 1000000 );
+
+        // All that was due until the scan is passed on, and if nothing is due yet, all until
+        // the next event. The play thread holds back the events of the other shards until then.
+        const qint64 mark =waiting ? INT64_MAX : idle > 0 ? now + idle : scanned + 1;
+        // It is only moved as long as it was not held since it was read, and all that was held
+        // for was carried out
+        if( mark != published && _held.load() == 0 && _watermark.compare_exchange_strong( published, mark ) )
+            found =true;
+        if( found ) _output->wake();
+        _waiter.wait( _clock.timer(), until );
+    }
+    _pending.clear();
+}
+
+/** Pass @d to the play thread. When it is behind, wait for it rather than lose events. */
+void
+SchedulerShard::push( const PlayThread::Due& d ) {
+    while( !_outbox.push( d ) ) {
+        if( isInterruptionRequested() ) return;
+        _output->wake();
+        yieldCurrentThread();
+    }
+}
+
+/** Change the tracks as @e, which was due at @due, says. Tracks of other shards are left to
+ *  their shard, which starts or resets them at @due as well. */
+void
+SchedulerShard::apply( const EventQueue::Event* e, qint64 due ) {
+    if( e->type == EventQueue::TriggerEvent && e->event
+        && (e->event->type == Trigger::StartEvent || e->event->type == Trigger::ResetEvent) ) {
+        const Track* t =_comp->trackById( e->event->target );
+        if( !t ) return;
+        const int owner =(*_owners)[(int)(t - _comp->tracks().constData())];
+        if( owner != _index ) {
+            const PlayThread::Command c ={ e->event->type == Trigger::StartEvent ? PlayThread::Command::Start
+                                                                                 : PlayThread::Command::Reset,
+                                           t->id(), -1, false, 0, due };
+            (*_shards)[owner]->post( c, false );
+            return;
+        }
+    }
+    _queue.apply( e, _comp );
+}
+
+/** Carry out the messages that were posted, or keep them until their section starts */
+void
+SchedulerShard::processMailbox() {
+    Message m;
+    while( _mailbox.pop( &m ) ) {
+        PlayThread::Command& c =m.command;
+        if( c.type == PlayThread::Command::Tempo ) {
+            // The play thread changed its clock at c.executed, this one follows at the same time
+            _clock.setScale( c.value / 1000.0, c.executed * 1000000 );
+            continue;
+        }
+        if( c.type == PlayThread::Command::Nudge ) {
+            _clock.setNudge( 1.0 + c.value / 1e6, c.executed * 1000000 );
+            continue;
+        }
+        const Track* t =_comp->trackById( c.track );
+        const qint64 due =c.quantize && t ? _queue.nextSection( _queue.find( t ), _clock.elapsed() ) : -1;
+        if( due > _clock.elapsed() && _pending.count() < MAX_PENDING_COMMANDS ) {
+            c.executed =due;
+            _pending.append( m );
+        } else {
+            execute( m );
+            if( !m.report && (c.type == PlayThread::Command::Start || c.type == PlayThread::Command::Reset) )
+                _held.fetch_sub( 1 );
+        }
+    }
+
+    const qint64 now =_clock.elapsed();
+    for( int i =0; i < _pending.count(); ) {
+        if( _pending[i].command.executed <= now ) {
+            m =_pending[i];
+            _pending.remove( i );
+            execute( m );
+        } else
+            i++;
+    }
+}
+
+void
+SchedulerShard::execute( Message& m ) {
+    PlayThread::Command& c =m.command;
+    EventQueue::TrackQueue* tq =_queue.find( _comp->trackById( c.track ) );
+    // Tracks on the precompiled schedule cannot be started or stopped on their own
+    if( !tq || tq->scheduled ) {
+        if( m.report ) _ignored++;
+        return;
+    }
+
+    const qint64 now =_clock.elapsed();
+    // The starts and resets of triggers of other shards take effect when the trigger was due,
+    // as they would without shards, rather than when this shard got to them
+    const qint64 at =m.report ? now : c.executed;
+    switch( c.type ) {
+    case PlayThread::Command::Start:
+        _queue.startTrack( tq, at );
+        break;
+    case PlayThread::Command::Stop:
+        _queue.stopTrack( tq, now );
+        break;
+    case PlayThread::Command::Reset:
+        _queue.resetTrack( tq, at );
+        break;
+    default:
+        return;
+    }
+    if( !m.report ) return;
+
+    // The notes of a track that was stopped or reset by a trigger are ended by the play thread
+    // when it sends the trigger, those of commands when it takes this from the outbox
+    if( c.type != PlayThread::Command::Start ) {
+        const PlayThread::Due d ={ nullptr, tq, now };
+        push( d );
+        _output->wake();
+    }
+    c.executed =now;
+    _executed->push( c );
+}
@@ -0,0 +1,93 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QThread>
+#include <QVector>
+#include "eventqueue.h"
+#include "playthread.h"
+#include "playclock.h"
+#include "mpmcqueue.h"
+#include "waiter.h"
+#include <atomic>
+
+#define SHARD_OUTBOX 4096       // Due events a shard can be ahead of the play thread
+#define SHARD_MAILBOX 256       // Messages that can wait for a shard
+
+/** Finds the due events of a part of the tracks, on a thread of its own.
+ *
+ * With many tracks, looking for the next due event takes most of the time of the play
+ * thread. Its tracks can then be divided over several shards, which each play theirs through
+ * their own EventQueue and carry out what changes their tracks. The events they find due are
+ * passed to the play thread, which merges them in the order they were due and sends them,
+ * so the voices and the MIDI output stay with a single thread.
+ *
+ * Triggers and commands that start, stop or reset a track of another shard are posted to the
+ * mailbox of that shard. Both the mailbox and the outbox are lock-free.
+ */
+class SchedulerShard : public QThread {
+    Q_OBJECT
+public:
+    SchedulerShard( int index, Waiter* output, MpmcQueue<PlayThread::Command>* executed, QObject* parent =0 );
+    ~SchedulerShard();
+
+    /** Play the tracks at @indices of @source, which belongs to @comp. @owners has the index
+     *  of the shard that plays each track, @shards all shards. Only while not playing. */
+    void setTracks( const Composition* comp, const EventQueue& source, const QVector<int>& indices,
+                    const QVector<SchedulerShard*>* shards, const QVector<int>* owners );
+    int trackCount() const { return _queue.tracks().count(); }
+
+    /** Start playing at the time of @clock, with the tracks as they are in the source queue */
+    void play( const PlayClock& clock, const RealtimeOptions& realtime );
+    void stop() { requestInterruption(); _waiter.wake(); }
+
+    /** Post @c to the shard. Commands from outside are reported back once they are carried
+     *  out, the starts and resets of triggers of other shards are not; their executed is the
+     *  time the trigger was due, and the watermark is held there until they are carried out.
+     *  Can be called from any thread. */
+    bool post( const PlayThread::Command& c, bool report );
+
+    // Only for the play thread
+    bool take( PlayThread::Due* d ) { return _outbox.pop( d ); }
+    // Everything that is due before this time (msec on the play clock) is in the outbox. Read
+    // it before taking from the outbox.
+    qint64 watermark() const { return _watermark.load( std::memory_order_acquire ); }
+    // Commands from outside for tracks on the schedule, only valid while not playing
+    quint64 ignoredCount() const { return _ignored; }
+
+    void run() override;
+
+private:
+    struct Message {
+        PlayThread::Command command;
+        bool report;
+    };
+
+    void hold( qint64 due );
+    void processMailbox();
+    void execute( Message& );
+    void apply( const EventQueue::Event*, qint64 due );
+    void push( const PlayThread::Due& );
+
+    int _index;
+    const Composition* _comp;
+    EventQueue _queue;
+    PlayClock _clock;
+    RealtimeOptions _realtime;
+    const QVector<SchedulerShard*>* _shards;
+    const QVector<int>* _owners;        // Index of the shard of every track
+    Waiter _waiter;
+    Waiter* _output;                    // Of the play thread
+    MpmcQueue<PlayThread::Command>* _executed;
+    MpmcQueue<Message> _mailbox;
+    MpmcQueue<PlayThread::Due> _outbox;
+    QVector<Message> _pending;          // Quantised commands, executed is the time they are due
+    quint64 _ignored;
+    std::atomic<qint64> _watermark;
+    std::atomic<int> _held;             // Posted starts and resets of other shards not carried out
+};
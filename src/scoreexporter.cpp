@@ -0,0 +1,138 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "scoreexporter.h"
+#include "composition.h"
+#include <QDir>
+#include <QIODevice>
+#include <QPainter>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <QtMath>
+
+// Number of frames per worker thread that are simulated before they are rendered together
+#define FRAMES_PER_THREAD 4
+
+ScoreExporter::ScoreExporter( const Composition* comp ) :
+    _comp( comp ),
+    _size( 1080, 1080 ),
+    _fps( 30.0 ),
+    _duration( 10.0 ),
+    _next( 0 ) {
+
+    _queue.initialize( comp );
+    _renderer.setComposition( comp );
+    setDarkPalette( false );
+}
+
+ScoreExporter::~ScoreExporter() { }
+
+void
+ScoreExporter::setDarkPalette( bool dark ) {
+    QPalette pal;
+    pal.setColor( QPalette::Window, dark ? Qt::black : Qt::white );
+    pal.setColor( QPalette::WindowText, dark ? Qt::white : Qt::black );
+    pal.setColor( QPalette::Disabled, QPalette::WindowText, Qt::gray );
+    _renderer.setPalette( pal );
+}
+
+int
+ScoreExporter::frameCount() const {
+    return qMax( 0, qCeil( _duration * _fps ) );
+}
+
+/** Write every frame as a numbered PNG file (frame00000.png, ...) to @directory */
+bool
+ScoreExporter::exportImages( const QString& directory, QString* error ) {
+    QDir dir( directory );
+    if( !dir.mkpath( "." ) ) {
+        if( error ) *error =QString( "Could not create directory '%1'" ).arg( directory );
+        return false;
+    }
+
+    rewind();
+    FrameVectorT frames;
+    while( nextBatch( frames ) ) {
+        // Encoding is the most expensive part, so it is done by the workers as well
+        QtConcurrent::blockingMap( frames, [&]( Frame& f ) {
+            f.image =renderFrame( f.state );
+            f.ok =f.image.save( dir.filePath( QString( "frame%1.png" ).arg( f.index, 5, 10, QChar( '0' ) ) ), "PNG" );
+            f.image =QImage();
+        } );
+
+        for( const auto& f : frames ) {
+            if( !f.ok ) {
+                if( error ) *error =QString( "Could not write frame %1 to '%2'" ).arg( f.index ).arg( directory );
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/** Write every frame to @out as raw 8-bit RGBX pixels, e.g. for
+ *  ffmpeg -f rawvideo -pix_fmt rgb0 -s <width>x<height> -r <fps> -i - */
+bool
+ScoreExporter::exportRaw( QIODevice* out, QString* error ) {
+    rewind();
+    FrameVectorT frames;
+    while( nextBatch( frames ) ) {
+        QtConcurrent::blockingMap( frames, [&]( Frame& f ) {
+            f.image =renderFrame( f.state ).convertToFormat( QImage::Format_RGBX8888 );
+        } );
+
+        // Frames have to be written in order
+        for( auto& f : frames ) {
+            const qint64 bytes =(qint64)f.image.bytesPerLine() * f.image.height();
+            if( out->write( reinterpret_cast<const char*>( f.image.constBits() ), bytes ) != bytes ) {
+                if( error ) *error =QString( "Could not write frame %1: %2" ).arg( f.index ).arg( out->errorString() );
+                return false;
+            }
+            f.image =QImage();
+        }
+    }
+    return true;
+}
+
+/** Reset the virtual clock to the start of the composition and prepare the renderer */
+void
+ScoreExporter::rewind() {
+    // The level of detail has to be set before the renderer is shared by the workers
+    _renderer.setDetail( _renderer.deviceTransform( _size ).m11() );
+    _queue.restart( 0, 0 );
+    _next =0;
+}
+
+/** Advance the virtual clock through the next batch of frames and take a snapshot of each.
+ *  Returns false when all frames have been produced. */
+bool
+ScoreExporter::nextBatch( FrameVectorT& frames ) {
+    const int batch =qMax( 1, QThreadPool::globalInstance()->maxThreadCount() ) * FRAMES_PER_THREAD;
+    const int count =qMin( batch, frameCount() - _next );
+    frames.resize( qMax( 0, count ) );
+
+    for( int i =0; i < count; i++, _next++ ) {
+        const double now =_next * 1000.0 / _fps;
+        _queue.advance( (qint64)now, true );
+        EventQueue::Event* e =nullptr;
+        while( (e = _queue.takeFront()) )
+            _queue.apply( e, _comp );
+
+        frames[i].index =_next;
+        frames[i].state =ScoreRenderer::snapshot( _queue, now );
+        frames[i].ok =false;
+    }
+    return count > 0;
+}
+
+QImage
+ScoreExporter::renderFrame( const ScoreRenderer::StateT& state ) const {
+    QImage image( _size, QImage::Format_RGB32 );
+    QPainter painter( &image );
+    _renderer.render( painter, _size, state );
+    return image;
+}
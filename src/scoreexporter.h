@@ -0,0 +1,66 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include "eventqueue.h"
+#include "scorerenderer.h"
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+class Composition;
+class QIODevice;
+
+/** Renders the visualisation of a Composition to a sequence of images without a display.
+ *
+ * Playback is followed on a virtual clock that advances by exactly one frame at a time,
+ * so the output does not depend on how fast frames can be rendered. The state of the
+ * queue is simulated sequentially (which is cheap), after which the frames are drawn and
+ * encoded in parallel on the global thread pool.
+ */
+class ScoreExporter {
+public:
+    ScoreExporter( const Composition* );
+    ~ScoreExporter();
+
+    void setSize( const QSize& s ) { _size =s; }
+    QSize size() const { return _size; }
+
+    void setFrameRate( double fps ) { _fps =fps; }
+    double frameRate() const { return _fps; }
+
+    void setDuration( double seconds ) { _duration =seconds; }
+    double duration() const { return _duration; }
+
+    void setDarkPalette( bool dark );
+
+    int frameCount() const;
+
+    bool exportImages( const QString& directory, QString* error =nullptr );
+    bool exportRaw( QIODevice* out, QString* error =nullptr );
+
+private:
+    struct Frame {
+        int index;
+        ScoreRenderer::StateT state;
+        QImage image;
+        bool ok;
+    };
+    typedef QVector<Frame> FrameVectorT;
+
+    void rewind();
+    bool nextBatch( FrameVectorT& );
+    QImage renderFrame( const ScoreRenderer::StateT& ) const;
+
+    const Composition* _comp;
+    EventQueue _queue;
+    ScoreRenderer _renderer;
+    QSize _size;
+    double _fps, _duration;
+    int _next;
+};
@@ -0,0 +1,558 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "scorerenderer.h"
+#include "composition.h"
+#include "eventqueue.h"
+#include <QPainter>
+#include <QPen>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+
+// Dimensions of the score, in window units
+static const float stroke =.02f;
+static const float markerSize =.4f;
+static const float radiusStep = 1.f;
+static const float margin = 1.f;
+
+// Level of detail, in device pixels
+static const qreal minSectionLength =2.0;   // Shorter sections are merged with their neighbours
+static const qreal minMarkerSize =3.0;      // Smaller markers are left out
+
+static inline QPointF
+polar( double degrees, double radius ) {
+    return QPointF( qCos( qDegreesToRadians(degrees) ) * radius,
+                    qSin( qDegreesToRadians(degrees) ) * radius );
+}
+
+static QColor
+rgbLERP( QColor c1, QColor c2, float w ) {
+    QColor d;
+    // For some reason setRgbF gives me weird errors here...
+    d.setRgb (
+        (c1.redF()   * (1.f-w) + c2.redF()   * w) * 255,
+        (c1.greenF() * (1.f-w) + c2.greenF() * w) * 255,
+        (c1.blueF()  * (1.f-w) + c2.blueF()  * w) * 255
+    );
+    return d;
+}
+
+ScoreRenderer::ScoreRenderer() : _comp( nullptr ), _detail( 0.0 ) {
+    setComposition( nullptr );
+}
+
+ScoreRenderer::~ScoreRenderer() { }
+
+void
+ScoreRenderer::setComposition( const Composition* comp ) {
+    _comp =comp;
+    _rings.clear();
+
+    if( _comp != nullptr ) {
+        float radius = 1.f;
+        for( const auto& track : _comp->tracks() ) {
+            Ring ring;
+            ring.track =&track;
+            ring.radius =radius;
+            ring.sorted =std::is_sorted( track.sections().begin(), track.sections().end(),
+                []( const Track::Section& a, const Track::Section& b ) { return a.offset < b.offset; } );
+            // Look up the triggers once, rather than every frame
+            for( const auto& section : track.sections() ) {
+                const Trigger* trig = _comp->triggerById( section.trigger );
+                ring.stopMarkers.append( trig && trig->hasStopEvent() );
+            }
+            buildGeometry( ring );
+            buildIndex( ring );
+            buildPath( ring );
+            _rings.append( ring );
+            radius += radiusStep;
+        }
+    }
+
+    const int count =qMax( 1, _rings.count() );
+    const float windowRadius = 2.f + radiusStep * (count-1) + margin;
+    _window =QRect( -qCeil(windowRadius), -qCeil(windowRadius), qCeil(2 * windowRadius), qCeil(2 * windowRadius) );
+}
+
+/** Return the transformation from window coordinates to the coordinates of a device of @size.
+ *  At @zoom 1 the whole window fits the device, @center is the point of the window that is
+ *  shown in the middle of the device. */
+QTransform
+ScoreRenderer::deviceTransform( const QSize& size, qreal zoom, const QPointF& center ) const {
+    const qreal scale =zoom * qMin( size.width(), size.height() ) / (qreal)_window.width();
+    return QTransform( scale, 0, 0, scale,
+                       size.width() / 2.0 - center.x() * scale,
+                       size.height() / 2.0 - center.y() * scale );
+}
+
+void
+ScoreRenderer::setupPainter( QPainter& painter, const QTransform& transform ) const {
+    painter.setTransform( transform );
+    painter.setRenderHint( QPainter::Antialiasing, true );
+}
+
+/** Rebuild the paths of all rings for drawing at @pixelsPerUnit device pixels per window unit.
+ *  The scale is rounded down to a power of two, so zooming only rebuilds them now and then. */
+void
+ScoreRenderer::setDetail( qreal pixelsPerUnit ) {
+    const qreal detail =pixelsPerUnit > 0.0 ? qPow( 2.0, qFloor( std::log2( pixelsPerUnit ) ) ) : 0.0;
+    if( detail == _detail ) return;
+    _detail =detail;
+    for( auto& ring : _rings )
+        buildPath( ring );
+}
+
+/** Set @first and @last to the range of rings that cross @visible (in window coordinates).
+ *  The range is empty (@first > @last) if none do. */
+void
+ScoreRenderer::visibleRings( const QRectF& visible, int* first, int* last ) const {
+    // Closest and farthest point of the rectangle from the center
+    const qreal cx =qBound( visible.left(), 0.0, visible.right() );
+    const qreal cy =qBound( visible.top(), 0.0, visible.bottom() );
+    const qreal fx =qMax( qAbs( visible.left() ), qAbs( visible.right() ) );
+    const qreal fy =qMax( qAbs( visible.top() ), qAbs( visible.bottom() ) );
+    const qreal near =qSqrt( cx*cx + cy*cy ) - markerSize;
+    const qreal far =qSqrt( fx*fx + fy*fy ) + markerSize;
+
+    // Ring i has radius 1 + i * radiusStep
+    *first =qMax( 0, qCeil( (near - 1.f) / radiusStep ) );
+    *last =qMin( _rings.count() - 1, qFloor( (far - 1.f) / radiusStep ) );
+}
+
+/** Take a snapshot of the positions of all trains in @queue.
+ *  If @now is given (in msec, fractional), positions are interpolated to that time rather than
+ *  taken from the last time the queue was advanced to. */
+ScoreRenderer::StateT
+ScoreRenderer::snapshot( const EventQueue& queue, double now ) {
+    StateT state( queue.tracks().count() );
+    QVector<double> positions;
+    if( now >= 0.0 ) queue.trackPositions( now, &positions );
+    for( int i =0; i < state.count(); i++ ) {
+        const EventQueue::TrackQueue* tq =queue.tracks()[i];
+        const double offset =now < 0.0 ? queue.normalizedOffset( i ) : positions[i];
+        state[i].running =tq->running;
+        state[i].pos =offset * tq->track->length();
+    }
+    return state;
+}
+
+/** Render a complete frame of @size, including the background */
+void
+ScoreRenderer::render( QPainter& painter, const QSize& size, const StateT& state ) const {
+    painter.fillRect( QRect( QPoint(), size ), _palette.color( QPalette::Window ) );
+    if( _rings.isEmpty() || state.count() != _rings.count() ) return;
+
+    const QTransform transform =deviceTransform( size );
+    const QRectF visible =transform.inverted().mapRect( QRectF( QPointF(), size ) );
+    int first, last;
+    visibleRings( visible, &first, &last );
+    QVector<int> rings;
+    for( int i =first; i <= last; i++ ) rings.append( i );
+
+    painter.save();
+    setupPainter( painter, transform );
+    drawStatic( painter, state, visible );
+    drawMoving( painter, state, rings );
+    painter.restore();
+}
+
+/** Draw everything that does not move during playback: the sections and their markers.
+ *  Only the rings that cross @visible (in window coordinates) are drawn. */
+void
+ScoreRenderer::drawStatic( QPainter& painter, const StateT& state, const QRectF& visible ) const {
+    int first, last;
+    visibleRings( visible, &first, &last );
+    last =qMin( last, state.count() - 1 );
+
+    // All rings that share a pen are drawn with a single path
+    QPainterPath running, stopped;
+    for( int i =first; i <= last; i++ )
+        (state[i].running ? running : stopped).addPath( _rings[i].path );
+
+    QPen pen;
+    pen.setWidthF( stroke );
+    pen.setColor( _palette.color( QPalette::WindowText ) );
+    painter.setPen( pen );
+    painter.drawPath( running );
+    pen.setColor( _palette.color( QPalette::Disabled, QPalette::WindowText ) );
+    painter.setPen( pen );
+    painter.drawPath( stopped );
+}
+
+/** Draw the trains and the highlighted sections of @rings */
+void
+ScoreRenderer::drawMoving( QPainter& painter, const StateT& state, const QVector<int>& rings ) const {
+    QPen pen;
+    pen.setWidthF( stroke );
+
+    // Axles that are too small to draw as a marker are drawn as a single point
+    const bool markers =showMarkers();
+    QPainterPath trains;
+    QPolygonF axles;
+    for( int r : rings ) {
+        if( r >= state.count() ) continue;
+        const Ring& ring =_rings[r];
+        const RingState& rs =state[r];
+
+        // Highlight the section the playhead is in
+        int i =currentSection( r, rs );
+        if( rs.running && i != -1 ) {
+            const Track& track =*ring.track;
+            const int sects =track.sections().count();
+            const double angle1 =track.sections()[i].offset;
+            const double angle2 =(i == sects-1 ? track.length() : 0.0) + track.sections()[(i+1) % sects].offset;
+            float w = (rs.pos-angle1) / (angle2-angle1 ); // Normalized distance
+            pen.setColor( rgbLERP( Qt::red, _palette.color( QPalette::WindowText ), w ) );
+            painter.setPen( pen );
+            QPainterPath section;
+            addSection( section, ring, i, markers );
+            painter.drawPath( section );
+        }
+
+        // Each axle is a separate triangle in the batch
+        const QPolygonF train =trainPolygon( ring, rs.pos );
+        for( int a =0; a+2 < train.count(); a += 3 ) {
+            if( !markers ) {
+                axles << train[a+2];
+                continue;
+            }
+            trains.moveTo( train[a] );
+            trains.lineTo( train[a+1] );
+            trains.lineTo( train[a+2] );
+            trains.closeSubpath();
+        }
+    }
+
+    // All trains share the same pen
+    pen.setColor( _palette.color( QPalette::WindowText ) );
+    painter.setPen( pen );
+    if( markers )
+        painter.drawPath( trains );
+    else {
+        // Points are drawn with the width of the pen, so make it about a pixel wide
+        pen.setWidthF( _detail > 0.0 ? qMax( (qreal)stroke, 1.5 / _detail ) : stroke );
+        painter.setPen( pen );
+        painter.drawPoints( axles );
+    }
+}
+
+/** Return the index of the section the playhead of @ring is in, or -1 if it is before the first */
+int
+ScoreRenderer::currentSection( int r, const RingState& rs ) const {
+    const Ring& ring =_rings[r];
+    const Track::SectionVectorT& sections =ring.track->sections();
+    if( sections.isEmpty() ) return -1;
+
+    if( ring.sorted ) {
+        auto it =std::upper_bound( sections.begin(), sections.end(), rs.pos,
+            []( double pos, const Track::Section& s ) { return pos < s.offset; } );
+        return (int)(it - sections.begin()) - 1;
+    }
+
+    const int sects =sections.count();
+    for( int i =0; i < sects; i++ ) {
+        const double angle1 =sections[i].offset;
+        const double angle2 =(i == sects-1 ? ring.track->length() : 0.0) + sections[(i+1) % sects].offset;
+        if( rs.pos >= angle1 && rs.pos < angle2 ) return i;
+    }
+    return -1;
+}
+
+/** Precompute the geometry of @ring that does not depend on the position of the train */
+void
+ScoreRenderer::buildGeometry( Ring& ring ) const {
+    const Track& track =*ring.track;
+    const float radius =ring.radius;
+    const float degPerUnit = 360.0 / (2.0 * radius * M_PI);
+    const double c =360.0 / (double)track.length();
+
+    // The axle markers for the train at position 0, to be rotated into place every frame
+    ring.train.clear();
+    double o =0.0;
+    for( int i =0; i < track.axleCount(); i++ ) {
+        o -= i==0 ? 0.0 : track.axleOffsets()[i-1];
+        const double angle =c * o;
+        ring.train << polar( angle, radius-markerSize/2.f )
+                   << polar( angle, radius+markerSize/2.f )
+                   << polar( angle+degPerUnit*markerSize, radius );
+    }
+}
+
+/** Build the sorted indices of sections and axles of @ring, used to look them up by angle */
+void
+ScoreRenderer::buildIndex( Ring& ring ) const {
+    const Track& track =*ring.track;
+
+    ring.sections.resize( track.sections().count() );
+    for( int i =0; i < ring.sections.count(); i++ )
+        ring.sections[i] =Key { track.sections()[i].offset, i };
+    std::stable_sort( ring.sections.begin(), ring.sections.end() );
+
+    ring.rank.resize( ring.sections.count() );
+    for( int k =0; k < ring.sections.count(); k++ )
+        ring.rank[ring.sections[k].index] =k;
+
+    ring.axles.resize( track.axleCount() );
+    double o =0.0;
+    for( int i =0; i < ring.axles.count(); i++ ) {
+        o += i==0 ? 0.0 : track.axleOffsets()[i-1];
+        ring.axles[i] =Key { o, i };
+    }
+    std::stable_sort( ring.axles.begin(), ring.axles.end() );
+}
+
+/** Build the path with all sections and markers of @ring at the current level of detail */
+void
+ScoreRenderer::buildPath( Ring& ring ) const {
+    const Track& track =*ring.track;
+    const int sects =track.sections().count();
+    const int length =track.length();
+    const double c =360.0 / (double)length; // Factor to convert track length to degrees
+    const bool markers =showMarkers();
+
+    // Sections shorter than this (in track units) cannot be told apart at this scale
+    const double minLength =_detail > 0.0 
+        ? minSectionLength / _detail / (2.0 * M_PI * ring.radius) * length
+        : 0.0;
+    auto sectionLength =[&]( int i ) {
+        return (i == sects-1 ? length : 0.0) + track.sections()[(i+1) % sects].offset - track.sections()[i].offset;
+    };
+
+    ring.path =QPainterPath();
+    for( int i =0; i < sects; ) {
+        if( sectionLength( i ) >= minLength ) {
+            addSection( ring.path, ring, i, markers );
+            i++;
+            continue;
+        }
+        // Merge this and all following short sections into a single arc without markers
+        const double start =track.sections()[i].offset;
+        double end =start;
+        for( ; i < sects && sectionLength( i ) < minLength; i++ )
+            end +=sectionLength( i );
+        addArc( ring.path, ring, c*start - 90.0, c*end - 90.0, 0.0 );
+    }
+}
+
+/** Add the arc and (if @marker is set) the marker of section @i of the track of @ring to @path */
+void
+ScoreRenderer::addSection( QPainterPath& path, const Ring& ring, int i, bool marker ) const {
+    const Track& track =*ring.track;
+    const float radius =ring.radius;
+    // Calculate the number of degrees of the circle that correspond to one window-space unit
+    const float degPerUnit = 360.0 / (2.0 * radius * M_PI);
+    const int length =track.length();
+    const double c =360.0 / (double)length; // Factor to convert track length to degrees
+
+    const int sects  =track.sections().count();
+    const float gap = degPerUnit * (markerSize/4.0); // degrees
+    const Track::Section& section1 =track.sections()[i];
+    const Track::Section& section2 =
+        i == sects-1
+            ? track.sections()[0]
+            : track.sections()[i+1];
+    const float angle1 =section1.offset;
+    const float angle2 =(i == sects-1 ? length : 0.0) + section2.offset;
+
+    // The arc first
+    float start =c*angle1 - 90.0f; // -90 to start in the 12' oclock position
+    addArc( path, ring, start, c*angle2 - 90.0f, gap );
+    if( !marker ) return;
+
+    // Now the marker.
+    // For a stop-event we use a square
+    if( ring.stopMarkers[i] ) {
+        double o =degPerUnit * markerSize;
+        QPolygonF square;
+        square << polar( start, radius-markerSize/2.f )
+               << polar( start, radius+markerSize/2.f )
+               << polar( start+o, radius+markerSize/2.f )
+               << polar( start+o, radius-markerSize/2.f )
+               << polar( start, radius-markerSize/2.f );
+        path.addPolygon( square );
+
+    } else {
+        // For a Midi-event we use a perpendicular line marking the section
+        path.moveTo( polar( start, radius-markerSize/2.f ) );
+        path.lineTo( polar( start, radius+markerSize/2.f ) );
+    }
+}
+
+/** Add the arc of @ring from angle @start to @end minus @gap (all in degrees) to @path */
+void
+ScoreRenderer::addArc( QPainterPath& path, const Ring& ring, double start, double end, double gap ) const {
+    const float radius =ring.radius;
+    QRectF circle( -radius, -radius, radius*2, radius*2 );
+    const double span =end - start - gap;
+    path.arcMoveTo( circle, -start );
+    path.arcTo( circle, -start, -span );
+}
+
+/** Return true if markers come out large enough to be drawn at the current level of detail */
+bool
+ScoreRenderer::showMarkers() const {
+    return _detail <= 0.0 || markerSize * _detail >= minMarkerSize;
+}
+
+/** Return the axle markers of the 'train' of @ring at @pos, three vertices per axle */
+QPolygonF
+ScoreRenderer::trainPolygon( const Ring& ring, double pos ) const {
+    const double c =360.0 / (double)ring.track->length();
+    return QTransform().rotate( c * pos - 90.0 ).map( ring.train );
+}
+
+/** Return the area in window coordinates covered by the moving parts of ring @r:
+ *  the train and the highlighted section */
+QRectF
+ScoreRenderer::movingBounds( int r, const RingState& rs ) const {
+    const Ring& ring =_rings[r];
+    const Track& track =*ring.track;
+    const float radius =ring.radius;
+    const double c =360.0 / (double)track.length();
+    QRectF bounds =trainPolygon( ring, rs.pos ).boundingRect();
+
+    int i =currentSection( r, rs );
+    if( rs.running && i != -1 ) {
+        // Approximate the arc by a number of points on it, plus the maximal bulge in between
+        const int sects =track.sections().count();
+        const double start =c * track.sections()[i].offset - 90.0;
+        const double end =c * ((i == sects-1 ? track.length() : 0.0) + track.sections()[(i+1) % sects].offset) - 90.0;
+        const int steps =8;
+        const double bulge =radius * (1.0 - qCos( qDegreesToRadians( (end-start) / steps / 2.0 ) ));
+        QPolygonF arc;
+        for( int k =0; k <= steps; k++ )
+            arc << polar( start + (end-start) * k / steps, radius );
+        bounds |= arc.boundingRect().adjusted( -bulge, -bulge, bulge, bulge );
+        // Include the section marker
+        bounds |= QRectF( polar( start, radius ), QSizeF() ).adjusted( -markerSize, -markerSize, markerSize, markerSize );
+    }
+
+    const qreal m =markerSize / 2.f + stroke;
+    return bounds.adjusted( -m, -m, m, m );
+}
+
+/** Return the index of the ring under @p (in window coordinates), or -1 if there is none.
+ *  Rings are evenly spaced, so this does not depend on the number of rings. */
+int
+ScoreRenderer::ringAt( const QPointF& p, qreal tolerance ) const {
+    const qreal r =qSqrt( p.x()*p.x() + p.y()*p.y() );
+    const int i =qRound( (r - 1.f) / radiusStep );
+    if( i < 0 || i >= _rings.count() ) return -1;
+    if( qAbs( r - _rings[i].radius ) > markerSize/2.f + tolerance ) return -1;
+    return i;
+}
+
+/** Return the axle or section under @p (in window coordinates), given the positions of
+ *  the trains in @state. @tolerance is the distance in window units a hit may be off. */
+ScoreRenderer::Hit
+ScoreRenderer::hitTest( const QPointF& p, const StateT& state, qreal tolerance ) const {
+    Hit hit { Hit::None, -1, -1 };
+    const int r =ringAt( p, tolerance );
+    if( r == -1 ) return hit;
+
+    const Ring& ring =_rings[r];
+    const int length =ring.track->length();
+    const double unitsPerWindow =length / (2.0 * M_PI * ring.radius);
+
+    // Convert the angle of @p to an offset on the track, 0 being the 12 o'clock position
+    double offset =std::fmod( qRadiansToDegrees( std::atan2( p.y(), p.x() ) ) + 90.0, 360.0 );
+    if( offset < 0.0 ) offset += 360.0;
+    offset *= length / 360.0;
+
+    // Trains are drawn on top, so they are tried first
+    if( r < state.count() ) {
+        const int axle =axleAt( ring, state[r].pos, offset, tolerance * unitsPerWindow );
+        if( axle != -1 ) return Hit { Hit::Axle, r, axle };
+    }
+
+    // Prefer a section whose marker is close, otherwise take the one @p lies on
+    int section =nearestSection( ring, offset );
+    if( section != -1 ) {
+        double d =qAbs( ring.track->sections()[section].offset - offset );
+        d =qMin( d, length - d );
+        if( d > (markerSize + tolerance) * unitsPerWindow )
+            section =sectionAt( ring, offset );
+    }
+    if( section == -1 ) return hit;
+    return Hit { Hit::Section, r, section };
+}
+
+/** Update the index and the path of @ring after the offset or trigger of @section has changed */
+void
+ScoreRenderer::updateSection( int r, int section ) {
+    if( r < 0 || r >= _rings.count() ) return;
+    Ring& ring =_rings[r];
+    const Track& track =*ring.track;
+    if( section < 0 || section >= ring.rank.count() ) return;
+
+    // Move the section to its new place in the sorted index
+    const Key key { track.sections()[section].offset, section };
+    const int from =ring.rank[section];
+    ring.sections.remove( from );
+    const int to =std::upper_bound( ring.sections.begin(), ring.sections.end(), key ) - ring.sections.begin();
+    ring.sections.insert( to, key );
+    for( int k =qMin( from, to ); k <= qMax( from, to ); k++ )
+        ring.rank[ring.sections[k].index] =k;
+
+    ring.sorted =std::is_sorted( track.sections().begin(), track.sections().end(),
+        []( const Track::Section& a, const Track::Section& b ) { return a.offset < b.offset; } );
+    const Trigger* trig = _comp->triggerById( track.sections()[section].trigger );
+    ring.stopMarkers[section] =trig && trig->hasStopEvent();
+    buildPath( ring );
+}
+
+/** Return the section of @ring that @offset lies on: the last one that starts before it */
+int
+ScoreRenderer::sectionAt( const Ring& ring, double offset ) const {
+    if( ring.sections.isEmpty() ) return -1;
+    auto it =std::upper_bound( ring.sections.begin(), ring.sections.end(), Key { offset, 0 } );
+    // Before the first section we are still on the last one, which wraps around
+    if( it == ring.sections.begin() ) return ring.sections.last().index;
+    return (it-1)->index;
+}
+
+/** Return the section of @ring that starts closest to @offset */
+int
+ScoreRenderer::nearestSection( const Ring& ring, double offset ) const {
+    const int count =ring.sections.count();
+    if( count == 0 ) return -1;
+    const double length =ring.track->length();
+    const int k =std::lower_bound( ring.sections.begin(), ring.sections.end(), Key { offset, 0 } ) - ring.sections.begin();
+
+    // Only the neighbours on either side (which wrap around) can be the closest
+    const Key& next =ring.sections[k % count];
+    const Key& prev =ring.sections[(k + count - 1) % count];
+    double dn =qAbs( next.offset - offset ), dp =qAbs( offset - prev.offset );
+    dn =qMin( dn, length - dn );
+    dp =qMin( dp, length - dp );
+    return dn <= dp ? next.index : prev.index;
+}
+
+/** Return the axle of the train of @ring at @pos whose marker covers @offset, or -1 */
+int
+ScoreRenderer::axleAt( const Ring& ring, double pos, double offset, double tolerance ) const {
+    if( ring.axles.isEmpty() ) return -1;
+    const double length =ring.track->length();
+    // The marker of an axle points forward from its position, m track units long
+    const double m =markerSize * length / (2.0 * M_PI * ring.radius);
+
+    double behind =std::fmod( pos - offset, length );
+    if( behind < 0.0 ) behind += length;
+
+    // A train can be longer than its track, so every lap behind the first axle is tried,
+    // starting one lap ahead for the marker of the first axle
+    for( behind -= length; behind <= ring.axles.last().offset + m + tolerance; behind += length ) {
+        const double center =behind + m / 2.0;
+        auto it =std::lower_bound( ring.axles.begin(), ring.axles.end(), Key { center, 0 } );
+        if( it != ring.axles.end() && qAbs( it->offset - center ) <= m / 2.0 + tolerance )
+            return it->index;
+        if( it != ring.axles.begin() && qAbs( (it-1)->offset - center ) <= m / 2.0 + tolerance )
+            return (it-1)->index;
+    }
+    return -1;
+}
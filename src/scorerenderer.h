@@ -0,0 +1,120 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QPainterPath>
+#include <QPalette>
+#include <QPolygonF>
+#include <QRect>
+#include <QTransform>
+#include <QVector>
+
+class Composition;
+class Track;
+class EventQueue;
+class QPainter;
+
+/** Draws the train notation of a Composition with any QPainter.
+ *
+ * The geometry of the score is computed once by setComposition(), after which the renderer
+ * is only read from. The moving parts are drawn from a State, a snapshot of the position
+ * of every train, so the same renderer can be used from several threads at once
+ * (e.g. to render the frames of an export in parallel).
+ *
+ * Detail is reduced to what is visible at the scale set by setDetail(): consecutive
+ * sections that are too short to tell apart are merged into one arc and markers that
+ * would come out too small are left out. Rings outside the visible area are skipped,
+ * so the cost of drawing depends on the size of the output rather than the composition.
+ */
+class ScoreRenderer {
+public:
+    struct RingState {
+        bool running;
+        double pos;                 // Position of the train on the track [0..length)
+    };
+    typedef QVector<RingState> StateT;
+
+    // Result of hitTest(): the section or axle of the track with index @ring
+    struct Hit {
+        enum Type { None, Section, Axle };
+        Type type;
+        int ring;
+        int index;              // Section or axle
+    };
+
+    ScoreRenderer();
+    ~ScoreRenderer();
+
+    void setComposition( const Composition* );
+    const Composition* composition() const { return _comp; }
+
+    int ringCount() const { return _rings.count(); }
+
+    void setPalette( const QPalette& p ) { _palette =p; }
+    const QPalette& palette() const { return _palette; }
+
+    // The square that contains all rings, in window (score) coordinates
+    QRect window() const { return _window; }
+    QTransform deviceTransform( const QSize&, qreal zoom =1.0, const QPointF& center =QPointF() ) const;
+    void setupPainter( QPainter&, const QTransform& ) const;
+
+    void setDetail( qreal pixelsPerUnit );
+    qreal detail() const { return _detail; }
+
+    void visibleRings( const QRectF&, int* first, int* last ) const;
+
+    static StateT snapshot( const EventQueue&, double now =-1.0 );
+
+    void render( QPainter&, const QSize&, const StateT& ) const;
+    void drawStatic( QPainter&, const StateT&, const QRectF& visible ) const;
+    void drawMoving( QPainter&, const StateT&, const QVector<int>& rings ) const;
+
+    int currentSection( int ring, const RingState& ) const;
+    QRectF movingBounds( int ring, const RingState& ) const;
+
+    int ringAt( const QPointF&, qreal tolerance =0.0 ) const;
+    Hit hitTest( const QPointF&, const StateT&, qreal tolerance =0.0 ) const;
+    void updateSection( int ring, int section );
+
+private:
+    // Entry of the sorted indices of sections and axles
+    struct Key {
+        double offset;
+        int index;
+        bool operator<( const Key& k ) const { return offset < k.offset; }
+    };
+
+    struct Ring {
+        const Track* track;
+        float radius;
+        QVector<bool> stopMarkers;  // Section i has a trigger with a stop event
+        bool sorted;                // Sections are sorted by offset
+        QPainterPath path;          // All sections and markers, at the current level of detail
+        QPolygonF train;            // Three vertices per axle, for the train at position 0
+        QVector<Key> sections;      // Sections sorted by offset
+        QVector<int> rank;          // Position of each section in the sorted index
+        QVector<Key> axles;         // Axles sorted by their distance behind the first one
+    };
+
+    void buildGeometry( Ring& ) const;
+    void buildIndex( Ring& ) const;
+    void buildPath( Ring& ) const;
+    void addSection( QPainterPath&, const Ring&, int section, bool marker =true ) const;
+    void addArc( QPainterPath&, const Ring&, double start, double end, double gap ) const;
+    bool showMarkers() const;
+    QPolygonF trainPolygon( const Ring&, double pos ) const;
+    int sectionAt( const Ring&, double offset ) const;
+    int nearestSection( const Ring&, double offset ) const;
+    int axleAt( const Ring&, double pos, double offset, double tolerance ) const;
+
+    const Composition* _comp;
+    QVector<Ring> _rings;
+    QRect _window;
+    qreal _detail;              // Device pixels per window unit the paths are built for
+    QPalette _palette;
+};
@@ -8,28 +8,37 @@
 #include "scorewidget.h"
 #include "composition.h"
 #include "eventqueue.h"
+#include <QApplication>
 #include <QPainter>
-#include <QPen>
+#include <QPaintEvent>
+#include <QMouseEvent>
+#include <QWheelEvent>
 #include <QRect>
 #include <QtMath>
 #include <cstdio>
 
-QColor
-rgbLERP( QColor c1, QColor c2, float w ) {
-    QColor d;
-    // For some reason setRgbF gives me weird errors here...
-    d.setRgb (
-        (c1.redF()   * (1.f-w) + c2.redF()   * w) * 255,
-        (c1.greenF() * (1.f-w) + c2.greenF() * w) * 255,
-        (c1.blueF()  * (1.f-w) + c2.blueF()  * w) * 255
-    );
-    return d;
-}
+// Range and step of zooming with the mouse wheel
+static const qreal minZoom =1.0;
+static const qreal maxZoom =256.0;
+static const qreal zoomStep =1.2;       // per notch of the wheel
+// Distance the mouse may be off when picking sections and axles, in pixels
+static const qreal pickTolerance =4.0;
 
-ScoreWidget::ScoreWidget( QWidget* parent ) : QWidget( parent ), _comp( nullptr ) {
+ScoreWidget::ScoreWidget( QWidget* parent ) : 
+    QWidget( parent ), 
+    _comp( nullptr ), 
+    _queue( nullptr ),
+    _zoom( 1.0 ),
+    _dragged( false ),
+    _hover( ScoreRenderer::Hit { ScoreRenderer::Hit::None, -1, -1 } ),
+    _first( 0 ),
+    _last( -1 ) {
     
     setBackgroundRole( QPalette::Window );
-    setAutoFillBackground( true );
+    // The static layer covers the whole widget, including the background
+    setAttribute( Qt::WA_OpaquePaintEvent );
+    // Hovering is tracked for picking sections and axles
+    setMouseTracking( true );
     setDarkPalette( false );
 
 }
@@ -43,18 +52,56 @@ ScoreWidget::setDarkPalette( bool dark ) {
     QPalette pal;
     pal.setColor( QPalette::Window, dark ? Qt::black : Qt::white );
     pal.setColor( QPalette::WindowText, dark ? Qt::white : Qt::black );
+    invalidateStatic();
 }
 
 void
 ScoreWidget::setComposition( Composition* comp ) {
     _comp =comp;
-    update();
+    _renderer.setComposition( comp );
+    _state =ScoreRenderer::StateT( _renderer.ringCount(), ScoreRenderer::RingState { false, 0.0 } );
+    _dirty =QVector<QRect>( _renderer.ringCount() );
+    _hover =ScoreRenderer::Hit { ScoreRenderer::Hit::None, -1, -1 };
+
+    updateLayout();
+    updatePositions();
+    invalidateStatic();
+}
+
+void
+ScoreWidget::setZoom( qreal zoom ) {
+    zoom =qBound( minZoom, zoom, maxZoom );
+    if( zoom == _zoom ) return;
+    _zoom =zoom;
+    updateLayout();
+    invalidateStatic();
+}
+
+void
+ScoreWidget::setCenter( const QPointF& center ) {
+    // Keep at least part of the score in view
+    const QRectF w =_renderer.window();
+    const QPointF c( qBound( w.left(), center.x(), w.right() ), qBound( w.top(), center.y(), w.bottom() ) );
+    if( c == _center ) return;
+    _center =c;
+    updateLayout();
+    invalidateStatic();
+}
+
+/** Show the whole score again */
+void
+ScoreWidget::resetView() {
+    _zoom =1.0;
+    _center =QPointF();
+    updateLayout();
+    invalidateStatic();
 }
 
 void
 ScoreWidget::setEventQueue( const EventQueue* eq ) {
     _queue =eq;
-    update();
+    updatePositions();
+    invalidateStatic();
 }
 
 QSize 
@@ -67,141 +114,205 @@ ScoreWidget::sizeHint() const {
     return minimumSizeHint(); // for now
 }
 
-void 
-ScoreWidget::paintEvent( QPaintEvent *event ) {
-    if( _comp == nullptr || _comp->tracks().isEmpty() || !_queue ) return;
-
-    const float stroke =.02f;
-    const float markerSize =.4f;
-    //const int count = _comp->tracks().count();
-    const float radiusStep = 1.f;
-    const float margin = 1.f;
-    const float windowRadius = 2.f + radiusStep * (_comp->tracks().count()-1) + margin;
-    
-    _window =QRect( -qCeil(windowRadius), -qCeil(windowRadius), qCeil(2 * windowRadius), qCeil(2 * windowRadius) );
+void
+ScoreWidget::resizeEvent( QResizeEvent* ) {
+    updateLayout();
+    invalidateStatic();
+}
 
-    QPainter painter (this);
-    painter.setWindow( _window );
-    
-    /* In addition, we set up the viewport to match the ratio of the window */
-
-    float s =.0f;
-
-    if( width() > height() ) {     
-        float w = ((float)_window.width() / (float)_window.height()) * (float)height();
-        int delta = (int)w - width();
-        painter.setViewport( -delta / 2, 0, (int)w, height() );
-        s = w / _window.width();
-    } else {
-        float h = ((float)_window.height() / (float)_window.width()) * (float)width();
-        int delta = (int)h - height();
-        painter.setViewport( 0, -delta / 2, width(), (int)h );
-        s = h / _window.height();
+void
+ScoreWidget::changeEvent( QEvent* event ) {
+    if( event->type() == QEvent::PaletteChange )
+        invalidateStatic();
+    QWidget::changeEvent( event );
+}
+
+/** Zoom in or out around the point under the mouse */
+void
+ScoreWidget::wheelEvent( QWheelEvent* event ) {
+    const qreal steps =event->angleDelta().y() / 120.0;
+    if( steps == 0.0 ) return;
+
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 14, 0 )
+    const QPointF pos =event->position();
+#else
+    const QPointF pos =event->posF();
+#endif
+    const QPointF anchor =_toDevice.inverted().map( pos );
+    const qreal zoom =qBound( minZoom, _zoom * qPow( zoomStep, steps ), maxZoom );
+    if( zoom == _zoom ) return;
+
+    // Find the center for which the anchor stays under the mouse at the new zoom
+    const qreal scale =_toDevice.m11() * zoom / _zoom;
+    _zoom =zoom;
+    // setCenter() lays out the score again, unless the center stays where it was
+    const QPointF center =_center;
+    setCenter( anchor - (pos - QPointF( width() / 2.0, height() / 2.0 )) / scale );
+    if( _center == center ) {
+        updateLayout();
+        invalidateStatic();
     }
+    event->accept();
+}
 
-//    viewport = painter.viewport();
+void
+ScoreWidget::mousePressEvent( QMouseEvent* event ) {
+    if( event->button() == Qt::LeftButton ) {
+        _dragPos =event->pos();
+        _dragged =false;
+    }
+}
 
-    painter.setRenderHint( QPainter::Antialiasing, true );
-    
-    QPen pen;
-    pen.setColor( palette().color( QPalette::WindowText ) );
-    pen.setWidthF( stroke );
-    painter.setPen( pen );
-
-    float radius = 1.f;
-
-    for( const auto & tq : _queue->tracks() ) {
-
-        const Track& track =*tq->track;
-        // Calculate the number of degrees of the circle that correspond to one window-space unit
-        const float degPerUnit = 360.0 / (2.0 * radius * M_PI);
-//        painter.drawEllipse( QPointF(0,0), radius, radius );
-        const int length =track.length();
-        const double c =360.0 / (double)length; // Factor to convert track length to degrees
-        QRectF circle( -radius, -radius, radius*2, radius*2 );
-        
-        if( track.sections().isEmpty() ) {
-            //painter.drawEllipse( circle );
-            continue;
-        }
+/** Pan by dragging with the left mouse button, otherwise follow what is under the mouse */
+void
+ScoreWidget::mouseMoveEvent( QMouseEvent* event ) {
+    if( !(event->buttons() & Qt::LeftButton) ) {
+        setHover( hitTest( event->pos() ) );
+        return;
+    }
+    const QPoint delta =event->pos() - _dragPos;
+    if( !_dragged && delta.manhattanLength() < QApplication::startDragDistance() ) return;
+    _dragged =true;
+    _dragPos =event->pos();
+    setCenter( _center - QPointF( delta ) / _toDevice.m11() );
+}
 
-        const int sects  =track.sections().count();
-        const double pos =tq->normalizedOffset * length;
-
-        for( int i =0; i < sects; i++ ) {
-            const float gap = degPerUnit * (markerSize/4.0); // degrees
-            const Track::Section& section1 =track.sections()[i];
-            const Track::Section& section2 =
-                i == sects-1 
-                    ? track.sections()[0] 
-                    : track.sections()[i+1];
-            const float angle1 =section1.offset;
-            const float angle2 =(i == sects-1 ? length : 0.0) + section2.offset;
-            
-            // Determine if the playhead is in the current section
-            if( tq->running == false )
-                pen.setColor( palette().color( QPalette::Disabled, QPalette::WindowText ) );
-            else if( pos >= angle1 && pos < angle2 ) {
-                float w = (pos-angle1) / (angle2-angle1 ); // Normalized distance
-                pen.setColor( rgbLERP( Qt::red, palette().color( QPalette::WindowText ), w ) );
-            }
-            else
-                pen.setColor( palette().color( QPalette::WindowText ) );
-            painter.setPen( pen );
-
-            // Draw the arc first
-            float start =c*angle1 - 90.0f; // -90 to start in the 12' oclock position
-            float span  =(c*angle2 - 90.0f) - start - gap;
-            painter.drawArc( circle, -start*16.f, -span*16.f ); 
-            //printf( "Draw Arc %f, %f\n", -start, -span );
-            
-            const Trigger* trig = _comp->triggerById( section1.trigger );
-
-            // Now draw the marker.
-            // For a stop-event we use a square
-            if( trig && trig->hasStopEvent() ) {
-                double o =degPerUnit * markerSize;
-                QPointF square[4] = {
-                        QPointF( qCos( qDegreesToRadians(start) ) * (radius-markerSize/2.f),
-                                 qSin( qDegreesToRadians(start) ) * (radius-markerSize/2.f) ),
-                        QPointF( qCos( qDegreesToRadians(start) ) * (radius+markerSize/2.f),
-                                 qSin( qDegreesToRadians(start) ) * (radius+markerSize/2.f) ), 
-                        QPointF( qCos( qDegreesToRadians(start+o) ) * (radius+markerSize/2.f),
-                                 qSin( qDegreesToRadians(start+o) ) * (radius+markerSize/2.f) ),
-                        QPointF( qCos( qDegreesToRadians(start+o) ) * (radius-markerSize/2.f),
-                                 qSin( qDegreesToRadians(start+o) ) * (radius-markerSize/2.f) ) };
-                painter.drawPolygon( square, 4 );
-
-            } else {
-                // For a Midi-event we use a perpendicular line marking the section
-                painter.drawLine(
-                        QPointF( qCos( qDegreesToRadians(start) ) * (radius-markerSize/2.f),
-                                 qSin( qDegreesToRadians(start) ) * (radius-markerSize/2.f) ),
-                        QPointF( qCos( qDegreesToRadians(start) ) * (radius+markerSize/2.f),
-                                 qSin( qDegreesToRadians(start) ) * (radius+markerSize/2.f) ) );
-            }
+/** A click that did not pan selects the section or axle under the mouse */
+void
+ScoreWidget::mouseReleaseEvent( QMouseEvent* event ) {
+    if( event->button() != Qt::LeftButton || _dragged ) return;
+    const ScoreRenderer::Hit hit =hitTest( event->pos() );
+    if( hit.type == ScoreRenderer::Hit::None ) return;
+    emit clicked( hit.ring,
+                  hit.type == ScoreRenderer::Hit::Section ? hit.index : -1,
+                  hit.type == ScoreRenderer::Hit::Axle ? hit.index : -1 );
+}
 
-        }
+void
+ScoreWidget::leaveEvent( QEvent* ) {
+    setHover( ScoreRenderer::Hit { ScoreRenderer::Hit::None, -1, -1 } );
+}
+
+/** Return the section or axle at @pos in widget coordinates */
+ScoreRenderer::Hit
+ScoreWidget::hitTest( const QPoint& pos ) const {
+    if( !_queue || _state.isEmpty() )
+        return ScoreRenderer::Hit { ScoreRenderer::Hit::None, -1, -1 };
+    return _renderer.hitTest( _toDevice.inverted().map( QPointF( pos ) ), _state, pickTolerance / _toDevice.m11() );
+}
+
+void
+ScoreWidget::updateSection( int track, int section ) {
+    _renderer.updateSection( track, section );
+    invalidateStatic();
+}
+
+void
+ScoreWidget::setHover( const ScoreRenderer::Hit& hit ) {
+    if( hit.type == _hover.type && hit.ring == _hover.ring && hit.index == _hover.index ) return;
+    _hover =hit;
+    setCursor( hit.type == ScoreRenderer::Hit::None ? Qt::ArrowCursor : Qt::PointingHandCursor );
+    emit hovered( hit.ring,
+                  hit.type == ScoreRenderer::Hit::Section ? hit.index : -1,
+                  hit.type == ScoreRenderer::Hit::Axle ? hit.index : -1 );
+}
 
-        // Draw the 'train'
-        double o =0.0;
-        for( int i =0; i < track.axleCount(); i++ ) {
-            o -= i==0 ? 0.0 : track.axleOffsets()[i-1];
-            double angle =c * (o+pos) - 90.0;
-            QPointF train[3] = {
-                    QPointF( qCos( qDegreesToRadians(angle) ) * (radius-markerSize/2.f),
-                             qSin( qDegreesToRadians(angle) ) * (radius-markerSize/2.f) ),
-                    QPointF( qCos( qDegreesToRadians(angle) ) * (radius+markerSize/2.f),
-                             qSin( qDegreesToRadians(angle) ) * (radius+markerSize/2.f) ),
-                    QPointF( qCos( qDegreesToRadians(angle+degPerUnit*markerSize) ) * (radius),
-                             qSin( qDegreesToRadians(angle+degPerUnit*markerSize) ) * (radius) ) };
-            pen.setColor( palette().color( QPalette::WindowText ) );
-            painter.setPen( pen );
-            painter.drawPolygon( train, 3 );
+void
+ScoreWidget::mouseDoubleClickEvent( QMouseEvent* event ) {
+    if( event->button() == Qt::LeftButton )
+        resetView();
+}
+
+/** Sample the positions of all trains from the event queue and repaint the areas that changed.
+ *  If @now is given (in msec, fractional), positions are interpolated to that time rather than
+ *  taken from the last time the queue was advanced to. */
+void
+ScoreWidget::updatePositions( double now ) {
+    if( !_queue || _queue->tracks().count() != _state.count() ) return;
+
+    const ScoreRenderer::StateT state =ScoreRenderer::snapshot( *_queue, now );
+
+    QRegion dirty;
+    for( int i =0; i < _state.count(); i++ ) {
+        const bool visible =i >= _first && i <= _last;
+        if( state[i].running != _state[i].running ) {
+            // Stopped tracks are drawn in a different color, which is part of the static layer
+            _state[i].running =state[i].running;
+            if( visible ) invalidateStatic();
         }
+        
+        if( state[i].pos == _state[i].pos ) continue;
+        _state[i].pos =state[i].pos;
+        if( !visible ) continue;
 
+        QRect bounds =movingBounds( i );
+        dirty += _dirty[i];
+        dirty += bounds;
+        _dirty[i] =bounds;
+    }
+    if( !dirty.isEmpty() )
+        update( dirty );
+}
 
-        radius += radiusStep;
+/** Compute the mapping of the score to the widget for the current zoom and center,
+ *  the rings that are visible and the level of detail to draw them with */
+void
+ScoreWidget::updateLayout() {
+    _toDevice =_renderer.deviceTransform( size(), _zoom, _center );
+    _visible =_toDevice.inverted().mapRect( QRectF( rect() ) );
+    _renderer.visibleRings( _visible, &_first, &_last );
+    _renderer.setDetail( _toDevice.m11() * devicePixelRatioF() );
+
+    for( int i =0; i < _dirty.count(); i++ )
+        _dirty[i] =i >= _first && i <= _last ? movingBounds( i ) : QRect();
+}
+
+void
+ScoreWidget::invalidateStatic() {
+    _static =QPixmap();
+    update();
+}
+
+/** Render everything that does not move during playback to the static layer */
+void
+ScoreWidget::renderStatic() {
+    const qreal dpr =devicePixelRatioF();
+    _static =QPixmap( size() * dpr );
+    _static.setDevicePixelRatio( dpr );
+    _static.fill( palette().color( QPalette::Window ) );
+    
+    _renderer.setPalette( palette() );
+    QPainter painter( &_static );
+    _renderer.setupPainter( painter, _toDevice );
+    _renderer.drawStatic( painter, _state, _visible );
+}
+
+void 
+ScoreWidget::paintEvent( QPaintEvent *event ) {
+    QPainter painter (this);
+    if( _comp == nullptr || _comp->tracks().isEmpty() || !_queue ) {
+        painter.fillRect( event->rect(), palette().color( QPalette::Window ) );
+        return;
     }
 
+    if( _static.isNull() )
+        renderStatic();
+
+    // Only the damaged part of the static layer is copied, and only the moving parts
+    // that intersect it are drawn on top
+    painter.setClipRegion( event->region() );
+    painter.drawPixmap( 0, 0, _static );
+
+    QVector<int> rings;
+    for( int i =_first; i <= _last && i < _dirty.count(); i++ )
+        if( event->region().intersects( _dirty[i] ) ) rings.append( i );
+
+    _renderer.setupPainter( painter, _toDevice );
+    _renderer.drawMoving( painter, _state, rings );
+}
+
+/** Return the area in widget coordinates covered by the moving parts of ring @i */
+QRect
+ScoreWidget::movingBounds( int i ) const {
+    return _toDevice.mapRect( _renderer.movingBounds( i, _state[i] ) ).toAlignedRect().adjusted( -1, -1, 1, 1 );
 }
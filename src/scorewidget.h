@@ -7,7 +7,11 @@
 
 #pragma once
 
+#include "scorerenderer.h"
 #include <QWidget>
+#include <QPixmap>
+#include <QTransform>
+#include <QVector>
 
 class Composition;
 //class PlayHead;
@@ -30,19 +34,64 @@ public:
 
     void setDarkPalette( bool dark );
     bool hasDarkPalette() const { return _dark; }
-    
+
+    // The score is shown at @zoom times the size at which it fits, with @center in the middle
+    void setZoom( qreal zoom );
+    qreal zoom() const { return _zoom; }
+    void setCenter( const QPointF& center );
+    QPointF center() const { return _center; }
+
     QSize minimumSizeHint() const override;
     QSize sizeHint() const override;
 
+    ScoreRenderer::Hit hitTest( const QPoint& ) const;
+    // Show the new offset or trigger of @section of the track at index @track
+    void updateSection( int track, int section );
+
+signals:
+    // The section or axle under the mouse, -1 for none. @track is the index of the track.
+    void hovered( int track, int section, int axle );
+    void clicked( int track, int section, int axle );
+
+public slots:
+    void updatePositions( double now =-1.0 );
+    void resetView();
+
 protected:
     void paintEvent( QPaintEvent *event ) override;
-
+    void resizeEvent( QResizeEvent *event ) override;
+    void changeEvent( QEvent *event ) override;
+    void wheelEvent( QWheelEvent *event ) override;
+    void mousePressEvent( QMouseEvent *event ) override;
+    void mouseMoveEvent( QMouseEvent *event ) override;
+    void mouseReleaseEvent( QMouseEvent *event ) override;
+    void leaveEvent( QEvent *event ) override;
+    void mouseDoubleClickEvent( QMouseEvent *event ) override;
 
 private:
+    void updateLayout();
+    void invalidateStatic();
+    void setHover( const ScoreRenderer::Hit& );
+    void renderStatic();
+    QRect movingBounds( int ring ) const;
+
     Composition* _comp;
     const EventQueue* _queue;
 //    const PlayHead* _playhead;
 
     bool _dark;
-    QRect _window;
+    ScoreRenderer _renderer;
+    // Positions are sampled by updatePositions() so that painting is consistent
+    // with the regions that were marked dirty
+    ScoreRenderer::StateT _state;
+    QVector<QRect> _dirty;      // Area covered by the moving parts of each ring, in widget coordinates
+    qreal _zoom;
+    QPointF _center;            // Point of the score in the middle of the widget, in window coordinates
+    QPoint _dragPos;
+    bool _dragged;
+    ScoreRenderer::Hit _hover;
+    QTransform _toDevice;       // Maps window (score) coordinates to widget coordinates
+    QRectF _visible;            // Visible part of the score, in window coordinates
+    int _first, _last;          // Range of rings that cross the visible part
+    QPixmap _static;            // Cached layer with everything that does not move
 };
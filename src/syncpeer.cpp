@@ -0,0 +1,323 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "syncpeer.h"
+
+#include <QUdpSocket>
+#include <QMutexLocker>
+#include <QtEndian>
+#include <cstring>
+#include <random>
+
+// Layout of a datagram, all numbers big-endian: "MTSY", version, type, 2 unused bytes, the id
+// of the sender, and then
+//   Ping:      time it was sent on the timer of the sender, phase of the sender
+//   Pong:      time of the ping, time it was received and time the pong was sent on the timer
+//              of the sender of the pong
+//   Announce:  revision, author, anchor on the timer of the sender, position, scale (double),
+//              playing (1 byte)
+#define SYNC_VERSION 1
+#define SYNC_HEADER 16
+#define SYNC_PING_SIZE (SYNC_HEADER + 16)
+#define SYNC_PONG_SIZE (SYNC_HEADER + 24)
+#define SYNC_ANNOUNCE_SIZE (SYNC_HEADER + 41)
+
+static inline void
+put64( uchar* p, quint64 v ) {
+    qToBigEndian<quint64>( v, p );
+}
+
+static inline quint64
+get64( const uchar* p ) {
+    return qFromBigEndian<quint64>( p );
+}
+
+static void
+header( uchar* p, int type, quint64 id ) {
+    memcpy( p, "MTSY", 4 );
+    p[4] =SYNC_VERSION;
+    p[5] =(uchar)type;
+    p[6] =p[7] =0;
+    put64( p + 8, id );
+}
+
+SyncPeer::SyncPeer( QObject* parent ) :
+    QThread( parent ),
+    _socket( nullptr ),
+    _port( 0 ),
+    _changed( false ),
+    _phase( SYNC_NO_PHASE ) {
+    std::random_device random;
+    // Never 0, which stands for a peer that was not heard from yet
+    do _id =((quint64)random() << 32) ^ random(); while( _id == 0 );
+    _timer.start();
+    _timeline ={ 0, 0, false, 0, 0, 1.0 };
+}
+
+SyncPeer::~SyncPeer() {
+    requestInterruption();
+    wait();
+    delete _socket;
+}
+
+/** Bind to @port on @address. The peer is started with start(). */
+bool
+SyncPeer::listen( const QHostAddress& address, quint16 port, QString* error ) {
+    if( isRunning() || _socket != nullptr ) return false;
+
+    _socket =new QUdpSocket();
+    if( !_socket->bind( address, port ) ) {
+        if( error != nullptr ) *error =_socket->errorString();
+        delete _socket;
+        _socket =nullptr;
+        return false;
+    }
+    _port =_socket->localPort();
+    // The socket is only used by run()
+    _socket->moveToThread( this );
+    return true;
+}
+
+/** A peer at @address and @port that was not heard from */
+static SyncPeer::Peer
+newPeer( const QHostAddress& address, quint16 port, bool given ) {
+    SyncPeer::Peer p;
+    p.id =0;
+    p.address =address;
+    p.port =port;
+    p.seen =p.offset =p.rtt =0;
+    p.phase =SYNC_NO_PHASE;
+    p.samples =0;
+    p.given =given;
+    return p;
+}
+
+void
+SyncPeer::addPeer( const QHostAddress& address, quint16 port ) {
+    if( isRunning() || _peers.count() >= SYNC_MAX_PEERS ) return;
+    _peers.append( newPeer( address, port, true ) );
+}
+
+SyncPeer::Timeline
+SyncPeer::timeline() const {
+    QMutexLocker locker( &_lock );
+    return _timeline;
+}
+
+SyncPeer::Timeline
+SyncPeer::propose( Timeline t ) {
+    {
+        QMutexLocker locker( &_lock );
+        t.revision =_timeline.revision + 1;
+        t.author =_id;
+        _timeline =t;
+    }
+    _changed.store( true, std::memory_order_release );
+    return t;
+}
+
+QVector<SyncPeer::Peer>
+SyncPeer::peers() const {
+    const qint64 now =_timer.nsecsElapsed();
+    QVector<Peer> peers;
+    QMutexLocker locker( &_lock );
+    for( const auto& p : _peers )
+        if( isAlive( p, now ) ) peers.append( p );
+    return peers;
+}
+
+void
+SyncPeer::run() {
+    if( _socket == nullptr ) return;
+    qint64 nextPing =0, nextAnnounce =0;
+    while( !isInterruptionRequested() ) {
+        qint64 now =_timer.nsecsElapsed();
+        if( now >= nextPing ) {
+            expire( now );
+            ping();
+            nextPing =now + SYNC_PING * 1000000LL;
+        }
+        if( _changed.exchange( false, std::memory_order_acquire ) || now >= nextAnnounce ) {
+            announce();
+            nextAnnounce =now + SYNC_ANNOUNCE * 1000000LL;
+        }
+
+        // Changes of the timeline are not signalled, so they wait for at most SYNC_POLL
+        const qint64 timeout =qBound( (qint64)0, (qMin( nextPing, nextAnnounce ) - now) / 1000000, (qint64)SYNC_POLL );
+        if( _socket->hasPendingDatagrams() || _socket->waitForReadyRead( (int)timeout ) ) {
+            while( _socket->hasPendingDatagrams() ) {
+                QHostAddress address;
+                quint16 port =0;
+                const qint64 size =_socket->readDatagram( reinterpret_cast<char*>( _buffer ), sizeof( _buffer ), &address, &port );
+                now =_timer.nsecsElapsed();
+                if( size > 0 ) receive( _buffer, (int)size, address, port, now );
+            }
+        }
+    }
+}
+
+void
+SyncPeer::receive( const uchar* data, int size, const QHostAddress& address, quint16 port, qint64 now ) {
+    if( size < SYNC_HEADER || memcmp( data, "MTSY", 4 ) != 0 || data[4] != SYNC_VERSION ) return;
+    const quint64 id =get64( data + 8 );
+    if( id == 0 || id == _id ) return;
+    Peer* p =findPeer( id, address, port, now );
+    if( p == nullptr ) return;
+    {
+        QMutexLocker locker( &_lock );
+        p->seen =now;
+    }
+
+    switch( data[5] ) {
+    case Ping: {
+        if( size < SYNC_PING_SIZE ) return;
+        {
+            QMutexLocker locker( &_lock );
+            p->phase =(qint64)get64( data + SYNC_HEADER + 8 );
+        }
+        uchar pong[SYNC_PONG_SIZE];
+        header( pong, Pong, _id );
+        memcpy( pong + SYNC_HEADER, data + SYNC_HEADER, 8 );
+        put64( pong + SYNC_HEADER + 8, (quint64)now );
+        put64( pong + SYNC_HEADER + 16, (quint64)_timer.nsecsElapsed() );
+        send( *p, pong, sizeof( pong ) );
+        break;
+    }
+    case Pong: {
+        if( size < SYNC_PONG_SIZE ) return;
+        const qint64 t0 =(qint64)get64( data + SYNC_HEADER );
+        const qint64 t1 =(qint64)get64( data + SYNC_HEADER + 8 );
+        const qint64 t2 =(qint64)get64( data + SYNC_HEADER + 16 );
+        const qint64 rtt =(now - t0) - (t2 - t1);
+        if( t0 > now || rtt < 0 ) return;
+
+        // The offset is off by at most half the round trip, so the shortest one is the best
+        QMutexLocker locker( &_lock );
+        const int i =p->samples % SYNC_SAMPLES;
+        p->offsets[i] =((t1 - t0) + (t2 - now)) / 2;
+        p->rtts[i] =rtt;
+        p->samples++;
+        int best =0;
+        for( int j =1; j < qMin( p->samples, SYNC_SAMPLES ); j++ )
+            if( p->rtts[j] < p->rtts[best] ) best =j;
+        p->offset =p->offsets[best];
+        p->rtt =p->rtts[best];
+        break;
+    }
+    case Announce: {
+        if( size < SYNC_ANNOUNCE_SIZE || p->samples == 0 ) return;
+        const uchar* a =data + SYNC_HEADER;
+        Timeline t;
+        t.revision =get64( a );
+        t.author =get64( a + 8 );
+        t.anchor =(qint64)get64( a + 16 ) - p->offset;
+        t.position =(qint64)get64( a + 24 );
+        const quint64 bits =get64( a + 32 );
+        memcpy( &t.scale, &bits, sizeof( t.scale ) );
+        t.playing =a[40] != 0;
+        if( !(t.scale > 0.0) ) return;
+
+        bool newer;
+        {
+            QMutexLocker locker( &_lock );
+            newer =t.revision > _timeline.revision || (t.revision == _timeline.revision && t.author > _timeline.author);
+            const bool same =t.revision == _timeline.revision && t.author == _timeline.author;
+            // The leader's anchor is followed as its clock drifts from this one
+            if( newer || (same && id == leader( now )) ) _timeline =t;
+        }
+        if( newer ) {
+            // Pass it on to the peers that may not have heard it
+            _changed.store( true, std::memory_order_release );
+            emit timelineChanged();
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void
+SyncPeer::ping() {
+    uchar ping[SYNC_PING_SIZE];
+    header( ping, Ping, _id );
+    put64( ping + SYNC_HEADER + 8, (quint64)_phase.load( std::memory_order_relaxed ) );
+    for( const auto& p : _peers ) {
+        put64( ping + SYNC_HEADER, (quint64)_timer.nsecsElapsed() );
+        send( p, ping, sizeof( ping ) );
+    }
+}
+
+void
+SyncPeer::announce() {
+    const Timeline t =timeline();
+    uchar announce[SYNC_ANNOUNCE_SIZE];
+    header( announce, Announce, _id );
+    uchar* a =announce + SYNC_HEADER;
+    put64( a, t.revision );
+    put64( a + 8, t.author );
+    put64( a + 16, (quint64)t.anchor );
+    put64( a + 24, (quint64)t.position );
+    quint64 bits;
+    memcpy( &bits, &t.scale, sizeof( bits ) );
+    put64( a + 32, bits );
+    a[40] =t.playing ? 1 : 0;
+    for( const auto& p : _peers )
+        send( p, announce, sizeof( announce ) );
+}
+
+void
+SyncPeer::send( const Peer& peer, const uchar* data, int size ) {
+    _socket->writeDatagram( reinterpret_cast<const char*>( data ), size, peer.address, peer.port );
+}
+
+/** The peer with @id, or else the one at @address and @port. That one was either not heard
+ *  from yet or restarted with a new id, so what was measured of it no longer holds. Peers
+ *  that were not given are added. */
+SyncPeer::Peer*
+SyncPeer::findPeer( quint64 id, const QHostAddress& address, quint16 port, qint64 now ) {
+    for( auto& p : _peers )
+        if( p.id == id ) return &p;
+    for( auto& p : _peers ) {
+        if( p.port == port && p.address.isEqual( address, QHostAddress::TolerantConversion ) ) {
+            QMutexLocker locker( &_lock );
+            p =newPeer( address, port, p.given );
+            p.id =id;
+            p.seen =now;
+            return &p;
+        }
+    }
+    if( _peers.count() >= SYNC_MAX_PEERS ) return nullptr;
+
+    QMutexLocker locker( &_lock );
+    _peers.append( newPeer( address, port, false ) );
+    _peers.last().id =id;
+    _peers.last().seen =now;
+    return &_peers.last();
+}
+
+/** Forget the peers that were learned from a message and were not heard from for SYNC_TIMEOUT */
+void
+SyncPeer::expire( qint64 now ) {
+    QMutexLocker locker( &_lock );
+    for( int i =_peers.count() - 1; i >= 0; i-- )
+        if( !_peers[i].given && now - _peers[i].seen >= SYNC_TIMEOUT * 1000000LL ) _peers.remove( i );
+}
+
+bool
+SyncPeer::isAlive( const Peer& p, qint64 now ) const {
+    return p.samples > 0 && now - p.seen < SYNC_TIMEOUT * 1000000LL;
+}
+
+/** The lowest id of this instance and the peers it hears from */
+quint64
+SyncPeer::leader( qint64 now ) const {
+    quint64 id =_id;
+    for( const auto& p : _peers )
+        if( isAlive( p, now ) && p.id < id ) id =p.id;
+    return id;
+}
@@ -0,0 +1,130 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QThread>
+#include <QVector>
+#include <QMutex>
+#include <QHostAddress>
+#include <QElapsedTimer>
+#include <atomic>
+#include <cstdint>
+
+#define SYNC_PING 100           // msec between two measurements of the offset to every peer
+#define SYNC_ANNOUNCE 500       // msec between two announcements of the timeline
+#define SYNC_POLL 10            // msec, longest time before a change of the timeline is sent
+#define SYNC_TIMEOUT 3000       // msec without a message after which a peer is left out
+#define SYNC_SAMPLES 16         // Measurements of the offset to a peer that are kept
+#define SYNC_MAX_PEERS 32
+#define SYNC_PACKET 64          // Bytes, larger datagrams are not ours
+#define SYNC_NO_PHASE INT64_MIN // Not playing, so not in or out of phase
+
+// How the window follows the timeline
+#define SYNC_LEAD 200           // msec between the announcement of a start and the start
+#define SYNC_CONTROL 100        // msec between two corrections of the phase
+#define SYNC_SLEW 1000          // msec to make up for a phase error
+#define SYNC_MAX_NUDGE 10000    // Largest change of the rate of the play clock, in millionths
+#define SYNC_JUMP 100           // msec, larger phase errors are corrected by seeking
+#define SYNC_SEEK 5             // msec, when the timeline was changed larger errors are corrected by seeking
+
+class QUdpSocket;
+
+/** Keeps the play time of MidiTrain instances on several machines in phase, over UDP, in the
+ *  style of Ableton Link.
+ *
+ * The instances share a timeline: whether they play, and from which position of the
+ * composition at what time, at which tempo scale. A start is announced a little ahead, so all
+ * instances start at the same time. Every instance keeps the timeline in terms of its own
+ * timer, measuring the offset between its timer and that of every peer the way NTP does: the
+ * measurement with the shortest round trip of the last few is taken.
+ *
+ * Any instance can change the timeline, the change with the highest revision wins. The
+ * instance with the lowest id leads: the others follow its announcements, so the timeline does
+ * not drift when the clocks of the machines do. The window nudges the rate of its play clock
+ * to stay in phase with the timeline, see MainWindow::syncTick().
+ *
+ * Peers are given by address; the ones that send to this instance are added by themselves.
+ */
+class SyncPeer : public QThread {
+    Q_OBJECT
+public:
+    struct Timeline {
+        quint64 revision;       // Higher revisions replace lower ones
+        quint64 author;         // Id of the instance that made the change, for equal revisions
+        bool playing;
+        qint64 anchor;          // nsec on the timer
+        qint64 position;        // Play time since the start of the composition at anchor, nsec
+        double scale;           // Tempo scale
+
+        // The play time at @wall nsec on the timer
+        qint64 positionAt( qint64 wall ) const { return playing ? position + (qint64)((wall - anchor) * scale) : position; }
+    };
+
+    struct Peer {
+        quint64 id;             // 0 until it was heard from
+        QHostAddress address;
+        quint16 port;
+        qint64 seen;            // Time of its last message, nsec on the timer
+        qint64 offset;          // Its timer minus the timer of this instance, nsec
+        qint64 rtt;             // Round trip of the measurement that gave the offset, nsec
+        qint64 phase;           // Its play time minus that of the timeline, as it last reported, nsec
+        int samples;            // Measurements so far
+        bool given;             // With addPeer(), rather than learned from a message. Kept when silent.
+        qint64 offsets[SYNC_SAMPLES], rtts[SYNC_SAMPLES];
+    };
+
+    SyncPeer( QObject* parent =0 );
+    ~SyncPeer();
+
+    bool listen( const QHostAddress& address, quint16 port, QString* error =nullptr );
+    quint16 port() const { return _port; }
+    // Also send to @port of @address. Only before the peer is started.
+    void addPeer( const QHostAddress& address, quint16 port );
+
+    // The same timer as the window, to which the timeline refers
+    void setTimer( const QElapsedTimer& t ) { _timer =t; }
+    quint64 id() const { return _id; }
+
+    Timeline timeline() const;
+    // Change the timeline of all instances, returns @t with its revision. Can be called from any thread.
+    Timeline propose( Timeline t );
+    // How far the play time of this instance is from the timeline, nsec, or SYNC_NO_PHASE
+    void setPhase( qint64 phase ) { _phase.store( phase, std::memory_order_relaxed ); }
+    qint64 phase() const { return _phase.load( std::memory_order_relaxed ); }
+    // The peers that were heard from recently and whose offset is known
+    QVector<Peer> peers() const;
+
+    void run() override;
+
+signals:
+    // Another instance changed the timeline
+    void timelineChanged();
+
+private:
+    enum Type { Ping =1, Pong, Announce };
+
+    void receive( const uchar* data, int size, const QHostAddress& address, quint16 port, qint64 now );
+    void ping();
+    void announce();
+    void send( const Peer& peer, const uchar* data, int size );
+    Peer* findPeer( quint64 id, const QHostAddress& address, quint16 port, qint64 now );
+    void expire( qint64 now );
+    bool isAlive( const Peer& peer, qint64 now ) const;
+    quint64 leader( qint64 now ) const;
+
+    quint64 _id;
+    QUdpSocket* _socket;
+    quint16 _port;
+    QElapsedTimer _timer;
+    QVector<Peer> _peers;               // Only changed by run() once started
+    Timeline _timeline;
+    mutable QMutex _lock;               // Guards _timeline, and _peers against readers
+    std::atomic<bool> _changed;         // The timeline was changed here and is to be sent
+    std::atomic<qint64> _phase;
+    uchar _buffer[SYNC_PACKET];
+};
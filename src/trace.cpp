@@ -0,0 +1,159 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "trace.h"
+#include "eventqueue.h"
+#include "composition.h"
+#include <cstdio>
+
+#define DRAIN_INTERVAL 50   // msec
+#define DRAIN_BATCH 1024    // records
+
+TraceBuffer::TraceBuffer( int capacity ) : _head( 0 ), _tail( 0 ), _dropped( 0 ) {
+    // Round the capacity up to a power of two, so the index can be masked
+    quint64 size =1;
+    while( size < (quint64)qMax( 2, capacity ) ) size <<= 1;
+    _mask =size - 1;
+    _records =new Record[size];
+}
+
+TraceBuffer::~TraceBuffer() {
+    delete[] _records;
+}
+
+/** Take up to @max records from the ring and copy them to @out.
+ *  Must only be called from the consumer thread. */
+int
+TraceBuffer::pop( Record* out, int max ) {
+    const quint64 tail =_tail.load( std::memory_order_relaxed );
+    const quint64 head =_head.load( std::memory_order_acquire );
+    const int count =(int)qMin( (quint64)max, head - tail );
+    for( int i =0; i < count; i++ )
+        out[i] =_records[(tail + i) & _mask];
+    _tail.store( tail + count, std::memory_order_release );
+    return count;
+}
+
+TraceWriter::TraceWriter( TraceBuffer* buffer, const QString& path, QObject* parent ) :
+    QThread( parent ),
+    _buffer( buffer ),
+    _file( path ) {
+}
+
+TraceWriter::~TraceWriter() {
+    stop();
+}
+
+bool
+TraceWriter::open( QString* error ) {
+    if( !_file.open( QIODevice::WriteOnly | QIODevice::Truncate ) ) {
+        if( error ) *error =_file.errorString();
+        return false;
+    }
+    _file.write( "{\"traceEvents\":[\n" );
+    _file.write( "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"MidiTrain\"}},\n" );
+    _file.write( "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Play thread\"}}" );
+    return true;
+}
+
+/** Stop draining, write what is left in the buffer and close the file */
+void
+TraceWriter::stop() {
+    if( isRunning() ) {
+        requestInterruption();
+        wait();
+    }
+    if( !_file.isOpen() ) return;
+    drain();
+    _file.write( QString( "\n],\"otherData\":{\"dropped\":%1}}\n" ).arg( _buffer->dropped() ).toUtf8() );
+    _file.close();
+}
+
+void
+TraceWriter::run() {
+    while( !isInterruptionRequested() ) {
+        drain();
+        msleep( DRAIN_INTERVAL );
+    }
+}
+
+void
+TraceWriter::drain() {
+    TraceBuffer::Record records[DRAIN_BATCH];
+    int count;
+    do {
+        count =_buffer->pop( records, DRAIN_BATCH );
+        for( int i =0; i < count; i++ )
+            write( records[i] );
+    } while( count == DRAIN_BATCH );
+    _file.flush();
+}
+
+static const char*
+eventName( const TraceBuffer::Record& r ) {
+    switch( r.type ) {
+    case EventQueue::LoopBeginEvent: return "Loop";
+    case EventQueue::ImplicitNoteOffEvent: return "Note off";
+    case EventQueue::TriggerEvent:
+        switch( r.trigger ) {
+        case Trigger::MidiEvent: return "MIDI";
+        case Trigger::StopEvent: return "Stop";
+        case Trigger::StartEvent: return "Start";
+        case Trigger::ResetEvent: return "Reset";
+        default: return "Trigger";
+        }
+    default: return "Event";
+    }
+}
+
+/** Write @r as a trace event. Times are written in usec, as the format requires. */
+void
+TraceWriter::write( const TraceBuffer::Record& r ) {
+    char buf[256];
+    int len =0;
+    const double ts =r.time / 1000.0;
+
+    switch( r.kind ) {
+    case TraceBuffer::Dispatch: {
+        // Every track gets its own row, named once
+        const int tid =r.track + 1;
+        if( !_tracks.contains( r.track ) ) {
+            _tracks.insert( r.track );
+            len =snprintf( buf, sizeof(buf),
+                ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Track %d\"}}",
+                tid, r.track );
+            _file.write( buf, len );
+        }
+        len =snprintf( buf, sizeof(buf),
+            ",\n{\"name\":\"%s\",\"cat\":\"event\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"section\":%d,\"scheduled\":%.3f,\"late\":%.3f}}",
+            eventName( r ), ts, tid, r.section, r.scheduled / 1000.0, (r.time - r.scheduled) / 1000.0 );
+        break;
+    }
+    case TraceBuffer::Sleep:
+        len =snprintf( buf, sizeof(buf),
+            ",\n{\"name\":\"sleep\",\"cat\":\"thread\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":0,"
+            "\"args\":{\"until\":%.3f}}",
+            ts, r.scheduled < 0 ? -1.0 : r.scheduled / 1000.0 );
+        break;
+    case TraceBuffer::Wakeup:
+        // Without a deadline the thread cannot oversleep
+        if( r.scheduled < 0 ) {
+            len =snprintf( buf, sizeof(buf),
+                ",\n{\"name\":\"sleep\",\"cat\":\"thread\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":0}", ts );
+            break;
+        }
+        len =snprintf( buf, sizeof(buf),
+            ",\n{\"name\":\"sleep\",\"cat\":\"thread\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":0,"
+            "\"args\":{\"oversleep\":%.3f}}",
+            ts, (r.time - r.scheduled) / 1000.0 );
+        break;
+    default:
+        return;
+    }
+    _file.write( buf, qMin( len, (int)sizeof(buf) - 1 ) );
+}
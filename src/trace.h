@@ -0,0 +1,89 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QThread>
+#include <QFile>
+#include <QSet>
+#include <QVector>
+#include <atomic>
+
+/** Fixed-size, lock-free ring of trace records with a single producer and a single consumer.
+ *
+ * The producer (the play thread) never blocks or allocates: when the ring is full the
+ * record is dropped and counted instead. The consumer is a TraceWriter.
+ */
+class TraceBuffer {
+public:
+    enum Kind {
+        Dispatch,               // An EventQueue::Event was processed
+        Sleep,                  // The play thread goes to sleep
+        Wakeup                  // The play thread woke up
+    };
+
+    struct Record {
+        qint64 time;            // Actual time, nsec
+        qint64 scheduled;       // Time the event was due, or the thread should wake up, nsec
+        qint32 kind;
+        qint32 type;            // EventQueue::EventType
+        qint32 trigger;         // Trigger::EventType, -1 for none
+        qint32 track;           // Track id
+        qint32 section;         // Index of the section in the track
+        qint32 reserved;
+    };
+
+    TraceBuffer( int capacity =65536 );
+    ~TraceBuffer();
+
+    /** Append @r to the ring. Must only be called from the producer thread. */
+    inline bool push( const Record& r ) {
+        const quint64 head =_head.load( std::memory_order_relaxed );
+        if( head - _tail.load( std::memory_order_acquire ) > _mask ) {
+            _dropped.fetch_add( 1, std::memory_order_relaxed );
+            return false;
+        }
+        _records[head & _mask] =r;
+        _head.store( head + 1, std::memory_order_release );
+        return true;
+    }
+
+    int pop( Record* out, int max );
+
+    int capacity() const { return (int)_mask + 1; }
+    quint64 dropped() const { return _dropped.load( std::memory_order_relaxed ); }
+
+private:
+    Record* _records;
+    quint64 _mask;
+    // Head and tail are written by different threads, so keep them on separate cache lines
+    alignas(64) std::atomic<quint64> _head;
+    alignas(64) std::atomic<quint64> _tail;
+    alignas(64) std::atomic<quint64> _dropped;
+};
+
+/** Drains a TraceBuffer in the background and writes it to a file in the Chrome trace
+ *  event format, which can be opened in chrome://tracing or Perfetto. */
+class TraceWriter : public QThread {
+    Q_OBJECT
+public:
+    TraceWriter( TraceBuffer*, const QString& path, QObject* parent =0 );
+    ~TraceWriter();
+
+    bool open( QString* error =nullptr );
+    void stop();
+
+    void run() override;
+
+private:
+    void drain();
+    void write( const TraceBuffer::Record& );
+
+    TraceBuffer* _buffer;
+    QFile _file;
+    QSet<qint32> _tracks;       // Tracks for which the name of the row has been written
+};
@@ -0,0 +1,233 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "voicetable.h"
+#include <QtAlgorithms>
+
+static const VoiceTable::Voice nullVoice ={ -1, 0, 0, 0, 0, 0, 0 };
+
+VoiceTable::VoiceTable() :
+    _free( -1 ),
+    _count( 0 ),
+    _portLimit( 0 ),
+    _policy( StealOldest ),
+    _stolen( 0 ),
+    _dropped( 0 ),
+    _suppressed( 0 ) {
+
+    const List empty ={ -1, -1 };
+    for( auto& l : _channelAge ) l =empty;
+    for( auto& l : _keys ) l =empty;
+    for( auto& l : _channelLevels ) l =empty;
+    for( auto& l : _portLevels ) l =empty;
+    _portAge =empty;
+
+    for( int c =0; c < Channels; c++ ) {
+        _channelLevelMask[c][0] =_channelLevelMask[c][1] =0;
+        _channelCount[c] =0;
+        _channelLimit[c] =0;
+    }
+    _portLevelMask[0] =_portLevelMask[1] =0;
+
+    // All entries start out on the free list, which is linked through the first list
+    _entries.resize( Capacity );
+    for( int i =Capacity-1; i >= 0; i-- ) {
+        _entries[i].voice =nullVoice;
+        _entries[i].links[0].next =_free;
+        _free =i;
+    }
+}
+
+VoiceTable::~VoiceTable() { }
+
+/** Prepare the per-track lists for @n tracks. All voices are forgotten. */
+void
+VoiceTable::setTrackCount( int n ) {
+    releaseAll( []( const Voice& ) {} );
+    _owners.fill( List { -1, -1 }, n );
+}
+
+void
+VoiceTable::setChannelLimit( int channel, int limit ) {
+    if( channel < 0 || channel >= Channels ) return;
+    _channelLimit[channel] =qMax( 0, limit );
+}
+
+void
+VoiceTable::setPortLimit( int limit ) {
+    _portLimit =qMax( 0, limit );
+}
+
+/** Start a voice for @note on @channel, played by @track.
+ *  If a limit is reached, either another voice is released (and copied to @stolen, so the
+ *  caller can send its NoteOff) or the new note is dropped, depending on the policy.
+ *  A voice that stands for several identical NoteOns has @refs > 1 and is only released by
+ *  as many NoteOffs; @borrowed of those come from other tracks than @track. */
+VoiceTable::Result
+VoiceTable::noteOn( int track, int channel, int note, int velocity, qint64 time, Voice* stolen,
+                    int refs, int borrowed ) {
+    if( channel < 0 || channel >= Channels || note < 0 || note >= Notes
+        || track < 0 || track >= _owners.count() ) {
+        _dropped++;
+        return Dropped;
+    }
+
+    Result result =Started;
+    const bool channelFull =_channelLimit[channel] != 0 && _channelCount[channel] >= _channelLimit[channel];
+    const bool portFull =(_portLimit != 0 && _count >= _portLimit) || _free == -1;
+    if( channelFull || portFull ) {
+        if( _policy == DropNew ) {
+            _dropped++;
+            return Dropped;
+        }
+        // A voice from the full channel also frees a place on the port
+        const int i =victim( channelFull ? channel : -1 );
+        if( i == -1 ) {
+            _dropped++;
+            return Dropped;
+        }
+        if( stolen ) *stolen =_entries[i].voice;
+        release( i );
+        _stolen++;
+        result =Stolen;
+    }
+
+    const int i =_free;
+    _free =_entries[i].links[0].next;
+
+    Voice& v =_entries[i].voice;
+    v.track =track;
+    v.channel =channel;
+    v.note =note;
+    v.velocity =qBound( 0, velocity, Notes-1 );
+    v.time =time;
+    v.refs =qMax( 1, refs );
+    v.borrowed =qBound( 0, borrowed, v.refs - 1 );
+    for( int k =0; k < ListCount; k++ )
+        append( k, i );
+
+    _channelCount[channel]++;
+    _count++;
+    return result;
+}
+
+/** Release a reference to the voice of @note on @channel that was started by @track, or
+ *  else one that @track shares with another track. Returns true if the voice was released
+ *  and a NoteOff should be sent. This is not the case if there is no voice (e.g. because it
+ *  was stolen) or if other references to it remain. */
+bool
+VoiceTable::noteOff( int track, int channel, int note ) {
+    if( channel < 0 || channel >= Channels || note < 0 || note >= Notes ) return false;
+
+    // Only voices of this very note on this channel are visited, oldest first
+    const List& key =_keys[channel * Notes + note];
+    int shared =-1;
+    for( int i =key.head; i != -1; i =_entries[i].links[Key].next ) {
+        Voice& v =_entries[i].voice;
+        if( v.track == track && v.refs > v.borrowed )
+            return unref( i, false );
+        if( shared == -1 && v.track != track && v.borrowed > 0 ) shared =i;
+    }
+    if( shared != -1 ) return unref( shared, true );
+    return false;
+}
+
+/** Drop one reference to the voice in entry @i and release it if it was the last one */
+bool
+VoiceTable::unref( int i, bool borrowed ) {
+    Voice& v =_entries[i].voice;
+    if( borrowed ) v.borrowed--;
+    if( --v.refs > 0 ) {
+        _suppressed++;
+        return false;
+    }
+    release( i );
+    return true;
+}
+
+VoiceTable::List&
+VoiceTable::list( int kind, const Voice& v ) {
+    switch( kind ) {
+    case ChannelAge:   return _channelAge[v.channel];
+    case PortAge:      return _portAge;
+    case Key:          return _keys[v.channel * Notes + v.note];
+    case Owner:        return _owners[v.track];
+    case ChannelLevel: return _channelLevels[v.channel * Notes + v.velocity];
+    case PortLevel:
+    default:           return _portLevels[v.velocity];
+    }
+}
+
+/** Append entry @i to the end of its list of @kind */
+void
+VoiceTable::append( int kind, int i ) {
+    const Voice& v =_entries[i].voice;
+    List& l =list( kind, v );
+    Link& link =_entries[i].links[kind];
+
+    if( l.head == -1 ) {
+        // The level lists are found through a bit mask
+        if( kind == ChannelLevel ) _channelLevelMask[v.channel][v.velocity >> 6] |= 1ull << (v.velocity & 63);
+        if( kind == PortLevel ) _portLevelMask[v.velocity >> 6] |= 1ull << (v.velocity & 63);
+    }
+    link.prev =l.tail;
+    link.next =-1;
+    if( l.tail != -1 ) _entries[l.tail].links[kind].next =i;
+    else l.head =i;
+    l.tail =i;
+}
+
+/** Remove entry @i from its list of @kind */
+void
+VoiceTable::unlink( int kind, int i ) {
+    const Voice& v =_entries[i].voice;
+    List& l =list( kind, v );
+    const Link& link =_entries[i].links[kind];
+
+    if( link.prev != -1 ) _entries[link.prev].links[kind].next =link.next;
+    else l.head =link.next;
+    if( link.next != -1 ) _entries[link.next].links[kind].prev =link.prev;
+    else l.tail =link.prev;
+
+    if( l.head == -1 ) {
+        if( kind == ChannelLevel ) _channelLevelMask[v.channel][v.velocity >> 6] &= ~(1ull << (v.velocity & 63));
+        if( kind == PortLevel ) _portLevelMask[v.velocity >> 6] &= ~(1ull << (v.velocity & 63));
+    }
+}
+
+/** Remove the voice in entry @i from all lists and return the entry to the pool */
+void
+VoiceTable::release( int i ) {
+    for( int k =0; k < ListCount; k++ )
+        unlink( k, i );
+    const Voice& v =_entries[i].voice;
+    _channelCount[v.channel]--;
+    _count--;
+
+    _entries[i].voice =nullVoice;
+    _entries[i].links[0].next =_free;
+    _free =i;
+}
+
+/** Return the voice to steal from @channel, or from the whole port if it is -1 */
+int
+VoiceTable::victim( int channel ) const {
+    if( _policy == StealQuietest ) {
+        const int level =lowestLevel( channel == -1 ? _portLevelMask : _channelLevelMask[channel] );
+        if( level == -1 ) return -1;
+        return channel == -1 ? _portLevels[level].head : _channelLevels[channel * Notes + level].head;
+    }
+    return channel == -1 ? _portAge.head : _channelAge[channel].head;
+}
+
+/** Return the lowest velocity that is set in @mask, or -1 */
+int
+VoiceTable::lowestLevel( const quint64* mask ) const {
+    if( mask[0] ) return qCountTrailingZeroBits( mask[0] );
+    if( mask[1] ) return 64 + qCountTrailingZeroBits( mask[1] );
+    return -1;
+}
@@ -0,0 +1,135 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QtGlobal>
+#include <QVector>
+
+/** Keeps track of the notes that are sounding on a MIDI port and limits their number.
+ *
+ * Every sounding note (a voice) is stored once in a fixed pool and is linked into several
+ * intrusive lists at the same time: per channel and per port in order of age, per channel
+ * and per port by velocity, per channel/note pair and per track. This makes starting,
+ * releasing and stealing a voice O(1), and finding the voice a NoteOff belongs to
+ * proportional to the number of voices that play the very same note on the same channel.
+ * Nothing is allocated while playing, apart from setTrackCount() which is called when
+ * a composition is loaded.
+ */
+class VoiceTable {
+public:
+    enum Policy {
+        StealOldest,            // Release the voice that was started first
+        StealQuietest,          // Release the voice with the lowest velocity (the oldest of those)
+        DropNew                 // Do not play the new note
+    };
+
+    enum Result {
+        Started,
+        Stolen,                 // Started, after releasing another voice
+        Dropped
+    };
+
+    enum {
+        Channels =16,
+        Notes =128,
+        Capacity =4096          // Maximum number of voices, whatever the limits
+    };
+
+    struct Voice {
+        int track;              // Index of the track that started the voice
+        qint8 channel, note, velocity;
+        qint64 time;            // Time the voice was started
+        int refs;               // Number of NoteOns this voice stands for (see EventQueue::coalesce())
+        int borrowed;           // Of which played by other tracks
+    };
+
+    VoiceTable();
+    ~VoiceTable();
+
+    void setTrackCount( int );
+
+    // A limit of 0 means no limit, other than the capacity of the table
+    void setChannelLimit( int channel, int limit );
+    int channelLimit( int channel ) const { return _channelLimit[channel]; }
+    void setPortLimit( int limit );
+    int portLimit() const { return _portLimit; }
+
+    void setPolicy( Policy p ) { _policy =p; }
+    Policy policy() const { return _policy; }
+
+    Result noteOn( int track, int channel, int note, int velocity, qint64 time, Voice* stolen,
+                   int refs =1, int borrowed =0 );
+    bool noteOff( int track, int channel, int note );
+
+    /** Release all voices of @track and call @f for each of them */
+    template<typename F> void releaseTrack( int track, F f ) {
+        if( track < 0 || track >= _owners.count() ) return;
+        while( _owners[track].head != -1 ) {
+            const int i =_owners[track].head;
+            const Voice v =_entries[i].voice;
+            release( i );
+            f( v );
+        }
+    }
+
+    /** Release all voices and call @f for each of them */
+    template<typename F> void releaseAll( F f ) {
+        while( _portAge.head != -1 ) {
+            const int i =_portAge.head;
+            const Voice v =_entries[i].voice;
+            release( i );
+            f( v );
+        }
+    }
+
+    int count() const { return _count; }
+    int channelCount( int channel ) const { return _channelCount[channel]; }
+    quint64 stolenCount() const { return _stolen; }
+    quint64 droppedCount() const { return _dropped; }
+    quint64 suppressedCount() const { return _suppressed; }
+
+private:
+    enum ListKind {
+        ChannelAge, PortAge, Key, Owner, ChannelLevel, PortLevel,
+        ListCount
+    };
+    struct Link { int prev, next; };
+    struct List { int head, tail; };
+    struct Entry {
+        Voice voice;
+        Link links[ListCount];
+    };
+
+    List& list( int kind, const Voice& );
+    void append( int kind, int i );
+    void unlink( int kind, int i );
+    void release( int i );
+    bool unref( int i, bool borrowed );
+    int victim( int channel ) const;
+    int lowestLevel( const quint64* mask ) const;
+
+    QVector<Entry> _entries;
+    int _free;                  // Head of the list of unused entries
+
+    List _channelAge[Channels];
+    List _portAge;
+    List _keys[Channels * Notes];
+    List _channelLevels[Channels * Notes];
+    List _portLevels[Notes];
+    QVector<List> _owners;
+    // One bit per velocity, set if the level list is not empty
+    quint64 _channelLevelMask[Channels][2];
+    quint64 _portLevelMask[2];
+
+    int _channelCount[Channels];
+    int _count;
+    int _channelLimit[Channels];
+    int _portLimit;
+    Policy _policy;
+    quint64 _stolen, _dropped, _suppressed;
+};
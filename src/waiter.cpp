@@ -0,0 +1,98 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#include "waiter.h"
+
+#ifdef Q_OS_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+Waiter::Waiter() :
+    _epoll( -1 ),
+    _timer( -1 ),
+    _event( -1 ) {
+#ifdef Q_OS_LINUX
+    _timer =timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    _event =eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( _timer < 0 || _event < 0 ) goto ERROR;
+    _epoll =epoll_create1( EPOLL_CLOEXEC );
+    if( _epoll < 0 ) goto ERROR;
+    {
+        struct epoll_event ev;
+        ev.events =EPOLLIN;
+        ev.data.fd =_timer;
+        if( epoll_ctl( _epoll, EPOLL_CTL_ADD, _timer, &ev ) != 0 ) goto ERROR;
+        ev.data.fd =_event;
+        if( epoll_ctl( _epoll, EPOLL_CTL_ADD, _event, &ev ) != 0 ) goto ERROR;
+    }
+    return;
+ERROR:
+    // Fall back to the semaphore
+    if( _epoll >= 0 ) close( _epoll );
+    if( _timer >= 0 ) close( _timer );
+    if( _event >= 0 ) close( _event );
+    _epoll =_timer =_event =-1;
+#endif
+}
+
+Waiter::~Waiter() {
+#ifdef Q_OS_LINUX
+    if( _epoll >= 0 ) {
+        close( _epoll );
+        close( _timer );
+        close( _event );
+    }
+#endif
+}
+
+void
+Waiter::wait( const QElapsedTimer& timer, qint64 until ) {
+    const qint64 timeout =until < 0 ? -1 : until - timer.nsecsElapsed();
+    if( until >= 0 && timeout <= 0 ) return;
+
+#ifdef Q_OS_LINUX
+    if( _epoll >= 0 ) {
+        // An all-zero time disarms the timer, which is what waiting without a deadline needs
+        struct itimerspec spec ={};
+        if( timeout > 0 ) {
+            spec.it_value.tv_sec =timeout / 1000000000;
+            spec.it_value.tv_nsec =timeout % 1000000000;
+        }
+        timerfd_settime( _timer, 0, &spec, nullptr );
+
+        struct epoll_event ev[2];
+        // Interrupted waits return as well, the caller checks what there is to do anyway
+        epoll_wait( _epoll, ev, 2, -1 );
+
+        // Reset both descriptors, so the next wait does not return right away
+        quint64 count;
+        while( read( _event, &count, sizeof( count ) ) > 0 ) {}
+        while( read( _timer, &count, sizeof( count ) ) > 0 ) {}
+        return;
+    }
+#endif
+    if( timeout < 0 )
+        _semaphore.acquire();
+    else
+        _semaphore.tryAcquire( 1, (int)((timeout + 999999) / 1000000) );
+}
+
+void
+Waiter::wake() {
+#ifdef Q_OS_LINUX
+    if( _epoll >= 0 ) {
+        const quint64 one =1;
+        // Only fails when the counter would overflow, and then the thread is woken already
+        if( write( _event, &one, sizeof( one ) ) < 0 ) {}
+        return;
+    }
+#endif
+    _semaphore.release();
+}
@@ -0,0 +1,39 @@
+/*
+ * MidiTrain -- MIDI sequencer and visualizer based on a train-inspired musical notation
+ *
+ * Author: Micky Faas <micky@edukitty.org>
+ * This work is released under the MIT license
+ */
+
+#pragma once
+
+#include <QtGlobal>
+#include <QElapsedTimer>
+#include <QSemaphore>
+
+/** Puts a thread to sleep until a deadline, or until another thread wakes it up.
+ *
+ * On Linux, the thread blocks in epoll on a timerfd that is armed with the deadline in nsec
+ * and an eventfd that wake() writes to, so it can sleep without any timeout at all and a
+ * wakeup costs one system call on either side. Elsewhere, or if the descriptors cannot be
+ * created, a semaphore is used, which has msec resolution.
+ */
+class Waiter {
+public:
+    Waiter();
+    ~Waiter();
+
+    // Whether the deadline is kept in nsec, with timerfd and epoll
+    bool isPrecise() const { return _epoll >= 0; }
+
+    /** Sleep until @until (nsec on @timer), or without a deadline if it is negative.
+     *  Returns early when wake() is called, or right away if it was called since the last wait. */
+    void wait( const QElapsedTimer& timer, qint64 until );
+
+    /** Wake up the waiting thread. Can be called from any thread and never blocks. */
+    void wake();
+
+private:
+    int _epoll, _timer, _event;
+    QSemaphore _semaphore;      // Used when there is no epoll
+};